@@ -1,187 +1,188 @@
 
+#include "WsSession.hpp"
+#include "eps_common/Codec.hpp"
 #include "eps_common/CommandLineInterface.hpp"
+#include "eps_common/Compression.hpp"
 #include "eps_common/Protocol.hpp"
 #include "eps_common/definitions.hpp"
 
-#include <boost/asio/strand.hpp>
-#include <boost/beast/core.hpp>
-#include <boost/beast/ssl.hpp>
-#include <boost/beast/websocket.hpp>
-#include <boost/beast/websocket/ssl.hpp>
 #include <semver.hpp>
 
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <format>
-#include <fstream>
 #include <functional>
 #include <iostream>
-#include <latch>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
 
-namespace beast = boost::beast;         // from <boost/beast.hpp>
-namespace http = beast::http;           // from <boost/beast/http.hpp>
-namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
-namespace net = boost::asio;            // from <boost/asio.hpp>
-namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
 namespace fs = std::filesystem;
-using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
 namespace eps {
 
-// Report a failure
-void fail(beast::error_code ec, char const *what) {
-    std::cerr << what << ": " << ec.message() << "\n";
-}
-
 /**
- * Implements a client to connect to a Webservice using SSL
- *
- * @note: This implementation is a fork from the Boost example. Here:
- *        https://www.boost.org/doc/libs/1_70_0/libs/beast/example/websocket/client/async-ssl/websocket_client_async_ssl.cpp
+ * Implements an interactive client to connect to a Webservice using SSL
  */
-class Client : public std::enable_shared_from_this<Client> {
+class Client : public WsSession {
 public:
-    explicit Client(net::io_context &ioc, ssl::context &ctx)
-        : version_{semver::version{defs::kInitialClientVersion}}
-        , resolver_{net::make_strand(ioc)}
-        , ws_{net::make_strand(ioc), ctx} {
+    explicit Client(net::io_context &ioc, ssl::context &ctx,
+                    proto::WireFormat format = proto::WireFormat::Json,
+                    proto::CompressionSettings compression = {},
+                    ReconnectSettings reconnect = {})
+        : WsSession{ioc, ctx, format, compression, reconnect}
+        , version_{semver::version{defs::kInitialClientVersion}}
+        , versionText_{version_.value.to_string()} {
 
         init();
     }
 
-    // Start the asynchronous operation
-    void run(std::string_view host, int port) {
-        host_ = host.data();
-        port_ = port;
-        auto const strPort = std::to_string(port);
-
-        // Look up the domain name
-        resolver_.async_resolve(host, strPort,
-                                beast::bind_front_handler(&Client::onResolve, shared_from_this()));
-    }
-
 private:
-    void onResolve(beast::error_code ec, tcp::resolver::results_type results) {
-        if (ec) {
-            return fail(ec, "resolve");
+    void onOpen() override {
+        // Once per connection, the server keeps what it says for the next messages
+        write(makeHelloRequest(),
+              [this](proto::Message &&response) { onHello(std::move(response)); });
+
+        if (!cmdLineIfaceThr_.joinable()) {
+            cmdLineIfaceThr_ =
+                std::jthread([this](std::stop_token stopToken) { runCLI(stopToken); });
+            return;
         }
-        // Set a timeout on the operation
-        beast::get_lowest_layer(ws_).expires_after(std::chrono::seconds(30));
-
-        // Make the connection on the IP address we get from a lookup
-        beast::get_lowest_layer(ws_).async_connect(
-            results, beast::bind_front_handler(&Client::onConnect, shared_from_this()));
+        std::cout << std::format("\n\nReconnected ({} TLS handshake)\n\n",
+                                 resumed_ ? "resumed" : "full");
     }
 
-    void onConnect(beast::error_code ec, tcp::resolver::results_type::endpoint_type) {
-        if (ec) {
-            return fail(ec, "connect");
-        }
-        // Set a timeout on the operation
-        beast::get_lowest_layer(ws_).expires_after(std::chrono::seconds(30));
+    /**
+     * A catalog published while the client was away is fetched right away
+     */
+    void onHello(proto::Message &&response) {
+        auto const serverHash = proto::stringEntry(response.payload, proto::keys::kHash);
 
-        // Perform the SSL handshake
-        ws_.next_layer().async_handshake(
-            ssl::stream_base::client,
-            beast::bind_front_handler(&Client::onSSLHandshake, shared_from_this()));
+        if (response.type != proto::MessageType::Accepted) {
+            std::ignore = messageHandler_.process(std::move(response));
+        }
+        if (!hash_.empty() && serverHash && *serverHash != hash_) {
+            requestUpdates();
+        }
     }
 
-    void onSSLHandshake(beast::error_code ec) {
-        if (ec) {
-            return fail(ec, "ssl_handshake");
+    void onMessage(proto::Message &&message) override {
+        if (auto const response = messageHandler_.process(std::move(message)); response) {
+            write(response.value());
         }
-        // Turn off the timeout on the tcp_stream, because
-        // the websocket stream has its own timeout system.
-        beast::get_lowest_layer(ws_).expires_never();
-
-        // Set suggested timeout settings for the websocket
-        ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
-
-        // Set a decorator to change the User-Agent of the handshake
-        ws_.set_option(websocket::stream_base::decorator([](websocket::request_type &req) {
-            req.set(http::field::user_agent,
-                    std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-async-ssl");
-        }));
+    }
 
-        // Perform the websocket handshake
-        ws_.async_handshake(host_, "/ws",
-                            beast::bind_front_handler(&Client::onHandshake, shared_from_this()));
+    void onBadFrame(std::exception const &ex) override {
+        // TODO: log the error but do nothing. The server should not send any malformed message.
     }
 
-    void onHandshake(beast::error_code ec) {
-        if (ec) {
-            return fail(ec, "handshake");
+    void onClosed() override {
+        if (!reconnects()) {
+            std::cout << "\n\nThe connection is closed, enter 0 to quit.\n\n";
         }
-        std::latch workersLatch{1U};
-        cmdLineIfaceThr_ =
-            std::jthread([&](std::stop_token stopToken) { runCLI(stopToken, workersLatch); });
-        wsInteractionThr_ = std::jthread([&](std::stop_token stopToken) { mainLoop(stopToken); });
-        workersLatch.wait();
     }
 
-    void mainLoop(std::stop_token stopToken) {
-        beast::flat_buffer b;
+    void onReconnecting(std::chrono::milliseconds delay) override {
+        std::cout << std::format("\n\nThe connection is lost, reconnecting in {}ms\n\n",
+                                 delay.count());
+    }
 
-        while (!stopToken.stop_requested()) {
-            ws_.read(b);
-            try {
-                nlohmann::json const dataJson =
-                    nlohmann::json::parse(beast::buffers_to_string(b.data()));
-                b.clear();
-                auto received = proto::toMessage(dataJson);
-
-                if (auto const response = messageHandler_.process(std::move(received)); response) {
-                    ws_.write(net::buffer(proto::toString(response.value())));
-                }
-            } catch (nlohmann::json::exception const &ex) {
-                // TODO: log the error but do nothing. The server should not send any malformed
-                // message.
-            }
+    /**
+     * Runs a request on the strand, where the state of the client lives. The CLI thread never
+     * touches the stream nor the state itself, so it does not wait for the network.
+     */
+    void onStrand(void (Client::*request)()) {
+        if (auto session = weak_from_this().lock(); session) {
+            net::post(strand_, [self = std::static_pointer_cast<Client>(session), request] {
+                (self.get()->*request)();
+            });
         }
     }
 
-    void runCLI(std::stop_token stopToken, std::latch &workersLatch) {
+    void runCLI(std::stop_token stopToken) {
         std::string const strPort = std::to_string(port_);
         cmdLineIface_
-            .option(
-                {.label = "Check the server version", .action = [&] { requestServerVersion(); }})
-            .option({.label = "Get updates", .action = [&] { requestUpdates(); }})
-            .option({.label = "Push settings changes", .action = [&] { requestPushSettings(); }});
+            .option({.label = "Check the server version",
+                     .action = [&] { onStrand(&Client::requestServerVersion); }})
+            .option({.label = "Get updates", .action = [&] { onStrand(&Client::requestUpdates); }})
+            .option({.label = "Push settings changes",
+                     .action = [&] { onStrand(&Client::requestPushSettings); }})
+            .option({.label = "Catch up: version, updates and settings in one batch",
+                     .action = [&] { onStrand(&Client::requestCatchUp); }})
+            .option({.label = "Send sample values",
+                     .action = [&] { onStrand(&Client::sendSamples); }})
+            .option({.label = "Query the last minute of the metrics",
+                     .action = [&] { onStrand(&Client::requestAggregates); }});
 
         while (!stopToken.stop_requested()) {
             auto const title = std::string{std::format("[MENU] Client (v{}) connected to {}:{}",
-                                                       version_.value.to_string(), host_, strPort)};
+                                                       versionText(), host_, strPort)};
 
             if (!cmdLineIface_.tryToExecuteAction(title)) {
                 std::cout << "\n\nShutdown has been requested, bye!\n\n";
                 break;
             }
         }
-        workersLatch.count_down();
+        shutdown();
+    }
+
+    std::string versionText() const {
+        std::lock_guard<std::mutex> _{versionTextMtx_};
+        return versionText_;
     }
 
     void init() {
         messageHandler_
             .onVersionUpdatesAvailable([&](proto::Message &&message) {
-                auto const strVersion = message.payload[proto::keys::kVersion].get<std::string>();
-                std::cout << "\n\n**Attention** A new version is available: " << strVersion << "\n";
+                std::cout << "\n\n**Attention** A new version is available: "
+                          << message.version.value_or("unknown") << "\n";
                 return std::nullopt;
             })
             .onUpdates([&](proto::Message &&message) {
                 // Should check better if the metrics we are receiving are valid but let's trust in
                 // our server to make things easier
-                metrics_.clear();
-
-                auto const strVersion = message.payload[proto::keys::kVersion].get<std::string>();
-                version_.value = semver::version{strVersion};
+                if (!message.version || !message.metrics) {
+                    return std::nullopt;
+                }
+                auto const base = proto::stringEntry(message.payload, proto::keys::kBase);
+
+                if (base) {
+                    // A delta only applies on top of the catalog it was computed from
+                    if (*base != hash_) {
+                        return std::nullopt;
+                    }
+                    if (auto removed = message.payload.find(proto::keys::kRemoved);
+                        removed != message.payload.end() && removed->is_array()) {
+                        for (auto const &name : *removed) {
+                            metrics_.erase(name.get<std::string>());
+                        }
+                    }
+                } else {
+                    metrics_.clear();
+                }
+                version_.value = semver::version{*message.version};
+                {
+                    std::lock_guard<std::mutex> _{versionTextMtx_};
+                    versionText_ = *message.version;
+                }
+                hash_ = proto::stringEntry(message.payload, proto::keys::kHash).value_or("");
 
-                for (auto &&m : message.payload[proto::keys::kMetrics]) {
-                    proto::Metric metric = m;
-                    metrics_.emplace(std::make_pair(metric.name, std::move(metric)));
+                for (auto &&metric : *message.metrics) {
+                    metrics_.insert_or_assign(metric.name, std::move(metric));
                 }
-                std::cout << "\n\nThe metrics has been updated\n\n";
+                std::cout << std::format("\n\nThe metrics has been updated ({})\n\n",
+                                         base ? "delta" : "full catalog");
+                return std::nullopt;
+            })
+            .onNotModified([&](proto::Message &&message) {
+                std::cout << "\n\nThe metrics are up to date\n\n";
                 return std::nullopt;
             })
             .onBadRequest([&](proto::Message &&message) {
@@ -194,47 +195,163 @@ private:
                 return std::nullopt;
             })
             .onAccepted([&](proto::Message &&message) {
+                if (auto const rejected = message.payload.find(proto::keys::kRejected);
+                    message.payload.is_object() && rejected != message.payload.end()) {
+                    std::cout << std::format("\n\nSome samples were rejected: {}\n\n",
+                                             rejected->dump());
+                    return std::nullopt;
+                }
                 std::cout << "\n\nYour last request was accepted!\n\n";
                 return std::nullopt;
+            })
+            .onAggregates([&](proto::Message &&message) {
+                std::cout << std::format("\n\n{}\n\n", message.payload.dump());
+                return std::nullopt;
+            })
+            .onBatch([&](proto::Message &&batch) {
+                // The responses come in the order of the requests, each handled on its own
+                for (auto &&item : proto::unbatch(std::move(batch))) {
+                    if (item.message) {
+                        std::ignore = messageHandler_.process(std::move(*item.message));
+                    }
+                }
+                return std::nullopt;
             });
     }
 
-    void requestServerVersion() {
-        nlohmann::json data = nlohmann::json::object();
-        data[proto::keys::kVersion] = version_.value.to_string();
+    void requestServerVersion() { write(makeVersionRequest()); }
+
+    void requestUpdates() { write(makeUpdatesRequest()); }
+
+    void requestPushSettings() { write(makePushSettingsRequest()); }
+
+    /**
+     * Everything a client coming back online asks for, in a single frame
+     */
+    void requestCatchUp() {
+        write(proto::Message{.type = proto::MessageType::Batch,
+                             .messages = std::vector<proto::Message>{
+                                 makeVersionRequest(), makeUpdatesRequest(),
+                                 makePushSettingsRequest()}});
+    }
+
+    /**
+     * Sends a few random values for every metric the client knows, the way an endpoint reports
+     */
+    void sendSamples() {
+        using namespace std::chrono;
+
+        static constexpr std::size_t kSamplesCount = 10;
+        auto const now = duration_cast<microseconds>(system_clock::now().time_since_epoch());
+        std::uniform_real_distribution<double> ratio{0.0, 1.0};
+        proto::Message request{.type = proto::MessageType::Ingest,
+                               .series = std::vector<proto::Series>{}};
+
+        for (auto &&[name, metric] : metrics_) {
+            auto &series = request.series->emplace_back(proto::Series{.metric = name});
+
+            for (std::size_t i = 0; i < kSamplesCount; ++i) {
+                // One value per second up to now
+                series.times.push_back((now - seconds{kSamplesCount - 1 - i}).count());
+
+                switch (metric.type) {
+                case proto::MetricType::Integer:
+                    series.integers.push_back(static_cast<int64_t>(ratio(random_) * 100));
+                    break;
+                case proto::MetricType::Double:
+                    series.doubles.push_back(ratio(random_));
+                    break;
+                case proto::MetricType::String:
+                    series.strings.push_back(std::format("sample {}", i));
+                    break;
+                }
+            }
+        }
+        write(request);
+    }
+
+    /**
+     * One Query per numeric metric, in as few batches as the server takes
+     */
+    void requestAggregates() {
+        proto::Message batch{.type = proto::MessageType::Batch,
+                             .messages = std::vector<proto::Message>{}};
+
+        for (auto &&[name, metric] : metrics_) {
+            if (metric.type == proto::MetricType::String) {
+                continue;
+            }
+            proto::Message query{.type = proto::MessageType::Query};
+            query.payload[proto::keys::kMetric] = name;
+            query.payload[proto::keys::kWindow] = 60;
+            query.payload[proto::keys::kPercentiles] = {50, 90, 99};
+            batch.messages->push_back(std::move(query));
+
+            if (batch.messages->size() == proto::kMaxBatchSize) {
+                write(batch);
+                batch.messages->clear();
+            }
+        }
+        if (!batch.messages->empty()) {
+            write(batch);
+        }
+    }
+
+    proto::Message makeHelloRequest() const {
+        proto::Message request{.type = proto::MessageType::Hello,
+                               .version = version_.value.to_string()};
+
+        if (!hash_.empty()) {
+            request.payload[proto::keys::kHash] = hash_;
+        }
+        return request;
+    }
 
-        proto::Message request{.type = proto::MessageType::Version, .payload = data};
-        ws_.write(net::buffer(proto::toString(request)));
+    proto::Message makeVersionRequest() const {
+        return proto::Message{.type = proto::MessageType::Version,
+                              .version = version_.value.to_string()};
     }
 
-    void requestUpdates() {
+    proto::Message makeUpdatesRequest() const {
         proto::Message request{.type = proto::MessageType::GetUpdates};
-        ws_.write(net::buffer(proto::toString(request)));
+
+        if (!hash_.empty()) {
+            request.payload[proto::keys::kHash] = hash_;
+        }
+        return request;
     }
 
-    void requestPushSettings() {
-        proto::Message request{.type = proto::MessageType::PushSettings};
-        nlohmann::json metricsArray = nlohmann::json::array();
+    proto::Message makePushSettingsRequest() const {
+        proto::Message request{.type = proto::MessageType::PushSettings,
+                               .version = version_.value.to_string()};
+
+        // The server validates a known catalog by its hash alone
+        if (!hash_.empty()) {
+            request.payload[proto::keys::kHash] = hash_;
+        } else {
+            request.metrics.emplace();
+            request.metrics->reserve(metrics_.size());
 
-        for (auto &&[k, m] : metrics_) {
-            metricsArray.push_back(m);
+            for (auto &&[k, m] : metrics_) {
+                request.metrics->push_back(m);
+            }
         }
-        request.payload[proto::keys::kMetrics] = metricsArray;
-        request.payload[proto::keys::kVersion] = version_.value.to_string();
-        ws_.write(net::buffer(proto::toString(request)));
+        return request;
     }
 
+    // The state below is only touched on the strand, except versionText_
     proto::Version version_;
-    tcp::resolver resolver_;
-    websocket::stream<beast::ssl_stream<beast::tcp_stream>> ws_;
-    beast::flat_buffer buffer_;
     proto::MessageHandler messageHandler_;
+    proto::metrics_umap_t metrics_ = proto::kMetricsDefault;
+    // Hash of the server catalog metrics_ was synced with, empty until the first Updates
+    std::string hash_;
+    std::minstd_rand random_{std::random_device{}()};
+    // Copy of the version for the CLI menu
+    mutable std::mutex versionTextMtx_;
+    std::string versionText_;
     CommandLineInterface cmdLineIface_;
-    std::jthread wsInteractionThr_;
+    // Last, so it is joined before the members it uses go away
     std::jthread cmdLineIfaceThr_;
-    proto::metrics_umap_t metrics_ = proto::kMetricsDefault;
-    std::string host_;
-    int port_;
 };
 
 } // namespace eps
@@ -0,0 +1,448 @@
+
+#pragma once
+
+#include "WsSession.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/LatencyHistogram.hpp"
+#include "eps_common/Protocol.hpp"
+#include "eps_common/definitions.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace eps {
+
+//--------------------------------------------------------------------------------
+// Profile / Report
+//--------------------------------------------------------------------------------
+
+// Requests the load generator sends, the mix weights and the report follow this order
+static constexpr std::array kLoadRequests = {
+    proto::MessageType::Version, proto::MessageType::GetUpdates, proto::MessageType::PushSettings,
+    proto::MessageType::Ingest};
+
+struct LoadProfile {
+    std::string host = "localhost";
+    int port = defs::ws::kPort;
+    std::size_t connections = 100;
+    // Requests per second over all the connections (open loop). With 0 every connection sends its
+    // next request as soon as the previous one is answered (closed loop)
+    double rate = 0;
+    std::chrono::seconds duration{10};
+    std::size_t threads = std::max(1U, std::thread::hardware_concurrency());
+    // Relative weights of the requests, in the order of kLoadRequests
+    std::array<unsigned, kLoadRequests.size()> mix{1, 1, 1, 0};
+    // Values sent for every metric of an Ingest request
+    std::size_t samples = 100;
+    proto::WireFormat format = proto::WireFormat::Json;
+    proto::CompressionSettings compression;
+};
+
+struct LoadReport {
+    std::size_t connected{0};
+    std::size_t failed{0};
+    uint64_t sent{0};
+    uint64_t received{0};
+    uint64_t errors{0};
+    // Open loop requests not sent because the connection had too many outstanding already, or
+    // its send queue was full
+    uint64_t dropped{0};
+    // The first failure, the others are usually the same
+    std::string firstError;
+    std::chrono::duration<double> elapsed{0};
+    LatencyHistogram latency;
+    std::array<LatencyHistogram, kLoadRequests.size()> latencyByRequest;
+
+    [[nodiscard]] double throughput() const {
+        return elapsed.count() > 0 ? static_cast<double>(received) / elapsed.count() : 0;
+    }
+};
+
+class LoadGenerator;
+
+//--------------------------------------------------------------------------------
+// Session
+//--------------------------------------------------------------------------------
+
+/**
+ * One connection of the load generator. Everything runs on the strand of the stream and the
+ * responses are matched with their requests by id, so they may come back in any order.
+ */
+class LoadSession : public WsSession {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    // Bound for the requests waiting for a response in open loop, so an overloaded server does not
+    // make the queues grow without limit
+    static constexpr std::size_t kMaxOutstanding = 1'024;
+
+    LoadSession(net::io_context &ioc, ssl::context &ctx, LoadProfile const &profile,
+                LoadGenerator &generator, unsigned seed);
+
+    /**
+     * Closes the connection once the outstanding requests are answered, from any thread
+     */
+    void stop() {
+        net::post(strand_, [self = self<LoadSession>()] {
+            self->stopping_ = true;
+            self->timer_.cancel();
+            self->closeWhenIdle();
+        });
+    }
+
+private:
+    void onOpen() override;
+
+    void onMessage(proto::Message &&response) override;
+
+    void onResponse(std::size_t request, clock_t::time_point sentAt,
+                    proto::Message &&response);
+
+    void onBadFrame(std::exception const &) override;
+
+    void onFailure(beast::error_code ec, char const *what) override;
+
+    void onClosed() override;
+
+    void onTick(beast::error_code ec) {
+        if (ec || stopping_) {
+            return;
+        }
+        if (inFlight() < kMaxOutstanding) {
+            // The latency counts from when the request was due, so a slow server cannot hide
+            // its queueing delay by slowing down the sender (coordinated omission)
+            sendRequest(pickRequest(), next_);
+        } else {
+            onDropped();
+        }
+        schedule();
+    }
+
+    void schedule() {
+        next_ += interval_;
+        timer_.expires_at(next_);
+        timer_.async_wait(beast::bind_front_handler(&LoadSession::onTick, self<LoadSession>()));
+    }
+
+    std::size_t pickRequest() { return pick_(random_); }
+
+    void sendRequest(std::size_t request, clock_t::time_point dueAt) {
+        // The session owns the callback, so it outlives it
+        auto const sent = write(makeRequest(kLoadRequests[request]),
+                                [this, request, dueAt](proto::Message &&m) {
+                                    onResponse(request, dueAt, std::move(m));
+                                });
+        if (sent) {
+            onSent();
+        } else {
+            onDropped();
+        }
+    }
+
+    void closeWhenIdle() {
+        if (stopping_ && inFlight() == 0) {
+            close();
+        }
+    }
+
+    proto::Message makeRequest(proto::MessageType type) const {
+        proto::Message request{.type = type};
+
+        if (type == proto::MessageType::GetUpdates || type == proto::MessageType::PushSettings) {
+            if (!hash_.empty()) {
+                request.payload[proto::keys::kHash] = hash_;
+            }
+        }
+        if (type == proto::MessageType::Version || type == proto::MessageType::PushSettings) {
+            request.version = defs::kInitialClientVersion;
+        }
+        if (type == proto::MessageType::Ingest) {
+            // The server stamps the values, a constant is enough to load the ingestion path
+            request.series.emplace();
+
+            for (auto &&[name, metric] : proto::kMetricsDefault) {
+                request.series->push_back(proto::Series{
+                    .metric = name, .doubles = std::vector<double>(profile_.samples, 0.5)});
+            }
+        }
+        if (type == proto::MessageType::PushSettings && hash_.empty()) {
+            request.metrics.emplace();
+
+            for (auto &&[k, m] : proto::kMetricsDefault) {
+                request.metrics->push_back(m);
+            }
+        }
+        return request;
+    }
+
+    void onSent();
+    void onDropped();
+
+    LoadProfile const &profile_;
+    LoadGenerator &generator_;
+    std::minstd_rand random_;
+    std::discrete_distribution<std::size_t> pick_;
+    net::steady_timer timer_;
+    clock_t::duration interval_{0};
+    clock_t::time_point next_;
+    // Hash of the last catalog received, sent back like the interactive client does
+    std::string hash_;
+    bool stopping_{false};
+};
+
+//--------------------------------------------------------------------------------
+// Generator
+//--------------------------------------------------------------------------------
+
+/**
+ * Opens the connections of a load profile over a pool of threads sharing one io_context, drives
+ * the requests for the duration of the profile and reports throughput and latencies.
+ *
+ * Every IO thread records into its own shard, so recording takes no lock and the shards are only
+ * merged into the report at the end.
+ */
+class LoadGenerator {
+public:
+    // Time given to the outstanding requests and to the closing handshakes after the run
+    static constexpr std::chrono::seconds kDrainTimeout{5};
+
+    LoadGenerator(LoadProfile profile, ssl::context &ctx)
+        : profile_{std::move(profile)}, ctx_{ctx}, shards_(profile_.threads) {}
+
+    LoadReport run() {
+        using namespace std::chrono_literals;
+        using clock_t = std::chrono::steady_clock;
+
+        net::io_context ioc{static_cast<int>(profile_.threads)};
+        std::vector<std::shared_ptr<LoadSession>> sessions;
+        sessions.reserve(profile_.connections);
+
+        for (std::size_t i = 0; i < profile_.connections; ++i) {
+            sessions.push_back(std::make_shared<LoadSession>(ioc, ctx_, profile_, *this,
+                                                             static_cast<unsigned>(i + 1)));
+            sessions.back()->run(profile_.host, profile_.port);
+        }
+        std::vector<std::jthread> workers;
+
+        for (auto &shard : shards_) {
+            workers.emplace_back([&ioc, &shard] {
+                currentShard_ = &shard;
+                ioc.run();
+            });
+        }
+        auto const start = clock_t::now();
+        auto previous = totals();
+
+        while (clock_t::now() - start < profile_.duration) {
+            std::this_thread::sleep_for(1s);
+            auto const current = totals();
+            std::cout << std::format("[{:>4}s] connections {} (failed {}) | sent {}/s, received "
+                                     "{}/s, errors {}\n",
+                                     std::chrono::duration_cast<std::chrono::seconds>(
+                                         clock_t::now() - start)
+                                         .count(),
+                                     connected_.load(), failed_.load(),
+                                     current.sent - previous.sent,
+                                     current.received - previous.received, current.errors);
+            previous = current;
+        }
+        auto const elapsed = clock_t::now() - start;
+
+        for (auto &session : sessions) {
+            session->stop();
+        }
+        for (auto const deadline = clock_t::now() + kDrainTimeout;
+             connected_.load() > 0 && clock_t::now() < deadline;) {
+            std::this_thread::sleep_for(10ms);
+        }
+        ioc.stop();
+        workers.clear();
+
+        LoadReport report{.connected = opened_.load(),
+                          .failed = failed_.load(),
+                          .firstError = firstError_,
+                          .elapsed = elapsed};
+        auto const counters = totals();
+        report.sent = counters.sent;
+        report.received = counters.received;
+        report.errors = counters.errors;
+        report.dropped = counters.dropped;
+
+        for (auto const &shard : shards_) {
+            for (std::size_t i = 0; i < kLoadRequests.size(); ++i) {
+                report.latency.merge(shard.latency[i]);
+                report.latencyByRequest[i].merge(shard.latency[i]);
+            }
+        }
+        return report;
+    }
+
+private:
+    friend class LoadSession;
+
+    struct Counters {
+        uint64_t sent{0};
+        uint64_t received{0};
+        uint64_t errors{0};
+        uint64_t dropped{0};
+    };
+
+    // Written by one IO thread, the counters are read by the reporting thread
+    struct alignas(64) Shard {
+        std::array<LatencyHistogram, kLoadRequests.size()> latency;
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    void onOpened() {
+        opened_.fetch_add(1, std::memory_order_relaxed);
+        connected_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onClosed() { connected_.fetch_sub(1, std::memory_order_relaxed); }
+
+    void onFailed(beast::error_code ec, char const *what, bool wasOpen) {
+        if (wasOpen) {
+            onError();
+        } else {
+            failed_.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> _{firstErrorMtx_};
+
+        if (firstError_.empty()) {
+            firstError_ = std::format("{}: {}", what, ec.message());
+        }
+    }
+
+    void onError() { currentShard_->errors.fetch_add(1, std::memory_order_relaxed); }
+
+    void onResponse(std::size_t request, LatencyHistogram::duration_t latency) {
+        currentShard_->latency[request].record(latency);
+        currentShard_->received.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Counters totals() const {
+        Counters counters;
+
+        for (auto const &shard : shards_) {
+            counters.sent += shard.sent.load(std::memory_order_relaxed);
+            counters.received += shard.received.load(std::memory_order_relaxed);
+            counters.errors += shard.errors.load(std::memory_order_relaxed);
+            counters.dropped += shard.dropped.load(std::memory_order_relaxed);
+        }
+        return counters;
+    }
+
+    static inline thread_local Shard *currentShard_ = nullptr;
+
+    LoadProfile const profile_;
+    ssl::context &ctx_;
+    std::vector<Shard> shards_;
+    std::atomic<std::size_t> opened_{0};
+    std::atomic<std::size_t> connected_{0};
+    std::atomic<std::size_t> failed_{0};
+    std::mutex firstErrorMtx_;
+    std::string firstError_;
+};
+
+//--------------------------------------------------------------------------------
+// Session implementation, it needs the complete generator
+//--------------------------------------------------------------------------------
+
+inline LoadSession::LoadSession(net::io_context &ioc, ssl::context &ctx,
+                                LoadProfile const &profile, LoadGenerator &generator,
+                                unsigned seed)
+    : WsSession{ioc, ctx, profile.format, profile.compression}
+    , profile_{profile}
+    , generator_{generator}
+    , random_{seed}
+    , pick_{profile.mix.begin(), profile.mix.end()}
+    , timer_{strand_} {
+
+    if (profile_.rate > 0) {
+        interval_ = std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(
+            static_cast<double>(profile_.connections) / profile_.rate));
+    }
+}
+
+inline void LoadSession::onOpen() {
+    generator_.onOpened();
+
+    if (stopping_) {
+        return closeWhenIdle();
+    }
+    if (profile_.rate > 0) {
+        // Spread the first requests of the connections over one interval
+        std::uniform_real_distribution<double> phase{0.0, 1.0};
+        next_ = clock_t::now() + std::chrono::duration_cast<clock_t::duration>(interval_ *
+                                                                               phase(random_));
+        timer_.expires_at(next_);
+        timer_.async_wait(beast::bind_front_handler(&LoadSession::onTick, self<LoadSession>()));
+    } else {
+        sendRequest(pickRequest(), clock_t::now());
+    }
+}
+
+inline void LoadSession::onMessage(proto::Message &&) {
+    // Only broadcasts come without an id, they are not answers to any request
+}
+
+inline void LoadSession::onResponse(std::size_t request, clock_t::time_point sentAt,
+                                    proto::Message &&response) {
+    auto const receivedAt = clock_t::now();
+    generator_.onResponse(request, std::chrono::duration_cast<LatencyHistogram::duration_t>(
+                                       receivedAt - sentAt));
+
+    if (auto hash = proto::stringEntry(response.payload, proto::keys::kHash); hash) {
+        hash_ = std::move(*hash);
+    }
+    if (stopping_) {
+        closeWhenIdle();
+    } else if (profile_.rate <= 0 && inFlight() == 0) {
+        sendRequest(pickRequest(), receivedAt);
+    }
+}
+
+inline void LoadSession::onBadFrame(std::exception const &) { generator_.onError(); }
+
+inline void LoadSession::onFailure(beast::error_code ec, char const *what) {
+    timer_.cancel();
+
+    if (open_) {
+        generator_.onClosed();
+    }
+    generator_.onFailed(ec, what, open_);
+}
+
+inline void LoadSession::onClosed() {
+    timer_.cancel();
+    generator_.onClosed();
+}
+
+inline void LoadSession::onSent() {
+    LoadGenerator::currentShard_->sent.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void LoadSession::onDropped() {
+    LoadGenerator::currentShard_->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+} // namespace eps
@@ -0,0 +1,116 @@
+
+#pragma once
+
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/ssl.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace eps {
+
+/**
+ * Keeps the last TLS session of every server the streams of an ssl::context connected to, so
+ * their next connection resumes it: an abbreviated handshake, without the key exchange and the
+ * certificate checks of a full one.
+ *
+ * With TLS 1.3 the session arrives after the handshake, with the ticket the server sends. The
+ * cache must outlive the streams of the context.
+ */
+class TlsSessionCache {
+public:
+    explicit TlsSessionCache(boost::asio::ssl::context &ctx) : ctx_{ctx.native_handle()} {
+        // The sessions are only stored here, OpenSSL never looks them up for a client anyway
+        SSL_CTX_set_session_cache_mode(ctx_,
+                                       SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_set_ex_data(ctx_, contextIndex(), this);
+        SSL_CTX_sess_set_new_cb(ctx_, &TlsSessionCache::onNewSession);
+    }
+
+    ~TlsSessionCache() {
+        SSL_CTX_sess_set_new_cb(ctx_, nullptr);
+        SSL_CTX_set_ex_data(ctx_, contextIndex(), nullptr);
+
+        for (auto &&[server, session] : sessions_) {
+            SSL_SESSION_free(session);
+        }
+    }
+
+    TlsSessionCache(TlsSessionCache const &) = delete;
+    TlsSessionCache &operator=(TlsSessionCache const &) = delete;
+
+    /**
+     * Offers the last session with the server to a stream about to handshake, and keeps the
+     * session it gets next. Nothing happens when the context of the stream has no cache.
+     *
+     * @param server e.g. host:port
+     */
+    static void resume(SSL *ssl, std::string const &server) {
+        auto *cache = of(ssl);
+
+        if (cache == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> _{cache->mtx_};
+        auto const it = cache->sessions_.try_emplace(server, nullptr).first;
+
+        // The keys are never erased, the stream can point to its own
+        SSL_set_ex_data(ssl, streamIndex(), const_cast<std::string *>(&it->first));
+
+        if (it->second != nullptr && SSL_SESSION_is_resumable(it->second) == 1) {
+            SSL_set_session(ssl, it->second);
+        }
+    }
+
+private:
+    static int contextIndex() {
+        static int const index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static int streamIndex() {
+        static int const index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static TlsSessionCache *of(SSL *ssl) {
+        return static_cast<TlsSessionCache *>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), contextIndex()));
+    }
+
+    /**
+     * Keeps a copy of the session: OpenSSL marks its own as not resumable when the connection
+     * ends without a closing handshake, which is what a server restart does to its clients
+     *
+     * @return 0, OpenSSL keeps its reference to the session
+     */
+    static int onNewSession(SSL *ssl, SSL_SESSION *session) {
+        auto *cache = of(ssl);
+        auto const *server =
+            static_cast<std::string const *>(SSL_get_ex_data(ssl, streamIndex()));
+
+        if (cache == nullptr || server == nullptr) {
+            return 0;
+        }
+        auto *copy = SSL_SESSION_dup(session);
+
+        if (copy == nullptr) {
+            return 0;
+        }
+        std::lock_guard<std::mutex> _{cache->mtx_};
+        auto &last = cache->sessions_[*server];
+
+        if (last != nullptr) {
+            SSL_SESSION_free(last);
+        }
+        last = copy;
+        return 0;
+    }
+
+    SSL_CTX *const ctx_;
+    std::mutex mtx_;
+    std::unordered_map<std::string, SSL_SESSION *> sessions_;
+};
+
+} // namespace eps
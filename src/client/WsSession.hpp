@@ -0,0 +1,631 @@
+
+#pragma once
+
+#include "TlsSessionCache.hpp"
+#include "eps_common/Codec.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/Logger.hpp"
+#include "eps_common/Protocol.hpp"
+#include "eps_common/SendQueue.hpp"
+#include "eps_common/definitions.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/beast/websocket.hpp>
+#include <boost/beast/websocket/ssl.hpp>
+#include <magic_enum.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
+using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+
+namespace eps {
+
+// Report a failure
+inline void fail(beast::error_code ec, char const *what) {
+    EPS_LOG_ERROR("{}: {}", what, ec.message());
+}
+
+/**
+ * Trusts the self-signed certificate of the server
+ */
+inline void loadRootCertificate(ssl::context &ctx, std::filesystem::path const &certificate) {
+    namespace fs = std::filesystem;
+
+    if (!fs::exists(certificate) || !fs::is_regular_file(certificate)) {
+        throw std::runtime_error(
+            std::format("Invalid server certificate [{}]", certificate.string()));
+    }
+    if (std::ifstream certFile(certificate.string()); certFile.is_open()) {
+        std::string certContents{(std::istreambuf_iterator<char>(certFile)),
+                                 std::istreambuf_iterator<char>()};
+
+        boost::system::error_code ec;
+        ctx.add_certificate_authority(boost::asio::buffer(certContents.data(), certContents.size()),
+                                      ec);
+        if (ec) {
+            throw std::runtime_error(
+                std::format("Unable to obtain the certificate authority from the "
+                            "server certificate [{}]",
+                            certificate.string()));
+        }
+    } else {
+        throw std::runtime_error(
+            std::format("Unable to open the server certificate [{}]", certificate.string()));
+    }
+}
+
+/**
+ * Whether and how fast a session reconnects once its connection is lost
+ */
+struct ReconnectSettings {
+    bool enabled{false};
+    std::chrono::milliseconds initialDelay{250};
+    std::chrono::milliseconds maxDelay{30'000};
+};
+
+/**
+ * Delays between the attempts to reconnect: the bound doubles after every attempt up to the
+ * maximum and the delay is drawn below it (full jitter), so the clients a server restart dropped
+ * at once do not all come back at once.
+ */
+class Backoff {
+public:
+    explicit Backoff(ReconnectSettings const &settings, unsigned seed = std::random_device{}())
+        : initialDelay_{settings.initialDelay}
+        , maxDelay_{settings.maxDelay}
+        , random_{seed} {}
+
+    std::chrono::milliseconds next() {
+        // Past 2^20 times the initial delay, the bound is the maximum for any sensible setting
+        auto const bound =
+            std::min(maxDelay_, initialDelay_ * (int64_t{1} << std::min(attempts_, 20U)));
+        ++attempts_;
+        return std::chrono::milliseconds{
+            std::uniform_int_distribution<int64_t>{0, bound.count()}(random_)};
+    }
+
+    void reset() { attempts_ = 0; }
+
+    [[nodiscard]] unsigned attempts() const { return attempts_; }
+
+private:
+    std::chrono::milliseconds initialDelay_;
+    std::chrono::milliseconds maxDelay_;
+    // Seeded with neighbouring values, the first draws of a minstd_rand would be alike
+    std::mt19937 random_;
+    unsigned attempts_{0};
+};
+
+/**
+ * Opens a websocket over SSL: resolves the host, connects, performs the SSL and the websocket
+ * handshakes and then runs the connection asynchronously on the strand of the stream.
+ *
+ * Frames are read in a loop and handed over decoded to onMessage(), and the bytes read are
+ * acknowledged to the server every defs::ws::kAckInterval, which it paces its sends on once the
+ * handshake announced it (defs::ws::kFlowControlHeader). Outgoing
+ * messages go through a SendQueue with a single write in flight, so requests can be queued from
+ * any thread without blocking and they leave in the order they were queued, which is also the
+ * order they were deflated in. Past the bytes the queue holds, its overflow policy drops the
+ * message or closes the connection.
+ *
+ * Requests sent with a response callback get an id the server echoes, so many of them can be in
+ * flight at once and they complete in whatever order the server answers them. Everything else the
+ * server sends goes to onMessage().
+ *
+ * With reconnections enabled, a lost connection is opened again after a Backoff delay, until
+ * shutdown() is called. The address of the server is only resolved again when connecting to it
+ * fails, and the TLS session is resumed when the context has a TlsSessionCache.
+ *
+ * @note: The connection chain is a fork from the Boost example. Here:
+ *        https://www.boost.org/doc/libs/1_70_0/libs/beast/example/websocket/client/async-ssl/websocket_client_async_ssl.cpp
+ */
+class WsSession : public std::enable_shared_from_this<WsSession> {
+public:
+    using stream_t = websocket::stream<beast::ssl_stream<beast::tcp_stream>>;
+    using response_cb_t = std::function<void(proto::Message &&)>;
+
+    WsSession(net::io_context &ioc, ssl::context &ctx, proto::WireFormat format,
+              proto::CompressionSettings compression, ReconnectSettings reconnect = {},
+              SendQueueSettings sendQueue = {.overflow = OverflowPolicy::Drop})
+        : format_{format}
+        , compression_{compression}
+        , reconnect_{reconnect}
+        , strand_{net::make_strand(ioc)}
+        , resolver_{strand_}
+        , ws_{std::in_place, strand_, ctx}
+        , ctx_{ctx}
+        , backoff_{reconnect}
+        , reconnectTimer_{strand_}
+        , outbox_{sendQueue} {
+
+        if (compression_.enabled) {
+            deflater_.emplace(compression_);
+        }
+    }
+
+    virtual ~WsSession() = default;
+
+    // Start the asynchronous operation
+    void run(std::string_view host, int port) {
+        host_ = host;
+        port_ = port;
+        connect();
+    }
+
+    /**
+     * Queues a message from any thread
+     */
+    void send(proto::Message message) {
+        net::post(strand_, [self = shared_from_this(), m = std::move(message)] {
+            self->write(m);
+        });
+    }
+
+    /**
+     * Sends a request from any thread, onResponse is called on the strand with its response
+     */
+    void request(proto::Message message, response_cb_t onResponse) {
+        net::post(strand_, [self = shared_from_this(), m = std::move(message),
+                            cb = std::move(onResponse)]() mutable {
+            self->write(std::move(m), std::move(cb));
+        });
+    }
+
+    /**
+     * Sends a request from any thread. The future is broken when the connection ends before the
+     * response arrives.
+     */
+    std::future<proto::Message> request(proto::Message message) {
+        auto promise = std::make_shared<std::promise<proto::Message>>();
+        auto future = promise->get_future();
+
+        request(std::move(message), [promise](proto::Message &&response) {
+            promise->set_value(std::move(response));
+        });
+        return future;
+    }
+
+    /**
+     * Closes the connection from any thread, once the queued messages are written, and stops
+     * reconnecting
+     */
+    void shutdown() {
+        net::post(strand_, [self = shared_from_this()] { self->close(); });
+    }
+
+protected:
+    /**
+     * Called on the strand once the websocket handshake succeeded, the reads already started
+     */
+    virtual void onOpen() = 0;
+
+    /**
+     * Called on the strand for every message received
+     */
+    virtual void onMessage(proto::Message &&message) = 0;
+
+    /**
+     * Called on the strand for a frame that could not be inflated or decoded
+     */
+    virtual void onBadFrame(std::exception const &ex) {}
+
+    /**
+     * Called when the connection fails, the session is over after that
+     */
+    virtual void onFailure(beast::error_code ec, char const *what) { fail(ec, what); }
+
+    /**
+     * Called once the connection is closed by either side without errors
+     */
+    virtual void onClosed() {}
+
+    /**
+     * Called on the strand when the next attempt to connect is due in delay
+     */
+    virtual void onReconnecting(std::chrono::milliseconds delay) {}
+
+    /**
+     * Whether the connection is opened again once it is lost, only on the strand
+     */
+    [[nodiscard]] bool reconnects() const { return reconnect_.enabled && !stopped_; }
+
+    /**
+     * Encodes and queues a message, only on the strand
+     *
+     * @return false when the message is not sent: the connection is not open or the send queue
+     * is full
+     */
+    bool write(proto::Message const &message) {
+        if (!open_ || closing_ || finished_) {
+            return false;
+        }
+        auto const &bytes = encoder_.encode(message, format_);
+        auto const *deflated = deflater_ ? deflater_->compress(bytes, format_) : nullptr;
+        auto frame = deflated != nullptr
+                         ? SendQueue::Frame{.bytes = *deflated, .binary = true}
+                         : SendQueue::Frame{.bytes = bytes, .binary = proto::isBinary(format_)};
+
+        if (outbox_.push(std::move(frame)) == SendQueue::Push::Overflow) {
+            if (outbox_.settings().overflow == OverflowPolicy::Disconnect) {
+                finish(net::error::no_buffer_space, "send queue");
+                // Aborts the read and the write in flight
+                beast::error_code ignored;
+                beast::get_lowest_layer(*ws_).socket().close(ignored);
+            }
+            return false;
+        }
+        if (!writing_) {
+            writeNext();
+        }
+        return true;
+    }
+
+    /**
+     * Encodes and queues a request with a new id, only on the strand
+     *
+     * @return false when the request is not sent, onResponse is then never called
+     */
+    bool write(proto::Message message, response_cb_t onResponse) {
+        if (!open_ || closing_ || finished_) {
+            return false;
+        }
+        message.id = nextId_++;
+        auto const it = inFlight_.emplace(*message.id, std::move(onResponse)).first;
+
+        if (!write(message)) {
+            if (!finished_) {
+                inFlight_.erase(it);
+            }
+            return false;
+        }
+        return true;
+    }
+
+
+    /**
+     * Requests waiting for their response, only on the strand
+     */
+    [[nodiscard]] std::size_t inFlight() const { return inFlight_.size(); }
+
+    /**
+     * Starts the closing handshake once the queued messages are written, only on the strand
+     */
+    void close() {
+        stopped_ = true;
+        reconnectTimer_.cancel();
+
+        if (!open_ || closing_ || finished_) {
+            return;
+        }
+        closing_ = true;
+
+        if (!writing_) {
+            startClosing();
+        }
+    }
+
+    template <typename Self> std::shared_ptr<Self> self() {
+        return std::static_pointer_cast<Self>(shared_from_this());
+    }
+
+    proto::WireFormat const format_;
+    proto::CompressionSettings const compression_;
+    ReconnectSettings const reconnect_;
+    net::strand<net::io_context::executor_type> strand_;
+    tcp::resolver resolver_;
+    // A stream cannot be opened again once closed, every connection gets a new one
+    std::optional<stream_t> ws_;
+    std::string host_;
+    int port_{0};
+    bool open_{false};
+    // Whether the TLS handshake of the connection resumed a session
+    bool resumed_{false};
+
+private:
+    void connect() {
+        if (!endpoints_.empty()) {
+            return onResolve({}, endpoints_);
+        }
+        // Look up the domain name
+        resolver_.async_resolve(
+            host_, std::to_string(port_),
+            beast::bind_front_handler(&WsSession::onResolve, shared_from_this()));
+    }
+
+    void onResolve(beast::error_code ec, tcp::resolver::results_type results) {
+        if (ec) {
+            return finish(ec, "resolve");
+        }
+        endpoints_ = results;
+
+        // Set a timeout on the operation
+        beast::get_lowest_layer(*ws_).expires_after(std::chrono::seconds(30));
+
+        // Make the connection on the IP address we get from a lookup
+        beast::get_lowest_layer(*ws_).async_connect(
+            results, beast::bind_front_handler(&WsSession::onConnect, shared_from_this()));
+    }
+
+    void onConnect(beast::error_code ec, tcp::resolver::results_type::endpoint_type) {
+        if (ec) {
+            // The server may have moved, the next attempt looks it up again
+            endpoints_ = {};
+            return finish(ec, "connect");
+        }
+        // Set a timeout on the operation
+        beast::get_lowest_layer(*ws_).expires_after(std::chrono::seconds(30));
+
+        auto *ssl = ws_->next_layer().native_handle();
+        SSL_set_tlsext_host_name(ssl, host_.c_str());
+        TlsSessionCache::resume(ssl, std::format("{}:{}", host_, port_));
+
+        // Perform the SSL handshake
+        ws_->next_layer().async_handshake(
+            ssl::stream_base::client,
+            beast::bind_front_handler(&WsSession::onSSLHandshake, shared_from_this()));
+    }
+
+    void onSSLHandshake(beast::error_code ec) {
+        if (ec) {
+            return finish(ec, "ssl_handshake");
+        }
+        resumed_ = SSL_session_reused(ws_->next_layer().native_handle()) == 1;
+        EPS_LOG_DEBUG("TLS handshake with {}:{}, {}", host_, port_,
+                      resumed_ ? "session resumed" : "full");
+
+        // Turn off the timeout on the tcp_stream, because
+        // the websocket stream has its own timeout system.
+        beast::get_lowest_layer(*ws_).expires_never();
+
+        // Set suggested timeout settings for the websocket
+        ws_->set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+
+        // Set a decorator to change the User-Agent of the handshake and to opt into a wire format,
+        // compression and Ack flow control
+        ws_->set_option(websocket::stream_base::decorator([this](websocket::request_type &req) {
+            req.set(http::field::user_agent,
+                    std::string(BOOST_BEAST_VERSION_STRING) + " websocket-client-async-ssl");
+            req.set(defs::ws::kWireFormatHeader, magic_enum::enum_name(format_));
+            req.set(defs::ws::kFlowControlHeader, defs::ws::kFlowControlAck);
+
+            if (compression_.enabled) {
+                req.set(defs::ws::kCompressionHeader, proto::toHeaderValue(compression_));
+            }
+        }));
+        ws_->binary(proto::isBinary(format_));
+
+        // Perform the websocket handshake
+        ws_->async_handshake(
+            host_, "/ws", beast::bind_front_handler(&WsSession::onHandshake, shared_from_this()));
+    }
+
+    void onHandshake(beast::error_code ec) {
+        if (ec) {
+            return finish(ec, "handshake");
+        }
+        open_ = true;
+        backoff_.reset();
+        read();
+
+        if (stopped_) {
+            // shutdown() was called while connecting
+            closing_ = true;
+            return startClosing();
+        }
+        onOpen();
+    }
+
+    void read() {
+        reading_ = true;
+        ws_->async_read(readBuffer_,
+                        beast::bind_front_handler(&WsSession::onRead, shared_from_this()));
+    }
+
+    void onRead(beast::error_code ec, std::size_t) {
+        reading_ = false;
+
+        if (ec) {
+            // Reading ends with an error once the closing handshake is done
+            finish(ec == websocket::error::closed || closing_ ? beast::error_code{} : ec, "read");
+            return reconnectWhenIdle();
+        }
+        std::string_view bytes{static_cast<char const *>(readBuffer_.data().data()),
+                               readBuffer_.size()};
+        received_ += bytes.size();
+        auto format = proto::frameFormat(ws_->got_binary());
+
+        try {
+            if (proto::isDeflated(bytes, ws_->got_binary())) {
+                std::tie(bytes, format) = inflater_->inflate(bytes);
+            }
+            dispatch(proto::decode(bytes, format));
+        } catch (nlohmann::json::exception const &ex) {
+            onBadFrame(ex);
+        } catch (proto::CompressionError const &ex) {
+            onBadFrame(ex);
+        }
+        readBuffer_.consume(readBuffer_.size());
+
+        if (!finished_) {
+            acknowledge();
+        }
+        // The Ack may not fit and close the connection
+        if (!finished_) {
+            read();
+        }
+    }
+
+    /**
+     * Tells the server how much was read, once every defs::ws::kAckInterval bytes. The count is
+     * cumulative, so an Ack lost with a full send queue is made up by the next one.
+     */
+    void acknowledge() {
+        if (received_ - acknowledged_ < defs::ws::kAckInterval) {
+            return;
+        }
+        proto::Message ack{.type = proto::MessageType::Ack};
+        ack.payload[proto::keys::kBytes] = received_;
+
+        if (write(ack)) {
+            acknowledged_ = received_;
+        }
+    }
+
+    void dispatch(proto::Message &&message) {
+        auto const it = message.id ? inFlight_.find(*message.id) : inFlight_.end();
+
+        if (it == inFlight_.end()) {
+            return onMessage(std::move(message));
+        }
+        auto onResponse = std::move(it->second);
+        inFlight_.erase(it);
+        onResponse(std::move(message));
+    }
+
+    void writeNext() {
+        writing_ = true;
+        writingFrame_ = outbox_.pop();
+        ws_->binary(writingFrame_.binary);
+        ws_->async_write(net::buffer(writingFrame_.bytes),
+                         beast::bind_front_handler(&WsSession::onWrite, shared_from_this()));
+    }
+
+    void onWrite(beast::error_code ec, std::size_t) {
+        if (ec) {
+            writing_ = false;
+            finish(ec, "write");
+            return reconnectWhenIdle();
+        }
+        outbox_.written(writingFrame_.bytes.size());
+
+        if (!outbox_.empty()) {
+            writeNext();
+            return;
+        }
+        writing_ = false;
+
+        if (closing_) {
+            startClosing();
+        }
+    }
+
+    void startClosing() {
+        ws_->async_close(websocket::close_code::normal,
+                         [self = shared_from_this()](beast::error_code ec) {
+                             if (ec) {
+                                 self->finish(ec, "close");
+                             }
+                         });
+    }
+
+    void finish(beast::error_code ec, char const *what) {
+        if (finished_) {
+            return;
+        }
+        finished_ = true;
+        outbox_.clear();
+        // Breaks the futures of the requests left without a response
+        inFlight_.clear();
+
+        if (ec) {
+            onFailure(ec, what);
+        } else {
+            onClosed();
+        }
+        if (reconnects()) {
+            // Aborts the operation still pending, the next connection waits for it to end
+            beast::error_code ignored;
+            beast::get_lowest_layer(*ws_).socket().close(ignored);
+            reconnectWhenIdle();
+        }
+    }
+
+    /**
+     * Schedules the next connection once the operations of the last one are over
+     */
+    void reconnectWhenIdle() {
+        if (!finished_ || reading_ || writing_ || waiting_ || !reconnects()) {
+            return;
+        }
+        auto const delay = backoff_.next();
+        onReconnecting(delay);
+
+        waiting_ = true;
+        reconnectTimer_.expires_after(delay);
+        reconnectTimer_.async_wait([self = shared_from_this()](beast::error_code ec) {
+            self->waiting_ = false;
+
+            if (!ec && self->reconnects()) {
+                self->reconnect();
+            }
+        });
+    }
+
+    void reconnect() {
+        ws_.emplace(strand_, ctx_);
+        open_ = false;
+        resumed_ = false;
+        closing_ = false;
+        finished_ = false;
+        readBuffer_.clear();
+        received_ = 0;
+        acknowledged_ = 0;
+        // The compression contexts belong to a connection
+        if (compression_.enabled) {
+            deflater_.emplace(compression_);
+        }
+        inflater_.emplace();
+        connect();
+    }
+
+    ssl::context &ctx_;
+    tcp::resolver::results_type endpoints_;
+    Backoff backoff_;
+    net::steady_timer reconnectTimer_;
+    beast::flat_buffer readBuffer_;
+    proto::MessageEncoder encoder_;
+    std::optional<proto::Deflater> deflater_;
+    std::optional<proto::Inflater> inflater_{std::in_place};
+    SendQueue outbox_;
+    // Out of the queue while it is written
+    SendQueue::Frame writingFrame_;
+    // Bytes read on the connection, and the last count acknowledged to the server
+    uint64_t received_{0};
+    uint64_t acknowledged_{0};
+    std::unordered_map<uint64_t, response_cb_t> inFlight_;
+    uint64_t nextId_{1};
+    bool reading_{false};
+    bool writing_{false};
+    bool closing_{false};
+    bool finished_{false};
+    // Set by close(), the session does not reconnect anymore
+    bool stopped_{false};
+    // Whether the next connection is scheduled
+    bool waiting_{false};
+};
+
+} // namespace eps
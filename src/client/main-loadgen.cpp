@@ -0,0 +1,139 @@
+
+#include "LoadGenerator.hpp"
+
+#include <charconv>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+
+namespace {
+
+constexpr std::string_view kUsage =
+    "Usage: eps-loadgen [--connections N] [--rate REQUESTS_PER_SECOND (0 = closed loop)]\n"
+    "                   [--duration SECONDS] [--threads N] [--mix VERSION:UPDATES:PUSH:INGEST]\n"
+    "                   [--samples VALUES_PER_METRIC] [--format json|msgpack] [--deflate]\n"
+    "                   [--host HOST] [--port PORT]\n";
+
+template <typename T> T toNumber(std::string_view arg) {
+    T value{};
+
+    if (auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+        ec != std::errc{} || ptr != arg.data() + arg.size()) {
+        throw std::invalid_argument(std::format("Invalid number [{}]", arg));
+    }
+    return value;
+}
+
+eps::LoadProfile parseProfile(int argc, char *argv[]) {
+    eps::LoadProfile profile;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view const option{argv[i]};
+
+        if (option == "--deflate") {
+            profile.compression.enabled = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            throw std::invalid_argument(std::format("Missing value for [{}]", option));
+        }
+        std::string_view value{argv[++i]};
+
+        if (option == "--connections") {
+            profile.connections = toNumber<std::size_t>(value);
+        } else if (option == "--rate") {
+            profile.rate = toNumber<double>(value);
+        } else if (option == "--duration") {
+            profile.duration = std::chrono::seconds{toNumber<unsigned>(value)};
+        } else if (option == "--threads") {
+            profile.threads = std::max<std::size_t>(1, toNumber<std::size_t>(value));
+        } else if (option == "--mix") {
+            // The weights left out are 0
+            for (auto &weight : profile.mix) {
+                if (value.empty()) {
+                    weight = 0;
+                    continue;
+                }
+                auto const end = std::min(value.find(':'), value.size());
+                weight = toNumber<unsigned>(value.substr(0, end));
+                value.remove_prefix(std::min(end + 1, value.size()));
+            }
+        } else if (option == "--samples") {
+            profile.samples = toNumber<std::size_t>(value);
+        } else if (option == "--format") {
+            profile.format = eps::proto::toWireFormat(value);
+        } else if (option == "--host") {
+            profile.host = value;
+        } else if (option == "--port") {
+            profile.port = toNumber<int>(value);
+        } else {
+            throw std::invalid_argument(std::format("Unknown option [{}]", option));
+        }
+    }
+    if (std::accumulate(profile.mix.begin(), profile.mix.end(), 0U) == 0) {
+        throw std::invalid_argument("The request mix needs at least one non zero weight");
+    }
+    return profile;
+}
+
+void printReport(eps::LoadReport const &report) {
+    auto printLatency = [](std::string_view name, eps::LatencyHistogram const &latency) {
+        std::cout << std::format("{:>14} | {:>10} | {:>8} | {:>8} | {:>8} | {:>8} | {:>8}\n", name,
+                                 latency.count(), latency.mean().count(),
+                                 latency.percentile(50).count(), latency.percentile(99).count(),
+                                 latency.percentile(99.9).count(), latency.max().count());
+    };
+    std::cout << std::format("\nConnections: {} opened, {} failed{}\n", report.connected,
+                             report.failed,
+                             report.firstError.empty() ? "" : " (" + report.firstError + ")");
+    std::cout << std::format("Requests: {} sent, {} answered, {} errors, {} dropped\n", report.sent,
+                             report.received, report.errors, report.dropped);
+    std::cout << std::format("Throughput: {:.1f} responses/s over {:.1f}s\n\n",
+                             report.throughput(), report.elapsed.count());
+    std::cout << std::format("{:>14} | {:>10} | {:>8} | {:>8} | {:>8} | {:>8} | {:>8}\n",
+                             "latency (us)", "count", "mean", "p50", "p99", "p999", "max");
+
+    for (std::size_t i = 0; i < eps::kLoadRequests.size(); ++i) {
+        printLatency(magic_enum::enum_name(eps::kLoadRequests[i]), report.latencyByRequest[i]);
+    }
+    printLatency("all", report.latency);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    namespace fs = std::filesystem;
+
+    eps::LoadProfile profile;
+    try {
+        profile = parseProfile(argc, argv);
+    } catch (std::exception const &ex) {
+        std::cerr << ex.what() << "\n" << kUsage;
+        return EXIT_FAILURE;
+    }
+    boost::asio::ssl::context sslContext{ssl::context::sslv23};
+
+    fs::path const sslServerCertificate = fs::current_path() / eps::defs::ws::kServerCertificate;
+
+    try {
+        eps::loadRootCertificate(sslContext, sslServerCertificate);
+
+    } catch (std::exception const &ex) {
+        std::cerr << "FATAL: cannot start the load generator: " << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << std::format("Loading {}:{} with {} connections, {} for {}s\n", profile.host,
+                             profile.port, profile.connections,
+                             profile.rate > 0 ? std::format("{} requests/s", profile.rate)
+                                              : std::string{"closed loop"},
+                             profile.duration.count());
+
+    eps::LoadGenerator generator{profile, sslContext};
+    printReport(generator.run());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+##################################################
+# Hook binding the acceptor of Crow with SO_REUSEPORT
+##################################################
+# Crow v1.0 builds its acceptor in the constructor of its server, inside App::run(), and has no
+# option for the socket before the bind. This adds crow::reuse_port: set before run(), the
+# acceptor is opened, given SO_REUSEPORT, then bound, so the worker processes of eps-server all
+# listen on the same port. Run by FetchContent in the Crow sources, once they are checked out.
+
+set(_file include/crow/http_server.h)
+file(READ ${_file} _source)
+
+# Already patched, e.g. the sources were populated again
+if(_source MATCHES "reuse_port")
+    return()
+endif()
+
+string(REGEX MATCH "acceptor_\\(io_service_, (tcp::endpoint\\([^\n]*\\))\\)," _init "${_source}")
+string(FIND "${_source}" "namespace crow" _namespace)
+
+if(NOT _init OR _namespace EQUAL -1)
+    message(FATAL_ERROR "Unable to add the SO_REUSEPORT hook to ${_file}, "
+                        "the acceptor of this Crow version is not built as expected")
+endif()
+set(_endpoint "${CMAKE_MATCH_1}")
+
+string(REPLACE "${_init}" "acceptor_([&] {
+              tcp::acceptor acceptor{io_service_};
+              auto const endpoint = ${_endpoint};
+              acceptor.open(endpoint.protocol());
+              acceptor.set_option(tcp::acceptor::reuse_address(true));
+              if (reuse_port)
+              {
+                  int const enable = 1;
+                  ::setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_REUSEPORT, &enable,
+                               sizeof(enable));
+              }
+              acceptor.bind(endpoint);
+              acceptor.listen();
+              return acceptor;
+          }())," _source "${_source}")
+
+# Declared at the top of the namespace, before the server uses it
+string(SUBSTRING "${_source}" ${_namespace} -1 _rest)
+string(FIND "${_rest}" "{" _open)
+math(EXPR _open "${_namespace} + ${_open} + 1")
+string(SUBSTRING "${_source}" 0 ${_open} _head)
+string(SUBSTRING "${_source}" ${_open} -1 _tail)
+set(_source "${_head}
+    /// Set before App::run() to bind the listening socket with SO_REUSEPORT
+    inline bool reuse_port = false;
+${_tail}")
+
+file(WRITE ${_file} "${_source}")
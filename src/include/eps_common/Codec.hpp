@@ -0,0 +1,1153 @@
+
+#pragma once
+
+#include "eps_common/Protocol.hpp"
+
+#include <magic_enum.hpp>
+#include <nlohmann/json.hpp>
+
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <format>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace eps::proto {
+
+//--------------------------------------------------------------------------------
+// Wire formats
+//--------------------------------------------------------------------------------
+
+/**
+ * Encodings a peer can use for its frames. JSON travels in text frames and MessagePack in binary
+ * frames, so the kind of the frame is enough to know how to decode it.
+ */
+enum class WireFormat : uint8_t { Json, MsgPack };
+
+inline bool isBinary(WireFormat format) { return format == WireFormat::MsgPack; }
+
+inline WireFormat frameFormat(bool isBinaryFrame) {
+    return isBinaryFrame ? WireFormat::MsgPack : WireFormat::Json;
+}
+
+/**
+ * Parses the format name sent during the handshake, falling back to JSON when it is unknown
+ */
+inline WireFormat toWireFormat(std::string_view name) {
+    return magic_enum::enum_cast<WireFormat>(name, magic_enum::case_insensitive)
+        .value_or(WireFormat::Json);
+}
+
+//--------------------------------------------------------------------------------
+// Encoding / Decoding
+//--------------------------------------------------------------------------------
+
+inline nlohmann::json toJson(Message const &m) { return toEnvelopeJson(m); }
+
+/**
+ * A message encoded once in every wire format, immutable and shared by all its senders
+ */
+struct EncodedFrame {
+    std::string json;
+    std::string msgPack;
+    // Deflated copies (see Compression.hpp), empty when the frame is not worth deflating
+    std::string deflatedJson;
+    std::string deflatedMsgPack;
+
+    std::string const &bytes(WireFormat format) const { return isBinary(format) ? msgPack : json; }
+
+    std::string const &deflated(WireFormat format) const {
+        return isBinary(format) ? deflatedMsgPack : deflatedJson;
+    }
+};
+
+using frame_ptr_t = std::shared_ptr<EncodedFrame const>;
+
+/**
+ * Writes messages into a buffer reused from one message to the next.
+ *
+ * The envelope, the typed fields and the payload entries are appended straight into the buffer
+ * in either wire format, so once the buffer has grown to the size of the usual messages encoding
+ * does not allocate. An encoder is meant to be owned by a single connection or thread.
+ */
+class MessageEncoder {
+public:
+    /**
+     * @return the encoded bytes, valid until the next call
+     */
+    std::string const &encode(Message const &m, WireFormat format) {
+        if (m.frame && !m.id) {
+            return m.frame->bytes(format);
+        }
+        buffer_.clear();
+
+        if (isBinary(format)) {
+            writeMsgPack(m);
+        } else {
+            writeJson(m);
+        }
+        return buffer_;
+    }
+
+    /**
+     * Hands the buffer over to the caller, the encoder starts from an empty one
+     */
+    std::string release() { return std::move(buffer_); }
+
+private:
+    /**
+     * Copies a frozen frame, adding the id to its envelope when there is one. The envelope is an
+     * object (a fixmap in MessagePack) opening the frame and the order of its entries does not
+     * matter.
+     */
+    void writeFrame(Message const &m, WireFormat format) {
+        auto const &frame = m.frame->bytes(format);
+
+        if (!m.id) {
+            buffer_ += frame;
+            return;
+        }
+        auto const id = *m.id;
+
+        if (isBinary(format)) {
+            putByte(static_cast<uint8_t>(frame.front() + 1));
+            putString(keys::kId);
+            putUnsigned(id);
+        } else {
+            buffer_ += R"({"id":)";
+            writeNumber(id);
+            buffer_ += ',';
+        }
+        buffer_.append(frame, 1);
+    }
+
+    //----------------------------------------
+    // JSON
+    //----------------------------------------
+
+    void writeJson(Message const &m) {
+        if (m.frame) {
+            return writeFrame(m, WireFormat::Json);
+        }
+        buffer_ += R"({"type":")";
+        buffer_ += magic_enum::enum_name(m.type);
+        buffer_ += '"';
+
+        if (m.id) {
+            buffer_ += R"(,"id":)";
+            writeNumber(*m.id);
+        }
+        buffer_ += R"(,"payload":)";
+
+        if (!m.version && !m.metrics && !m.series && !m.messages && !m.payload.is_object()) {
+            writeJsonValue(m.payload);
+        } else {
+            char separator = '{';
+            auto field = [&](std::string_view key) {
+                buffer_ += separator;
+                separator = ',';
+                writeJsonString(key);
+                buffer_ += ':';
+            };
+            if (m.version) {
+                field(keys::kVersion);
+                writeJsonString(*m.version);
+            }
+            if (m.metrics) {
+                field(keys::kMetrics);
+                writeJsonMetrics(*m.metrics);
+            }
+            if (m.series) {
+                field(keys::kSeries);
+                writeJsonSeries(*m.series);
+            }
+            if (m.messages) {
+                field(keys::kMessages);
+                char messageSeparator = '[';
+
+                for (auto const &message : *m.messages) {
+                    buffer_ += messageSeparator;
+                    messageSeparator = ',';
+                    writeJson(message);
+                }
+                if (messageSeparator == '[') {
+                    buffer_ += '[';
+                }
+                buffer_ += ']';
+            }
+            if (m.payload.is_object()) {
+                for (auto it = m.payload.begin(); it != m.payload.end(); ++it) {
+                    field(it.key());
+                    writeJsonValue(it.value());
+                }
+            }
+            if (separator == '{') {
+                buffer_ += '{';
+            }
+            buffer_ += '}';
+        }
+        buffer_ += '}';
+    }
+
+    void writeJsonMetrics(std::vector<Metric> const &metrics) {
+        buffer_ += '[';
+
+        for (auto const &metric : metrics) {
+            if (&metric != metrics.data()) {
+                buffer_ += ',';
+            }
+            buffer_ += R"({"name":)";
+            writeJsonString(metric.name);
+            buffer_ += R"(,"description":)";
+            writeJsonString(metric.description);
+            buffer_ += R"(,"type":")";
+            buffer_ += magic_enum::enum_name(metric.type);
+            buffer_ += R"("})";
+        }
+        buffer_ += ']';
+    }
+
+    void writeJsonSeries(std::vector<Series> const &series) {
+        auto writeArray = [&](auto const &values, auto &&writeValue) {
+            buffer_ += '[';
+
+            for (std::size_t i = 0; i < values.size(); ++i) {
+                if (i > 0) {
+                    buffer_ += ',';
+                }
+                writeValue(values[i]);
+            }
+            buffer_ += ']';
+        };
+        auto writeInteger = [&](int64_t value) { writeNumber(value); };
+        buffer_ += '[';
+
+        for (auto const &s : series) {
+            if (&s != series.data()) {
+                buffer_ += ',';
+            }
+            buffer_ += R"({"metric":)";
+            writeJsonString(s.metric);
+
+            if (!s.times.empty()) {
+                buffer_ += R"(,"times":)";
+                writeArray(s.times, writeInteger);
+            }
+            buffer_ += R"(,"values":)";
+
+            if (!s.strings.empty()) {
+                writeArray(s.strings, [&](std::string const &value) { writeJsonString(value); });
+            } else if (!s.doubles.empty()) {
+                writeArray(s.doubles, [&](double value) { writeJsonFloat(value); });
+            } else {
+                writeArray(s.integers, writeInteger);
+            }
+            buffer_ += '}';
+        }
+        buffer_ += ']';
+    }
+
+    void writeJsonValue(nlohmann::json const &value) {
+        using value_t = nlohmann::json::value_t;
+
+        switch (value.type()) {
+        case value_t::boolean:
+            buffer_ += value.get<bool>() ? "true" : "false";
+            break;
+        case value_t::number_integer:
+            writeNumber(value.get<nlohmann::json::number_integer_t>());
+            break;
+        case value_t::number_unsigned:
+            writeNumber(value.get<nlohmann::json::number_unsigned_t>());
+            break;
+        case value_t::number_float:
+            writeJsonFloat(value.get<nlohmann::json::number_float_t>());
+            break;
+        case value_t::string:
+            writeJsonString(value.get_ref<std::string const &>());
+            break;
+        case value_t::array: {
+            char separator = '[';
+
+            for (auto const &element : value) {
+                buffer_ += separator;
+                separator = ',';
+                writeJsonValue(element);
+            }
+            if (separator == '[') {
+                buffer_ += '[';
+            }
+            buffer_ += ']';
+            break;
+        }
+        case value_t::object: {
+            char separator = '{';
+
+            for (auto it = value.begin(); it != value.end(); ++it) {
+                buffer_ += separator;
+                separator = ',';
+                writeJsonString(it.key());
+                buffer_ += ':';
+                writeJsonValue(it.value());
+            }
+            if (separator == '{') {
+                buffer_ += '{';
+            }
+            buffer_ += '}';
+            break;
+        }
+        case value_t::binary: {
+            // Same layout nlohmann::json::dump uses for binary values
+            buffer_ += R"({"bytes":[)";
+            auto const &bytes = value.get_binary();
+
+            for (std::size_t i = 0; i < bytes.size(); ++i) {
+                if (i > 0) {
+                    buffer_ += ',';
+                }
+                writeNumber(static_cast<unsigned>(bytes[i]));
+            }
+            buffer_ += R"(],"subtype":null})";
+            break;
+        }
+        default:
+            buffer_ += "null";
+            break;
+        }
+    }
+
+    void writeJsonString(std::string_view str) {
+        static constexpr char kHex[] = "0123456789abcdef";
+        buffer_ += '"';
+
+        for (char c : str) {
+            switch (c) {
+            case '"':
+                buffer_ += R"(\")";
+                break;
+            case '\\':
+                buffer_ += R"(\\)";
+                break;
+            case '\n':
+                buffer_ += R"(\n)";
+                break;
+            case '\r':
+                buffer_ += R"(\r)";
+                break;
+            case '\t':
+                buffer_ += R"(\t)";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    buffer_ += R"(\u00)";
+                    buffer_ += kHex[(c >> 4) & 0x0F];
+                    buffer_ += kHex[c & 0x0F];
+                } else {
+                    buffer_ += c;
+                }
+                break;
+            }
+        }
+        buffer_ += '"';
+    }
+
+    void writeJsonFloat(double value) {
+        if (!std::isfinite(value)) {
+            buffer_ += "null";
+            return;
+        }
+        auto const start = buffer_.size();
+        writeNumber(value);
+
+        // Keep a fraction so the peer decodes a floating point number again
+        if (buffer_.find_first_of(".eE", start) == std::string::npos) {
+            buffer_ += ".0";
+        }
+    }
+
+    template <typename T> void writeNumber(T value) {
+        std::array<char, 32> chars{};
+        auto const [end, _] = std::to_chars(chars.data(), chars.data() + chars.size(), value);
+        buffer_.append(chars.data(), end);
+    }
+
+    //----------------------------------------
+    // MessagePack
+    //----------------------------------------
+
+    void writeMsgPack(Message const &m) {
+        if (m.frame) {
+            return writeFrame(m, WireFormat::MsgPack);
+        }
+        putContainerHeader(m.id ? 3 : 2, 0x80, 0xde, 0xdf);
+        putString(keys::kType);
+        putString(magic_enum::enum_name(m.type));
+
+        if (m.id) {
+            putString(keys::kId);
+            putUnsigned(*m.id);
+        }
+        putString(keys::kPayload);
+
+        if (!m.version && !m.metrics && !m.series && !m.messages && !m.payload.is_object()) {
+            writeMsgPackValue(m.payload);
+            return;
+        }
+        putContainerHeader((m.version ? 1 : 0) + (m.metrics ? 1 : 0) + (m.series ? 1 : 0) +
+                               (m.messages ? 1 : 0) +
+                               (m.payload.is_object() ? m.payload.size() : 0),
+                           0x80, 0xde, 0xdf);
+        if (m.version) {
+            putString(keys::kVersion);
+            putString(*m.version);
+        }
+        if (m.metrics) {
+            putString(keys::kMetrics);
+            putContainerHeader(m.metrics->size(), 0x90, 0xdc, 0xdd);
+
+            for (auto const &metric : *m.metrics) {
+                putContainerHeader(3, 0x80, 0xde, 0xdf);
+                putString("name");
+                putString(metric.name);
+                putString("description");
+                putString(metric.description);
+                putString("type");
+                putString(magic_enum::enum_name(metric.type));
+            }
+        }
+        if (m.series) {
+            putString(keys::kSeries);
+            putContainerHeader(m.series->size(), 0x90, 0xdc, 0xdd);
+
+            for (auto const &s : *m.series) {
+                writeMsgPackSeries(s);
+            }
+        }
+        if (m.messages) {
+            putString(keys::kMessages);
+            putContainerHeader(m.messages->size(), 0x90, 0xdc, 0xdd);
+
+            for (auto const &message : *m.messages) {
+                writeMsgPack(message);
+            }
+        }
+        if (m.payload.is_object()) {
+            for (auto it = m.payload.begin(); it != m.payload.end(); ++it) {
+                putString(it.key());
+                writeMsgPackValue(it.value());
+            }
+        }
+    }
+
+    void writeMsgPackSeries(Series const &s) {
+        putContainerHeader(s.times.empty() ? 2 : 3, 0x80, 0xde, 0xdf);
+        putString(keys::kMetric);
+        putString(s.metric);
+
+        if (!s.times.empty()) {
+            putString(keys::kTimes);
+            putContainerHeader(s.times.size(), 0x90, 0xdc, 0xdd);
+
+            for (auto const time : s.times) {
+                putInteger(time);
+            }
+        }
+        putString(keys::kValues);
+        putContainerHeader(s.size(), 0x90, 0xdc, 0xdd);
+
+        for (auto const &value : s.strings) {
+            putString(value);
+        }
+        for (auto const value : s.doubles) {
+            putByte(0xcb);
+            putBigEndian(std::bit_cast<uint64_t>(value));
+        }
+        for (auto const value : s.integers) {
+            putInteger(value);
+        }
+    }
+
+    void writeMsgPackValue(nlohmann::json const &value) {
+        using value_t = nlohmann::json::value_t;
+
+        switch (value.type()) {
+        case value_t::boolean:
+            putByte(value.get<bool>() ? 0xc3 : 0xc2);
+            break;
+        case value_t::number_integer:
+            putInteger(value.get<nlohmann::json::number_integer_t>());
+            break;
+        case value_t::number_unsigned:
+            putUnsigned(value.get<nlohmann::json::number_unsigned_t>());
+            break;
+        case value_t::number_float:
+            putByte(0xcb);
+            putBigEndian(std::bit_cast<uint64_t>(value.get<nlohmann::json::number_float_t>()));
+            break;
+        case value_t::string:
+            putString(value.get_ref<std::string const &>());
+            break;
+        case value_t::array:
+            putContainerHeader(value.size(), 0x90, 0xdc, 0xdd);
+
+            for (auto const &element : value) {
+                writeMsgPackValue(element);
+            }
+            break;
+        case value_t::object:
+            putContainerHeader(value.size(), 0x80, 0xde, 0xdf);
+
+            for (auto it = value.begin(); it != value.end(); ++it) {
+                putString(it.key());
+                writeMsgPackValue(it.value());
+            }
+            break;
+        case value_t::binary: {
+            auto const &bytes = value.get_binary();
+            putSized(bytes.size(), 0xc4, 0xc5, 0xc6);
+            buffer_.append(reinterpret_cast<char const *>(bytes.data()), bytes.size());
+            break;
+        }
+        default:
+            putByte(0xc0);
+            break;
+        }
+    }
+
+    void putString(std::string_view str) {
+        if (str.size() < 32) {
+            putByte(static_cast<uint8_t>(0xa0 | str.size()));
+        } else {
+            putSized(str.size(), 0xd9, 0xda, 0xdb);
+        }
+        buffer_ += str;
+    }
+
+    /**
+     * Writes a map or an array header, in its fixed form when it has less than 16 entries
+     */
+    void putContainerHeader(std::size_t size, uint8_t fixCode, uint8_t code16, uint8_t code32) {
+        if (size < 16) {
+            putByte(static_cast<uint8_t>(fixCode | size));
+        } else if (size <= std::numeric_limits<uint16_t>::max()) {
+            putByte(code16);
+            putBigEndian(static_cast<uint16_t>(size));
+        } else {
+            putByte(code32);
+            putBigEndian(static_cast<uint32_t>(size));
+        }
+    }
+
+    /**
+     * Writes the header of a string or binary value with an 8, 16 or 32 bits length
+     */
+    void putSized(std::size_t size, uint8_t code8, uint8_t code16, uint8_t code32) {
+        if (size <= std::numeric_limits<uint8_t>::max()) {
+            putByte(code8);
+            putByte(static_cast<uint8_t>(size));
+        } else if (size <= std::numeric_limits<uint16_t>::max()) {
+            putByte(code16);
+            putBigEndian(static_cast<uint16_t>(size));
+        } else {
+            putByte(code32);
+            putBigEndian(static_cast<uint32_t>(size));
+        }
+    }
+
+    void putUnsigned(uint64_t value) {
+        if (value < 0x80) {
+            putByte(static_cast<uint8_t>(value));
+        } else if (value <= std::numeric_limits<uint8_t>::max()) {
+            putByte(0xcc);
+            putByte(static_cast<uint8_t>(value));
+        } else if (value <= std::numeric_limits<uint16_t>::max()) {
+            putByte(0xcd);
+            putBigEndian(static_cast<uint16_t>(value));
+        } else if (value <= std::numeric_limits<uint32_t>::max()) {
+            putByte(0xce);
+            putBigEndian(static_cast<uint32_t>(value));
+        } else {
+            putByte(0xcf);
+            putBigEndian(value);
+        }
+    }
+
+    void putInteger(int64_t value) {
+        if (value >= 0) {
+            putUnsigned(static_cast<uint64_t>(value));
+        } else if (value >= -32) {
+            putByte(static_cast<uint8_t>(value));
+        } else if (value >= std::numeric_limits<int8_t>::min()) {
+            putByte(0xd0);
+            putByte(static_cast<uint8_t>(value));
+        } else if (value >= std::numeric_limits<int16_t>::min()) {
+            putByte(0xd1);
+            putBigEndian(static_cast<uint16_t>(value));
+        } else if (value >= std::numeric_limits<int32_t>::min()) {
+            putByte(0xd2);
+            putBigEndian(static_cast<uint32_t>(value));
+        } else {
+            putByte(0xd3);
+            putBigEndian(static_cast<uint64_t>(value));
+        }
+    }
+
+    template <typename T> void putBigEndian(T value) {
+        for (int shift = (sizeof(T) - 1) * 8; shift >= 0; shift -= 8) {
+            putByte(static_cast<uint8_t>(value >> shift));
+        }
+    }
+
+    void putByte(uint8_t byte) { buffer_ += static_cast<char>(byte); }
+
+    std::string buffer_;
+};
+
+inline std::string encode(Message const &m, WireFormat format) {
+    if (m.frame && !m.id) {
+        return m.frame->bytes(format);
+    }
+    MessageEncoder encoder;
+    encoder.encode(m, format);
+    return encoder.release();
+}
+
+inline frame_ptr_t freeze(Message const &m) {
+    return std::make_shared<EncodedFrame const>(EncodedFrame{
+        .json = encode(m, WireFormat::Json), .msgPack = encode(m, WireFormat::MsgPack)});
+}
+
+//--------------------------------------------------------------------------------
+// Streaming decoder
+//--------------------------------------------------------------------------------
+
+/**
+ * SAX consumer that fills a Message while the frame is parsed, for both JSON and MessagePack.
+ *
+ * The version and the metrics go straight into the typed fields of the message. Only the other
+ * payload entries are built as json values, so no DOM of the whole frame is ever created.
+ * Malformed content is reported with the same nlohmann::json exceptions the DOM path throws.
+ *
+ * The entries of a Batch are handed over to a decoder of their own, one at a time: a malformed
+ * entry only fails its own item and the parse goes on with the next one.
+ */
+class MessageDecoder {
+public:
+    using json_t = nlohmann::json;
+
+    /**
+     * @param withEntries whether the entries of a Batch are decoded, a nested Batch keeps them in
+     * its payload
+     */
+    explicit MessageDecoder(Message &message, bool withEntries = true)
+        : message_{message}, withEntries_{withEntries} {}
+
+    bool null() {
+        if (inEntry()) {
+            return forward(0, [](MessageDecoder &entry) { entry.null(); });
+        }
+        return scalar(json_t{});
+    }
+
+    bool boolean(bool value) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.boolean(value); });
+        }
+        return scalar(json_t(value));
+    }
+
+    bool number_integer(json_t::number_integer_t value) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.number_integer(value); });
+        }
+        if (isId() && value >= 0) {
+            message_.id = static_cast<uint64_t>(value);
+            return true;
+        }
+        return scalar(json_t(value));
+    }
+
+    bool number_unsigned(json_t::number_unsigned_t value) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.number_unsigned(value); });
+        }
+        if (isId()) {
+            message_.id = value;
+            return true;
+        }
+        return scalar(json_t(value));
+    }
+
+    bool number_float(json_t::number_float_t value, json_t::string_t const &text) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.number_float(value, text); });
+        }
+        return scalar(json_t(value));
+    }
+
+    bool binary(json_t::binary_t &value) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.binary(value); });
+        }
+        return scalar(json_t(std::move(value)));
+    }
+
+    bool string(json_t::string_t &value) {
+        if (inEntry()) {
+            return forward(0, [&](MessageDecoder &entry) { entry.string(value); });
+        }
+        switch (field_) {
+        case Field::Type:
+            message_.type =
+                magic_enum::enum_cast<MessageType>(value).value_or(MessageType::Uninitialized);
+            return true;
+        case Field::Version:
+            message_.version = std::move(value);
+            return true;
+        case Field::MetricName:
+            return setMetricField(metricNameBit, message_.metrics->back().name, value);
+        case Field::MetricDescription:
+            return setMetricField(metricDescriptionBit, message_.metrics->back().description,
+                                  value);
+        case Field::MetricType:
+            metricFields_ |= metricTypeBit;
+            message_.metrics->back().type =
+                magic_enum::enum_cast<MetricType>(value).value_or(MetricType::Integer);
+            return true;
+        default:
+            return scalar(json_t(std::move(value)));
+        }
+    }
+
+    bool start_object(std::size_t size) {
+        if (scopes_.empty()) {
+            return push(Scope::Envelope);
+        }
+        switch (scopes_.back()) {
+        case Scope::Entry:
+            return forward(1, [&](MessageDecoder &entry) { entry.start_object(size); });
+        case Scope::Entries:
+            startEntry();
+            return forward(1, [&](MessageDecoder &entry) { entry.start_object(size); });
+        case Scope::Envelope:
+            expectNot(Field::Id, "id must be an unsigned integer");
+
+            if (field_ == Field::Payload) {
+                // The payload json only becomes an object once an untyped entry shows up
+                return push(Scope::Payload);
+            }
+            return push(Scope::Skip);
+        case Scope::Payload:
+            expectNot(Field::Version, "version must be a string");
+            expectNot(Field::Metrics, "metrics must be an array");
+            expectNot(Field::Series, "series must be an array");
+            expectNot(Field::Messages, "messages must be an array");
+            return startDom(json_t::object());
+        case Scope::Metrics:
+            message_.metrics->emplace_back();
+            metricFields_ = 0;
+            return push(Scope::Metric);
+        case Scope::Metric:
+            expectNoMetricField();
+            return push(Scope::Skip);
+        case Scope::SeriesList:
+            message_.series->emplace_back();
+            return push(Scope::Series);
+        case Scope::Series:
+            expectNoSeriesField();
+            return push(Scope::Skip);
+        case Scope::Times:
+        case Scope::Values:
+            throw json_t::type_error::create(302, "series values must be scalars", nullptr);
+        case Scope::Dom:
+            return startDom(json_t::object());
+        default:
+            return push(Scope::Skip);
+        }
+    }
+
+    bool key(json_t::string_t &name) {
+        if (scopes_.empty()) {
+            return true;
+        }
+        switch (scopes_.back()) {
+        case Scope::Entry:
+            return forward(0, [&](MessageDecoder &entry) { entry.key(name); });
+        case Scope::Envelope:
+            field_ = name == keys::kType      ? Field::Type
+                     : name == keys::kId      ? Field::Id
+                     : name == keys::kPayload ? Field::Payload
+                                              : Field::Ignored;
+            break;
+        case Scope::Payload:
+            field_ = name == keys::kVersion                    ? Field::Version
+                     : name == keys::kMetrics                  ? Field::Metrics
+                     : name == keys::kSeries                   ? Field::Series
+                     : name == keys::kMessages && withEntries_ ? Field::Messages
+                                                               : Field::Dom;
+            if (field_ == Field::Dom) {
+                domTarget_ = &message_.payload[name];
+            }
+            break;
+        case Scope::Metric:
+            field_ = name == "name"          ? Field::MetricName
+                     : name == "description" ? Field::MetricDescription
+                     : name == "type"        ? Field::MetricType
+                                             : Field::Ignored;
+            break;
+        case Scope::Series:
+            field_ = name == keys::kMetric   ? Field::SeriesMetric
+                     : name == keys::kTimes  ? Field::Times
+                     : name == keys::kValues ? Field::Values
+                                             : Field::Ignored;
+            break;
+        case Scope::Dom:
+            objectElement_ = &(*domStack_.back())[name];
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    bool end_object() {
+        if (inEntry()) {
+            return forward(-1, [](MessageDecoder &entry) { entry.end_object(); });
+        }
+        if (scopes_.back() == Scope::Metric && metricFields_ != allMetricBits) {
+            throw json_t::out_of_range::create(403, "metric is missing a field", nullptr);
+        }
+        if (scopes_.back() == Scope::Series) {
+            if (auto const error = message_.series->back().malformed(); !error.empty()) {
+                throw json_t::out_of_range::create(403, std::string{error}, nullptr);
+            }
+        }
+        return pop();
+    }
+
+    bool start_array(std::size_t size) {
+        if (scopes_.empty()) {
+            return push(Scope::Skip);
+        }
+        switch (scopes_.back()) {
+        case Scope::Entry:
+            return forward(1, [&](MessageDecoder &entry) { entry.start_array(size); });
+        case Scope::Entries:
+            addEntryError();
+            return push(Scope::Skip);
+        case Scope::Envelope:
+            expectNot(Field::Id, "id must be an unsigned integer");
+
+            if (field_ == Field::Payload) {
+                domTarget_ = &message_.payload;
+                return startDom(json_t::array());
+            }
+            return push(Scope::Skip);
+        case Scope::Payload:
+            expectNot(Field::Version, "version must be a string");
+
+            if (field_ == Field::Metrics) {
+                message_.metrics.emplace();
+                return push(Scope::Metrics);
+            }
+            if (field_ == Field::Series) {
+                message_.series.emplace();
+                return push(Scope::SeriesList);
+            }
+            if (field_ == Field::Messages) {
+                message_.entries.emplace();
+                return push(Scope::Entries);
+            }
+            return startDom(json_t::array());
+        case Scope::Metrics:
+            throw json_t::type_error::create(302, "metric must be an object", nullptr);
+        case Scope::Metric:
+            expectNoMetricField();
+            return push(Scope::Skip);
+        case Scope::SeriesList:
+            throw json_t::type_error::create(302, "series must be an object", nullptr);
+        case Scope::Series:
+            expectNot(Field::SeriesMetric, "the metric of a series must be a string");
+
+            if (field_ == Field::Times) {
+                return push(Scope::Times);
+            }
+            if (field_ == Field::Values) {
+                return push(Scope::Values);
+            }
+            return push(Scope::Skip);
+        case Scope::Times:
+        case Scope::Values:
+            throw json_t::type_error::create(302, "series values must be scalars", nullptr);
+        case Scope::Dom:
+            return startDom(json_t::array());
+        default:
+            return push(Scope::Skip);
+        }
+    }
+
+    bool end_array() {
+        if (inEntry()) {
+            return forward(-1, [](MessageDecoder &entry) { entry.end_array(); });
+        }
+        return pop();
+    }
+
+    bool parse_error(std::size_t, std::string const &, nlohmann::detail::exception const &ex) {
+        throw ex;
+    }
+
+private:
+    enum class Scope : uint8_t {
+        Envelope,
+        Payload,
+        Metrics,
+        Metric,
+        SeriesList,
+        Series,
+        Times,
+        Values,
+        // The entries of a Batch, then the one being decoded
+        Entries,
+        Entry,
+        Dom,
+        Skip
+    };
+
+    // What the next value is, as told by the last key
+    enum class Field : uint8_t {
+        None,
+        Ignored,
+        Type,
+        Id,
+        Payload,
+        Version,
+        Metrics,
+        MetricName,
+        MetricDescription,
+        MetricType,
+        Series,
+        SeriesMetric,
+        Times,
+        Values,
+        Messages,
+        Dom
+    };
+
+    static constexpr uint8_t metricNameBit = 1U;
+    static constexpr uint8_t metricDescriptionBit = 2U;
+    static constexpr uint8_t metricTypeBit = 4U;
+    static constexpr uint8_t allMetricBits = metricNameBit | metricDescriptionBit | metricTypeBit;
+
+    bool scalar(json_t &&value) {
+        if (scopes_.empty()) {
+            return true;
+        }
+        switch (scopes_.back()) {
+        case Scope::Envelope:
+            expectNot(Field::Id, "id must be an unsigned integer");
+
+            if (field_ == Field::Payload) {
+                message_.payload = std::move(value);
+            }
+            break;
+        case Scope::Payload:
+            expectNot(Field::Version, "version must be a string");
+            expectNot(Field::Metrics, "metrics must be an array");
+            expectNot(Field::Series, "series must be an array");
+            expectNot(Field::Messages, "messages must be an array");
+            *domTarget_ = std::move(value);
+            break;
+        case Scope::Entries:
+            addEntryError();
+            break;
+        case Scope::Metrics:
+            throw json_t::type_error::create(302, "metric must be an object", nullptr);
+        case Scope::Metric:
+            expectNoMetricField();
+            break;
+        case Scope::SeriesList:
+            throw json_t::type_error::create(302, "series must be an object", nullptr);
+        case Scope::Series:
+            if (field_ == Field::SeriesMetric && value.is_string()) {
+                message_.series->back().metric = std::move(value.get_ref<std::string &>());
+            } else {
+                expectNoSeriesField();
+            }
+            break;
+        case Scope::Times:
+            if (!value.is_number_integer()) {
+                throw json_t::type_error::create(302, "series times must be integers", nullptr);
+            }
+            message_.series->back().times.push_back(value.get<int64_t>());
+            break;
+        case Scope::Values:
+            addSeriesValue(std::move(value));
+            break;
+        case Scope::Dom:
+            addToDom(std::move(value));
+            break;
+        default:
+            break;
+        }
+        return true;
+    }
+
+    bool inEntry() const { return !scopes_.empty() && scopes_.back() == Scope::Entry; }
+
+    /**
+     * Counts one more entry of the Batch, which is rejected as a whole past kMaxBatchSize
+     */
+    BatchItem &addEntry() {
+        if (message_.entries->size() == kMaxBatchSize) {
+            throw json_t::out_of_range::create(
+                403, std::format("a batch holds {} messages at most", kMaxBatchSize), nullptr);
+        }
+        return message_.entries->emplace_back();
+    }
+
+    void addEntryError() { addEntry().error = "A batched message must be an object"; }
+
+    void startEntry() {
+        auto &item = addEntry();
+        entry_ = std::make_unique<MessageDecoder>(item.message.emplace(), false);
+        entryDepth_ = 0;
+        push(Scope::Entry);
+    }
+
+    /**
+     * Hands an event over to the decoder of the current entry. Once the entry failed, the events
+     * up to its end are only counted.
+     *
+     * @param depth how the event changes the nesting depth within the entry
+     */
+    template <typename Event> bool forward(int depth, Event &&event) {
+        if (entry_) {
+            try {
+                event(*entry_);
+            } catch (json_t::exception const &ex) {
+                entry_.reset();
+                message_.entries->back() = BatchItem{.error = ex.what()};
+            }
+        }
+        entryDepth_ += depth;
+
+        if (entryDepth_ == 0) {
+            entry_.reset();
+            return pop();
+        }
+        return true;
+    }
+
+    bool isId() const {
+        return !scopes_.empty() && scopes_.back() == Scope::Envelope && field_ == Field::Id;
+    }
+
+    bool setMetricField(uint8_t bit, std::string &field, json_t::string_t &value) {
+        metricFields_ |= bit;
+        field = std::move(value);
+        return true;
+    }
+
+    void expectNot(Field field, char const *what) const {
+        if (field_ == field) {
+            throw json_t::type_error::create(302, what, nullptr);
+        }
+    }
+
+    void expectNoMetricField() const {
+        if (field_ == Field::MetricName || field_ == Field::MetricDescription ||
+            field_ == Field::MetricType) {
+            throw json_t::type_error::create(302, "metric fields must be strings", nullptr);
+        }
+    }
+
+    void expectNoSeriesField() const {
+        expectNot(Field::SeriesMetric, "the metric of a series must be a string");
+        expectNot(Field::Times, "series times must be an array");
+        expectNot(Field::Values, "series values must be an array");
+    }
+
+    void addSeriesValue(json_t &&value) {
+        auto &series = message_.series->back();
+
+        if (value.is_string()) {
+            series.strings.push_back(std::move(value.get_ref<std::string &>()));
+        } else if (value.is_number_float()) {
+            series.addNumber(value.get<double>());
+        } else if (value.is_number_integer()) {
+            series.addNumber(value.get<int64_t>());
+        } else {
+            throw json_t::type_error::create(302, "series values must be numbers or strings",
+                                             nullptr);
+        }
+    }
+
+    json_t *addToDom(json_t &&value) {
+        if (domStack_.empty()) {
+            *domTarget_ = std::move(value);
+            return domTarget_;
+        }
+        auto &parent = *domStack_.back();
+
+        if (parent.is_array()) {
+            parent.push_back(std::move(value));
+            return &parent.back();
+        }
+        *objectElement_ = std::move(value);
+        return objectElement_;
+    }
+
+    bool startDom(json_t &&container) {
+        domStack_.push_back(addToDom(std::move(container)));
+        return push(Scope::Dom);
+    }
+
+    bool push(Scope scope) {
+        scopes_.push_back(scope);
+        field_ = Field::None;
+        return true;
+    }
+
+    bool pop() {
+        if (scopes_.back() == Scope::Dom) {
+            domStack_.pop_back();
+        }
+        scopes_.pop_back();
+        field_ = Field::None;
+        return true;
+    }
+
+    Message &message_;
+    bool const withEntries_;
+    std::vector<Scope> scopes_;
+    Field field_ = Field::None;
+    uint8_t metricFields_ = 0;
+    json_t *domTarget_ = nullptr;
+    json_t *objectElement_ = nullptr;
+    std::vector<json_t *> domStack_;
+    // Decodes the Batch entry being parsed
+    std::unique_ptr<MessageDecoder> entry_;
+    int entryDepth_ = 0;
+};
+
+/**
+ * Decodes a frame in one pass, see MessageDecoder
+ *
+ * @throws nlohmann::json::exception when the frame is malformed
+ */
+inline Message decode(std::string_view data, WireFormat format) {
+    Message m;
+    MessageDecoder decoder{m};
+    nlohmann::json::sax_parse(data, &decoder,
+                              isBinary(format) ? nlohmann::json::input_format_t::msgpack
+                                               : nlohmann::json::input_format_t::json);
+    return m;
+}
+
+} // namespace eps::proto
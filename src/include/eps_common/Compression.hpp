@@ -0,0 +1,321 @@
+
+#pragma once
+
+#include "eps_common/Codec.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace eps::proto {
+
+//--------------------------------------------------------------------------------
+// Settings
+//--------------------------------------------------------------------------------
+
+/**
+ * How a peer deflates the frames it sends.
+ *
+ * The client opts into compression with a handshake header and the server then deflates what it
+ * sends to that client. Both peers always accept deflated frames.
+ */
+struct CompressionSettings {
+    // Approximate size of the inflate state besides its window, per the zlib documentation
+    static constexpr std::size_t kInflateStateSize = 7 * 1'024;
+
+    bool enabled = false;
+    // Frames smaller than this go out as they are, deflating them costs more than it saves
+    std::size_t threshold = 256;
+    // Keep the sliding window from one frame to the next. Repetitive traffic compresses much
+    // better, but the window has to be replayed in the same order on both sides
+    bool contextTakeover = true;
+    int level = Z_DEFAULT_COMPRESSION;
+    int windowBits = 15;
+    int memLevel = 8;
+
+    /**
+     * Memory of a deflate stream, per the zlib documentation
+     */
+    [[nodiscard]] std::size_t deflateMemory() const {
+        return (std::size_t{1} << (windowBits + 2)) + (std::size_t{1} << (memLevel + 9));
+    }
+
+    [[nodiscard]] std::size_t inflateMemory() const {
+        return (std::size_t{1} << windowBits) + kInflateStateSize;
+    }
+};
+
+static constexpr std::string_view kDeflate = "deflate";
+static constexpr std::string_view kNoContextTakeover = "no_context_takeover";
+
+/**
+ * Value of the handshake header a client sends to opt into compression
+ */
+inline std::string toHeaderValue(CompressionSettings const &settings) {
+    if (!settings.enabled) {
+        return {};
+    }
+    return settings.contextTakeover ? std::string{kDeflate}
+                                    : std::format("{}; {}", kDeflate, kNoContextTakeover);
+}
+
+/**
+ * Settings the server uses for a client, given the header value the client sent. Compression is
+ * only enabled when both sides want it, and a client can ask the server to not keep the context.
+ */
+inline CompressionSettings negotiateCompression(std::string_view offer,
+                                                CompressionSettings server) {
+    server.enabled = server.enabled && offer.starts_with(kDeflate);
+
+    if (offer.find(kNoContextTakeover) != std::string_view::npos) {
+        server.contextTakeover = false;
+    }
+    return server;
+}
+
+//--------------------------------------------------------------------------------
+// Frames
+//--------------------------------------------------------------------------------
+
+/**
+ * Deflated frames are binary frames laid out as: tag, flags, raw deflate data. Like RFC 7692 the
+ * data is flushed with Z_SYNC_FLUSH and the trailing 00 00 ff ff is left out of the frame.
+ *
+ * 0xc1 is never used by MessagePack, so the first byte tells a deflated frame from a plain one.
+ */
+static constexpr uint8_t kDeflatedTag = 0xC1;
+static constexpr uint8_t kFlagMsgPack = 0x01;
+// The frame was deflated without the context of the previous frames
+static constexpr uint8_t kFlagStandalone = 0x02;
+// Ends every Z_SYNC_FLUSH, it is left out of the frame and appended again before inflating
+static constexpr std::string_view kFlushTail{"\x00\x00\xff\xff", 4};
+
+inline bool isDeflated(std::string_view frame, bool isBinaryFrame) {
+    return isBinaryFrame && frame.size() >= 2 && static_cast<uint8_t>(frame[0]) == kDeflatedTag;
+}
+
+class CompressionError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+//--------------------------------------------------------------------------------
+// Deflater
+//--------------------------------------------------------------------------------
+
+/**
+ * Deflates the frames of one connection into a buffer reused from one frame to the next. With
+ * context takeover the frames must reach the peer in the order they were deflated.
+ */
+class Deflater {
+public:
+    explicit Deflater(CompressionSettings const &settings) : settings_{settings} {
+        if (deflateInit2(&stream_, settings_.level, Z_DEFLATED, -settings_.windowBits,
+                         settings_.memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw CompressionError{"Unable to initialize the deflate stream"};
+        }
+    }
+
+    ~Deflater() { deflateEnd(&stream_); }
+
+    Deflater(Deflater const &) = delete;
+    Deflater &operator=(Deflater const &) = delete;
+
+    /**
+     * @return the deflated frame, valid until the next call, or nullptr when the bytes should go
+     *         out as they are
+     */
+    std::string const *compress(std::string_view bytes, WireFormat format) {
+        if (bytes.size() < settings_.threshold) {
+            return nullptr;
+        }
+        uint8_t flags = isBinary(format) ? kFlagMsgPack : 0;
+
+        if (!settings_.contextTakeover) {
+            flags |= kFlagStandalone;
+        }
+        buffer_.assign({static_cast<char>(kDeflatedTag), static_cast<char>(flags)});
+
+        stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(bytes.data()));
+        stream_.avail_in = static_cast<uInt>(bytes.size());
+
+        do {
+            auto const offset = buffer_.size();
+            auto const chunkSize = std::max<std::size_t>(bytes.size() / 2, kMinChunkSize);
+            buffer_.resize(offset + chunkSize);
+            stream_.next_out = reinterpret_cast<Bytef *>(buffer_.data() + offset);
+            stream_.avail_out = static_cast<uInt>(chunkSize);
+
+            if (auto const ret = deflate(&stream_, Z_SYNC_FLUSH);
+                ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw CompressionError{std::format("deflate failed ({})", ret)};
+            }
+            buffer_.resize(offset + chunkSize - stream_.avail_out);
+        } while (stream_.avail_out == 0);
+
+        if (buffer_.ends_with(kFlushTail)) {
+            buffer_.resize(buffer_.size() - kFlushTail.size());
+        }
+        if (!settings_.contextTakeover) {
+            deflateReset(&stream_);
+
+            // Without context the peer has nothing to replay, so bigger output can be dropped
+            if (buffer_.size() >= bytes.size()) {
+                return nullptr;
+            }
+        }
+        return &buffer_;
+    }
+
+    [[nodiscard]] std::size_t memory() const { return settings_.deflateMemory(); }
+
+private:
+    static constexpr std::size_t kMinChunkSize = 1'024;
+
+    CompressionSettings const settings_;
+    z_stream stream_{};
+    std::string buffer_;
+};
+
+//--------------------------------------------------------------------------------
+// Inflater
+//--------------------------------------------------------------------------------
+
+/**
+ * Inflates the deflated frames of one connection. Frames deflated with context share one stream,
+ * standalone frames go through a second one that is reset every time, so both kinds can be
+ * interleaved on the same connection.
+ */
+class Inflater {
+public:
+    // Bound for a single inflated frame, so a small frame cannot blow up the memory
+    static constexpr std::size_t kMaxInflatedSize = 16 * 1'024 * 1'024;
+
+    explicit Inflater(int windowBits = 15) : windowBits_{windowBits} {}
+
+    ~Inflater() {
+        for (auto &stream : streams_) {
+            if (stream.initialized) {
+                inflateEnd(&stream.z);
+            }
+        }
+    }
+
+    Inflater(Inflater const &) = delete;
+    Inflater &operator=(Inflater const &) = delete;
+
+    /**
+     * @return the bytes of a deflated frame, valid until the next call, and their wire format
+     * @throws CompressionError when the frame is corrupted or inflates beyond kMaxInflatedSize
+     */
+    std::pair<std::string_view, WireFormat> inflate(std::string_view frame) {
+        auto const flags = static_cast<uint8_t>(frame[1]);
+        auto &stream = streams_[(flags & kFlagStandalone) != 0 ? 1 : 0];
+
+        if (!stream.initialized) {
+            if (inflateInit2(&stream.z, -windowBits_) != Z_OK) {
+                throw CompressionError{"Unable to initialize the inflate stream"};
+            }
+            stream.initialized = true;
+            memory_.fetch_add((std::size_t{1} << windowBits_) +
+                                  CompressionSettings::kInflateStateSize,
+                              std::memory_order_relaxed);
+        } else if ((flags & kFlagStandalone) != 0) {
+            inflateReset(&stream.z);
+        }
+        buffer_.clear();
+        feed(stream.z, frame.substr(2));
+        feed(stream.z, kFlushTail);
+
+        return {buffer_, (flags & kFlagMsgPack) != 0 ? WireFormat::MsgPack : WireFormat::Json};
+    }
+
+    /**
+     * Memory held by the inflate streams, safe to read from any thread
+     */
+    [[nodiscard]] std::size_t memory() const { return memory_.load(std::memory_order_relaxed); }
+
+private:
+    struct Stream {
+        z_stream z{};
+        bool initialized{false};
+    };
+
+    void feed(z_stream &z, std::string_view input) {
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+        z.avail_in = static_cast<uInt>(input.size());
+
+        int ret = Z_OK;
+
+        do {
+            auto const offset = buffer_.size();
+            auto const chunkSize = std::max<std::size_t>(input.size() * 4, kMinChunkSize);
+
+            if (offset + chunkSize > kMaxInflatedSize) {
+                throw CompressionError{"The inflated frame is too big"};
+            }
+            buffer_.resize(offset + chunkSize);
+            z.next_out = reinterpret_cast<Bytef *>(buffer_.data() + offset);
+            z.avail_out = static_cast<uInt>(chunkSize);
+
+            ret = ::inflate(&z, Z_SYNC_FLUSH);
+            buffer_.resize(offset + chunkSize - z.avail_out);
+
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw CompressionError{std::format("Corrupted deflated frame ({})", ret)};
+            }
+        } while (ret == Z_OK && (z.avail_in > 0 || z.avail_out == 0));
+
+        if (z.avail_in > 0) {
+            // Z_BUF_ERROR, no progress is possible with the input left
+            throw CompressionError{"Truncated deflated frame"};
+        }
+    }
+
+    static constexpr std::size_t kMinChunkSize = 1'024;
+
+    int const windowBits_;
+    std::array<Stream, 2> streams_;
+    std::string buffer_;
+    std::atomic<std::size_t> memory_{0};
+};
+
+//--------------------------------------------------------------------------------
+// Shared frames
+//--------------------------------------------------------------------------------
+
+/**
+ * Like freeze(m), also keeping standalone deflated copies for the peers that negotiated
+ * compression. Shared frames cannot use the context of a connection since they are deflated once
+ * for all of them.
+ */
+inline frame_ptr_t freeze(Message const &m, CompressionSettings settings) {
+    EncodedFrame frame{.json = encode(m, WireFormat::Json),
+                       .msgPack = encode(m, WireFormat::MsgPack)};
+
+    if (settings.enabled) {
+        settings.contextTakeover = false;
+        Deflater deflater{settings};
+
+        if (auto const *deflated = deflater.compress(frame.json, WireFormat::Json); deflated) {
+            frame.deflatedJson = *deflated;
+        }
+        if (auto const *deflated = deflater.compress(frame.msgPack, WireFormat::MsgPack);
+            deflated) {
+            frame.deflatedMsgPack = *deflated;
+        }
+    }
+    return std::make_shared<EncodedFrame const>(std::move(frame));
+}
+
+} // namespace eps::proto
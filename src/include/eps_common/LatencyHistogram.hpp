@@ -0,0 +1,108 @@
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace eps {
+
+/**
+ * Histogram of latencies with a bounded relative error, in the spirit of HdrHistogram.
+ *
+ * Values below kSubBuckets are counted exactly. Above, every power of two is split in
+ * kSubBuckets / 2 linear buckets, so a recorded value is off by less than 2 / kSubBuckets (about
+ * 1.6%) whatever its magnitude. Recording is a couple of bit operations and one increment, and
+ * histograms recorded by different threads are merged afterwards.
+ */
+class LatencyHistogram {
+public:
+    using duration_t = std::chrono::microseconds;
+
+    static constexpr unsigned kSubBucketBits = 7;
+    static constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+    static constexpr uint64_t kHalfSubBuckets = kSubBuckets / 2;
+    static constexpr std::size_t kBucketsCount =
+        kSubBuckets + (64 - kSubBucketBits) * kHalfSubBuckets;
+
+    void record(duration_t latency) {
+        auto const value = static_cast<uint64_t>(std::max<duration_t::rep>(latency.count(), 0));
+        ++counts_[indexOf(value)];
+        ++count_;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void merge(LatencyHistogram const &other) {
+        for (std::size_t i = 0; i < kBucketsCount; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    [[nodiscard]] uint64_t count() const { return count_; }
+
+    [[nodiscard]] duration_t min() const { return duration_t{count_ == 0 ? 0 : min_}; }
+
+    [[nodiscard]] duration_t max() const { return duration_t{max_}; }
+
+    [[nodiscard]] duration_t mean() const { return duration_t{count_ == 0 ? 0 : sum_ / count_}; }
+
+    /**
+     * @param percentile in [0, 100], e.g. 99.9
+     * @return the highest value of the bucket holding the percentile, never above max()
+     */
+    [[nodiscard]] duration_t percentile(double percentile) const {
+        if (count_ == 0) {
+            return duration_t{0};
+        }
+        auto const rank = static_cast<uint64_t>(
+            std::max(1.0, std::min(percentile, 100.0) / 100.0 * static_cast<double>(count_) + 0.5));
+        uint64_t seen = 0;
+
+        for (std::size_t i = 0; i < kBucketsCount; ++i) {
+            seen += counts_[i];
+
+            if (seen >= rank) {
+                return duration_t{std::min(highestValueOf(i), max_)};
+            }
+        }
+        return max();
+    }
+
+private:
+    static std::size_t indexOf(uint64_t value) {
+        if (value < kSubBuckets) {
+            return static_cast<std::size_t>(value);
+        }
+        // Keep the kSubBucketBits most significant bits, the first one is always set
+        auto const shift = static_cast<unsigned>(std::bit_width(value)) - kSubBucketBits;
+        return static_cast<std::size_t>(kSubBuckets + (shift - 1) * kHalfSubBuckets +
+                                        ((value >> shift) - kHalfSubBuckets));
+    }
+
+    static uint64_t highestValueOf(std::size_t index) {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        auto const shift = (index - kSubBuckets) / kHalfSubBuckets + 1;
+        auto const subBucket = (index - kSubBuckets) % kHalfSubBuckets + kHalfSubBuckets;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    std::array<uint64_t, kBucketsCount> counts_{};
+    uint64_t count_{0};
+    uint64_t sum_{0};
+    uint64_t min_{std::numeric_limits<uint64_t>::max()};
+    uint64_t max_{0};
+};
+
+} // namespace eps
@@ -0,0 +1,348 @@
+
+#pragma once
+
+#include <magic_enum.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Lines below this level are compiled out, e.g. -DEPS_LOG_MIN_LEVEL=2 keeps Info and above
+#ifndef EPS_LOG_MIN_LEVEL
+#define EPS_LOG_MIN_LEVEL 0
+#endif
+
+namespace eps::log {
+
+enum class Level : uint8_t { Trace, Debug, Info, Warning, Error, Off };
+
+/**
+ * Level below which lines are skipped before their arguments are formatted
+ */
+inline std::atomic<Level> threshold{Level::Info};
+
+inline bool enabled(Level level) { return level >= threshold.load(std::memory_order_relaxed); }
+
+//--------------------------------------------------------------------------------
+// Building blocks
+//--------------------------------------------------------------------------------
+
+/**
+ * Single producer, single consumer ring. The producer never waits: push fails when the ring is
+ * full.
+ */
+template <typename T, std::size_t N> class SpscRing {
+public:
+    static_assert(std::has_single_bit(N), "the capacity must be a power of two");
+
+    bool push(T &&value) {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+
+        if (tail - head_.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        slots_[tail & (N - 1)] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Calls f(T&&) with every value pushed so far, from the consumer thread
+     */
+    template <typename F> void drain(F &&f) {
+        auto head = head_.load(std::memory_order_relaxed);
+        auto const tail = tail_.load(std::memory_order_acquire);
+
+        for (; head != tail; ++head) {
+            f(std::move(slots_[head & (N - 1)]));
+        }
+        head_.store(head, std::memory_order_release);
+    }
+
+private:
+    alignas(64) std::atomic<uint64_t> head_{0};
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::unique_ptr<T[]> slots_{std::make_unique<T[]>(N)};
+};
+
+/**
+ * Admits at most kLinesPerSecond lines per second of one call site, and counts the others so the
+ * next line admitted tells how many were suppressed
+ */
+class RateLimit {
+public:
+    static constexpr uint32_t kLinesPerSecond = 20;
+
+    /**
+     * @return the lines suppressed since the last one admitted, none when this one is suppressed
+     */
+    std::optional<uint64_t> admit() {
+        using namespace std::chrono;
+
+        auto const now = duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+
+        if (auto window = window_.load(std::memory_order_relaxed);
+            window != now &&
+            window_.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+            count_.store(0, std::memory_order_relaxed);
+        }
+        if (count_.fetch_add(1, std::memory_order_relaxed) < kLinesPerSecond) {
+            return suppressed_.exchange(0, std::memory_order_relaxed);
+        }
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+private:
+    std::atomic<int64_t> window_{0};
+    std::atomic<uint32_t> count_{0};
+    std::atomic<uint64_t> suppressed_{0};
+};
+
+//--------------------------------------------------------------------------------
+// Logger
+//--------------------------------------------------------------------------------
+
+/**
+ * Asynchronous logger.
+ *
+ * Every thread formats its lines and pushes them to its own lock-free ring, a writer thread
+ * drains the rings every few milliseconds, orders the lines by time and writes them at once to
+ * the sink (stderr by default). A thread never waits for the sink: when its ring is full the line
+ * is dropped and the writer reports how many were.
+ *
+ * The level comes from the EPS_LOG_LEVEL environment variable (Info by default). Use the EPS_LOG_*
+ * macros, they skip the formatting of the lines below the level.
+ */
+class Logger {
+public:
+    using sink_func_t = std::function<void(std::string_view)>;
+
+    // Lines a thread can have waiting for the writer
+    static constexpr std::size_t kRingCapacity = 1'024;
+    static constexpr std::chrono::milliseconds kFlushInterval{10};
+
+    struct Record {
+        std::chrono::system_clock::time_point time;
+        Level level{Level::Info};
+        char const *file{""};
+        int line{0};
+        uint64_t suppressed{0};
+        std::string text;
+    };
+
+    static Logger &instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    Logger(Logger const &) = delete;
+    Logger &operator=(Logger const &) = delete;
+
+    ~Logger() {
+        writer_.request_stop();
+        writer_.join();
+    }
+
+    void level(Level level) { threshold.store(level, std::memory_order_relaxed); }
+
+    /**
+     * Replaces the sink, it is only called from the writer thread and flush
+     */
+    void sink(sink_func_t sink) {
+        std::lock_guard<std::mutex> _{writerMtx_};
+        sink_ = std::move(sink);
+    }
+
+    /**
+     * Queues a line from any thread, without locking
+     */
+    void write(Level level, char const *file, int line, uint64_t suppressed, std::string text) {
+        Record record{.time = std::chrono::system_clock::now(),
+                      .level = level,
+                      .file = file,
+                      .line = line,
+                      .suppressed = suppressed,
+                      .text = std::move(text)};
+
+        if (!local().push(std::move(record))) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Writes the lines queued so far before returning
+     */
+    void flush() {
+        std::lock_guard<std::mutex> _{writerMtx_};
+        drain();
+    }
+
+private:
+    using ring_t = SpscRing<Record, kRingCapacity>;
+
+    struct Producer {
+        ring_t ring;
+        // Set when the thread exits, the writer forgets the ring once it is drained
+        std::atomic<bool> closed{false};
+    };
+
+    /**
+     * Owned by a thread, closes its ring when the thread exits
+     */
+    struct ProducerHandle {
+        std::shared_ptr<Producer> producer;
+
+        ~ProducerHandle() {
+            if (producer) {
+                producer->closed.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() {
+        if (auto const *name = std::getenv("EPS_LOG_LEVEL"); name != nullptr) {
+            level(magic_enum::enum_cast<Level>(name, magic_enum::case_insensitive)
+                      .value_or(Level::Info));
+        }
+        writer_ = std::jthread([this](std::stop_token st) { run(st); });
+    }
+
+    ring_t &local() {
+        thread_local ProducerHandle handle;
+
+        if (!handle.producer) {
+            handle.producer = std::make_shared<Producer>();
+            std::lock_guard<std::mutex> _{producersMtx_};
+            producers_.push_back(handle.producer);
+        }
+        return handle.producer->ring;
+    }
+
+    void run(std::stop_token stopToken) {
+        std::mutex mtx;
+        std::condition_variable_any cv;
+
+        while (!stopToken.stop_requested()) {
+            flush();
+            std::unique_lock lock{mtx};
+            cv.wait_for(lock, stopToken, kFlushInterval, [] { return false; });
+        }
+        flush();
+    }
+
+    /**
+     * Writes the queued lines in time order, called with writerMtx_ held
+     */
+    void drain() {
+        std::vector<std::shared_ptr<Producer>> producers;
+        {
+            std::lock_guard<std::mutex> _{producersMtx_};
+            producers = producers_;
+            // A closed ring gets no more lines, this drain is its last one
+            std::erase_if(producers_, [](auto const &producer) {
+                return producer->closed.load(std::memory_order_acquire);
+            });
+        }
+        records_.clear();
+
+        for (auto const &producer : producers) {
+            producer->ring.drain([&](Record &&record) { records_.push_back(std::move(record)); });
+        }
+        if (auto const dropped = dropped_.exchange(0, std::memory_order_relaxed); dropped > 0) {
+            records_.push_back(Record{
+                .time = std::chrono::system_clock::now(),
+                .level = Level::Warning,
+                .file = __FILE__,
+                .line = __LINE__,
+                .text = std::format("{} lines dropped, the writer could not keep up", dropped)});
+        }
+        if (records_.empty()) {
+            return;
+        }
+        std::ranges::stable_sort(records_, {}, &Record::time);
+        buffer_.clear();
+
+        for (auto const &record : records_) {
+            format(buffer_, record);
+        }
+        sink_(buffer_);
+    }
+
+    static void format(std::string &out, Record const &record) {
+        using namespace std::chrono;
+
+        std::string_view file{record.file};
+        file = file.substr(file.find_last_of("/\\") + 1);
+
+        std::format_to(std::back_inserter(out), "{:%F %T} {:<7} {}:{} {}",
+                       floor<microseconds>(record.time), magic_enum::enum_name(record.level),
+                       file, record.line, record.text);
+        if (record.suppressed > 0) {
+            std::format_to(std::back_inserter(out), " ({} similar lines suppressed)",
+                           record.suppressed);
+        }
+        out += '\n';
+    }
+
+    static void writeToStderr(std::string_view text) {
+        std::fwrite(text.data(), 1, text.size(), stderr);
+        std::fflush(stderr);
+    }
+
+    std::mutex producersMtx_;
+    std::vector<std::shared_ptr<Producer>> producers_;
+    std::atomic<uint64_t> dropped_{0};
+
+    // Only used with writerMtx_ held
+    std::mutex writerMtx_;
+    sink_func_t sink_{&Logger::writeToStderr};
+    std::vector<Record> records_;
+    std::string buffer_;
+
+    std::jthread writer_;
+};
+
+} // namespace eps::log
+
+/**
+ * Logs a line formatted with std::format, e.g. EPS_LOG(Info, "{} connections", count). The
+ * arguments are not evaluated below the level, and a call site writes at most
+ * RateLimit::kLinesPerSecond lines per second.
+ */
+#define EPS_LOG(LEVEL, ...)                                                                        \
+    do {                                                                                           \
+        if constexpr (static_cast<int>(::eps::log::Level::LEVEL) >= EPS_LOG_MIN_LEVEL) {           \
+            if (::eps::log::enabled(::eps::log::Level::LEVEL)) {                                   \
+                static ::eps::log::RateLimit epsLogRateLimit;                                      \
+                if (auto const epsLogSuppressed = epsLogRateLimit.admit(); epsLogSuppressed) {     \
+                    ::eps::log::Logger::instance().write(::eps::log::Level::LEVEL, __FILE__,       \
+                                                         __LINE__, *epsLogSuppressed,              \
+                                                         std::format(__VA_ARGS__));                \
+                }                                                                                  \
+            }                                                                                      \
+        }                                                                                          \
+    } while (false)
+
+#define EPS_LOG_TRACE(...) EPS_LOG(Trace, __VA_ARGS__)
+#define EPS_LOG_DEBUG(...) EPS_LOG(Debug, __VA_ARGS__)
+#define EPS_LOG_INFO(...) EPS_LOG(Info, __VA_ARGS__)
+#define EPS_LOG_WARNING(...) EPS_LOG(Warning, __VA_ARGS__)
+#define EPS_LOG_ERROR(...) EPS_LOG(Error, __VA_ARGS__)
@@ -1,14 +1,26 @@
 
 #pragma once
 
+#include "eps_common/Logger.hpp"
+
 #include <crow.h>
 #include <magic_enum.hpp>
 #include <nlohmann/json.hpp>
 #include <semver.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <format>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace eps::proto {
 
@@ -22,15 +34,24 @@ enum class MessageType : uint32_t {
     Accepted,
 
     /* Request (Client -> Server) */
+    Hello,
     Version,
     GetUpdates,
     PushSettings,
+    Ingest,
+    Query,
+    Ack,
 
     /* Response (Server -> Client) */
     BadRequest,
     VersionUpdatesAvailable,
     Updates,
-    Deprecated
+    Deprecated,
+    NotModified,
+    Aggregates,
+
+    /* Both directions */
+    Batch
 };
 
 NLOHMANN_JSON_SERIALIZE_ENUM(MessageType,
@@ -39,21 +60,46 @@ NLOHMANN_JSON_SERIALIZE_ENUM(MessageType,
                                  {MessageType::BadRequest, "BadRequest"},
                                  {MessageType::NotSupported, "NotSupported"},
                                  {MessageType::Accepted, "Accepted"},
+                                 {MessageType::Hello, "Hello"},
                                  {MessageType::Version, "Version"},
                                  {MessageType::GetUpdates, "GetUpdates"},
                                  {MessageType::VersionUpdatesAvailable, "VersionUpdatesAvailable"},
                                  {MessageType::PushSettings, "PushSettings"},
+                                 {MessageType::Ingest, "Ingest"},
+                                 {MessageType::Query, "Query"},
+                                 {MessageType::Ack, "Ack"},
+                                 {MessageType::Aggregates, "Aggregates"},
                                  {MessageType::Updates, "Updates"},
                                  {MessageType::Deprecated, "Deprecated"},
+                                 {MessageType::NotModified, "NotModified"},
+                                 {MessageType::Batch, "Batch"},
                              })
 
 namespace keys {
 static constexpr std::string_view kRequest = "request";
 static constexpr std::string_view kType = "type";
+static constexpr std::string_view kId = "id";
 static constexpr std::string_view kPayload = "payload";
 static constexpr std::string_view kVersion = "version";
 static constexpr std::string_view kMetrics = "metrics";
 static constexpr std::string_view kError = "error";
+static constexpr std::string_view kHash = "hash";
+static constexpr std::string_view kBase = "base";
+static constexpr std::string_view kRemoved = "removed";
+static constexpr std::string_view kMessages = "messages";
+static constexpr std::string_view kSeries = "series";
+static constexpr std::string_view kMetric = "metric";
+static constexpr std::string_view kTimes = "times";
+static constexpr std::string_view kValues = "values";
+static constexpr std::string_view kAccepted = "accepted";
+static constexpr std::string_view kRejected = "rejected";
+static constexpr std::string_view kWindow = "window";
+static constexpr std::string_view kPercentiles = "percentiles";
+static constexpr std::string_view kCount = "count";
+static constexpr std::string_view kMin = "min";
+static constexpr std::string_view kMax = "max";
+static constexpr std::string_view kMean = "mean";
+static constexpr std::string_view kBytes = "bytes";
 static constexpr std::string kAvailability = "availability";
 static constexpr std::string kPerformance = "performance";
 } // namespace keys
@@ -69,15 +115,127 @@ struct Metric {
     std::string description;
     MetricType type;
     NLOHMANN_DEFINE_TYPE_INTRUSIVE(Metric, name, description, type)
+
+    bool operator==(Metric const &) const = default;
 };
 
 using metrics_umap_t = std::unordered_map<std::string, Metric>;
 
+/**
+ * Values of one metric carried by an Ingest message, column by column. Only the column of the
+ * value type is filled; integers sent for a Double metric are read as doubles.
+ */
+struct Series {
+    std::string metric;
+    // Microseconds since the epoch, one per value. When empty the server stamps the values with
+    // the time it received them
+    std::vector<int64_t> times;
+    std::vector<int64_t> integers;
+    std::vector<double> doubles;
+    std::vector<std::string> strings;
+
+    [[nodiscard]] std::size_t size() const {
+        return integers.size() + doubles.size() + strings.size();
+    }
+
+    /**
+     * Appends a number keeping the order of the values: once a double shows up, the integers
+     * read so far become doubles
+     */
+    void addNumber(double value) {
+        if (!integers.empty()) {
+            doubles.assign(integers.begin(), integers.end());
+            integers.clear();
+        }
+        doubles.push_back(value);
+    }
+
+    void addNumber(int64_t value) {
+        if (doubles.empty()) {
+            integers.push_back(value);
+        } else {
+            doubles.push_back(static_cast<double>(value));
+        }
+    }
+
+    /**
+     * @return why the series cannot be stored as it is, empty when it is well formed
+     */
+    [[nodiscard]] std::string_view malformed() const {
+        if (metric.empty()) {
+            return "series without a metric";
+        }
+        if ((!integers.empty() || !doubles.empty()) && !strings.empty()) {
+            return "values of a series must share one type";
+        }
+        if (!times.empty() && times.size() != size()) {
+            return "a series needs one time per value";
+        }
+        return {};
+    }
+};
+
+inline void to_json(nlohmann::json &json, Series const &series) {
+    json = nlohmann::json::object();
+    json[keys::kMetric] = series.metric;
+
+    if (!series.times.empty()) {
+        json[keys::kTimes] = series.times;
+    }
+    json[keys::kValues] = !series.strings.empty()   ? nlohmann::json(series.strings)
+                          : !series.doubles.empty() ? nlohmann::json(series.doubles)
+                                                    : nlohmann::json(series.integers);
+}
+
+inline void from_json(nlohmann::json const &json, Series &series) {
+    json.at(keys::kMetric).get_to(series.metric);
+
+    if (json.contains(keys::kTimes)) {
+        json.at(keys::kTimes).get_to(series.times);
+    }
+    for (auto const &value : json.at(keys::kValues)) {
+        if (value.is_string()) {
+            series.strings.push_back(value.get<std::string>());
+        } else if (value.is_number_float()) {
+            series.addNumber(value.get<double>());
+        } else {
+            series.addNumber(value.get<int64_t>());
+        }
+    }
+    if (auto const error = series.malformed(); !error.empty()) {
+        throw nlohmann::json::out_of_range::create(403, std::string{error}, &json);
+    }
+}
+
 metrics_umap_t const kMetricsDefault = {
     {keys::kAvailability, {.name = keys::kAvailability, .description = "The uptime", .type = MetricType::Double}},
     {keys::kPerformance, {.name = keys::kPerformance, .description = "The performance", .type = MetricType::Double}}
 };
 
+template <typename K, typename V> struct NotFoundInMapPred {
+    using map_t = std::unordered_map<K, V>;
+    map_t const &map;
+
+    explicit NotFoundInMapPred(map_t const &other) : map{other} {}
+
+    bool operator()(std::pair<K, V> const &element) const {
+        return map.find(element.first) == map.end();
+    }
+};
+
+/**
+ * @return the metrics of the server catalog the client does not have
+ */
+template <typename K, typename V>
+std::vector<std::pair<K, V>> findMissingMetrics(metrics_umap_t const &serverMetrics,
+                                                metrics_umap_t const &clientMetrics) {
+    std::vector<std::pair<K, V>> diff;
+
+    std::copy_if(serverMetrics.begin(), serverMetrics.end(), std::back_inserter(diff),
+                 NotFoundInMapPred<K, V>(clientMetrics));
+    return diff;
+}
+
 //--------------------------------------------------------------------------------
 // Message definitions
 //--------------------------------------------------------------------------------
@@ -86,98 +244,302 @@ struct Version {
     semver::version value;
 };
 
+struct EncodedFrame;
+struct BatchItem;
+
+// Sub-messages a Batch holds at most, a larger one is rejected as a whole
+static constexpr std::size_t kMaxBatchSize = 256;
+
 struct Message {
     MessageType type = MessageType::Uninitialized;
+    // Set by the client to match the response, which echoes it, with its request
+    std::optional<uint64_t> id;
+    // Any payload entry without a typed field below
     nlohmann::json payload;
+    // Typed payload entries, decoded straight from the frame without going through the payload
+    std::optional<std::string> version;
+    std::optional<std::vector<Metric>> metrics;
+    // Samples of an Ingest message
+    std::optional<std::vector<Series>> series;
+    // Sub-messages of a Batch to send, a received Batch is read with unbatch()
+    std::optional<std::vector<Message>> messages;
+    // Sub-messages of a received Batch, each decoded on its own
+    std::optional<std::vector<BatchItem>> entries;
+    // When set, the message was already encoded and the payload is not used to send it
+    std::shared_ptr<EncodedFrame const> frame;
 };
 
-inline Message toMessage(const nlohmann::json &json) {
+/**
+ * A sub-message of a Batch, or why its entry is not a message
+ */
+struct BatchItem {
+    std::optional<Message> message;
+    std::string error;
+};
+
+inline nlohmann::json toPayloadJson(Message const &m);
+
+/**
+ * The whole message as json, shared frames aside
+ */
+inline nlohmann::json toEnvelopeJson(Message const &m) {
+    nlohmann::json json = nlohmann::json::object();
+    json[keys::kType] = m.type;
+
+    if (m.id) {
+        json[keys::kId] = *m.id;
+    }
+    json[keys::kPayload] = toPayloadJson(m);
+    return json;
+}
+
+/**
+ * Merges the typed entries of the message back into its json payload
+ */
+inline nlohmann::json toPayloadJson(Message const &m) {
+    if (!m.version && !m.metrics && !m.series && !m.messages) {
+        return m.payload;
+    }
+    nlohmann::json payload = m.payload.is_object() ? m.payload : nlohmann::json::object();
+
+    if (m.version) {
+        payload[keys::kVersion] = *m.version;
+    }
+    if (m.metrics) {
+        payload[keys::kMetrics] = *m.metrics;
+    }
+    if (m.series) {
+        payload[keys::kSeries] = *m.series;
+    }
+    if (m.messages) {
+        auto &messages = payload[keys::kMessages] = nlohmann::json::array();
+
+        for (auto const &message : *m.messages) {
+            messages.push_back(toEnvelopeJson(message));
+        }
+    }
+    return payload;
+}
+
+/**
+ * @return the string stored under the key of a payload object, if there is one
+ */
+inline std::optional<std::string> stringEntry(nlohmann::json const &payload,
+                                              std::string_view key) {
+    if (payload.is_object()) {
+        if (auto it = payload.find(key); it != payload.end() && it->is_string()) {
+            return it->get<std::string>();
+        }
+    }
+    return std::nullopt;
+}
+
+/**
+ * @return the unsigned integer stored under the key of a payload object, if there is one
+ */
+inline std::optional<uint64_t> unsignedEntry(nlohmann::json const &payload, std::string_view key) {
+    if (payload.is_object()) {
+        if (auto it = payload.find(key); it != payload.end() && it->is_number_unsigned()) {
+            return it->get<uint64_t>();
+        }
+    }
+    return std::nullopt;
+}
+
+inline Message toMessage(const nlohmann::json &json, bool withEntries = true);
+
+/**
+ * @return the entries of a Batch payload, each read on its own so a malformed one only fails its
+ * own item
+ * @throws nlohmann::json::exception when there are more than kMaxBatchSize
+ */
+inline std::vector<BatchItem> toBatchItems(nlohmann::json const &entries) {
+    if (!entries.is_array()) {
+        throw nlohmann::json::type_error::create(302, "messages must be an array", &entries);
+    }
+    if (entries.size() > kMaxBatchSize) {
+        throw nlohmann::json::out_of_range::create(
+            403, std::format("a batch holds {} messages at most", kMaxBatchSize), &entries);
+    }
+    std::vector<BatchItem> items;
+    items.reserve(entries.size());
+
+    for (auto const &entry : entries) {
+        if (!entry.is_object()) {
+            items.push_back({.error = "A batched message must be an object"});
+            continue;
+        }
+        try {
+            // A nested Batch keeps its entries in the payload, the server rejects it anyway
+            items.push_back({.message = toMessage(entry, false)});
+        } catch (nlohmann::json::exception const &ex) {
+            items.push_back({.error = ex.what()});
+        }
+    }
+    return items;
+}
+
+/**
+ * @param withEntries whether the entries of a Batch are read, see toBatchItems
+ */
+inline Message toMessage(const nlohmann::json &json, bool withEntries) {
     Message m;
     if (json.contains(keys::kType)) {
         json.at(keys::kType).get_to(m.type);
     }
+    if (json.contains(keys::kId)) {
+        auto const &id = json.at(keys::kId);
+
+        // get<uint64_t> would convert -1 and 1.5, the streaming decoder rejects them too
+        if (!id.is_number_unsigned()) {
+            throw nlohmann::json::type_error::create(302, "id must be an unsigned integer", &id);
+        }
+        m.id = id.get<uint64_t>();
+    }
     if (json.contains(keys::kPayload)) {
         json.at(keys::kPayload).get_to(m.payload);
     }
+    if (m.payload.contains(keys::kVersion)) {
+        m.version = m.payload.at(keys::kVersion).get<std::string>();
+        m.payload.erase(keys::kVersion);
+    }
+    if (m.payload.contains(keys::kMetrics)) {
+        m.metrics = m.payload.at(keys::kMetrics).get<std::vector<Metric>>();
+        m.payload.erase(keys::kMetrics);
+    }
+    if (m.payload.contains(keys::kSeries)) {
+        m.series = m.payload.at(keys::kSeries).get<std::vector<Series>>();
+        m.payload.erase(keys::kSeries);
+    }
+    if (withEntries && m.payload.contains(keys::kMessages)) {
+        m.entries = toBatchItems(m.payload.at(keys::kMessages));
+        m.payload.erase(keys::kMessages);
+    }
     return m;
 }
 
+/**
+ * Takes the sub-messages out of a Batch, the decoders already read its entries one by one
+ */
+inline std::vector<BatchItem> unbatch(Message &&batch) {
+    std::vector<BatchItem> items;
+
+    if (batch.entries) {
+        items = std::move(*batch.entries);
+    } else if (batch.messages) {
+        items.reserve(batch.messages->size());
+
+        for (auto &&message : *batch.messages) {
+            items.push_back({.message = std::move(message)});
+        }
+    }
+    return items;
+}
+
 inline std::string toString(Message const &m) {
-    return std::format(R"({{"type": "{}", "payload": {}}})",
-                       std::string{magic_enum::enum_name(m.type)}, m.payload.dump());
+    return std::format(R"({{"type": "{}", {}"payload": {}}})",
+                       std::string{magic_enum::enum_name(m.type)},
+                       m.id ? std::format(R"("id": {}, )", *m.id) : std::string{},
+                       toPayloadJson(m).dump());
 }
 
 //--------------------------------------------------------------------------------
 //  Handlers
 //--------------------------------------------------------------------------------
 
-using handle_func_t = std::function<std::optional<Message>(Message &&)>;
+/**
+ * Handler of one message type, receiving the context of the dispatcher first
+ */
+template <typename... Context>
+using basic_handle_func_t = std::function<std::optional<Message>(Context &..., Message &&)>;
+
+using handle_func_t = basic_handle_func_t<>;
 
 /**
- * A value based handler
+ * A value based handler.
+ *
+ * Handlers live in an array indexed by MessageType and sized at compile time, so dispatching a
+ * message is a bounds check and an indexed call. A response echoes the id of the message it
+ * answers, so the handlers never deal with it.
+ *
+ * The Context the handlers receive with every message is whatever the dispatcher keeps between
+ * messages, e.g. the session of the connection on the server.
  */
-class MessageHandler {
+template <typename... Context> class BasicMessageHandler {
 public:
-    using self_t = MessageHandler;
+    using self_t = BasicMessageHandler;
+    using func_t = basic_handle_func_t<Context...>;
 
-    self_t &onBadRequest(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::BadRequest, f));
-        return *this;
-    }
+    static constexpr std::size_t kTypesCount = magic_enum::enum_count<MessageType>();
 
-    self_t &onNotSupported(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::NotSupported, f));
-        return *this;
-    }
+    static_assert(magic_enum::enum_values<MessageType>().back() ==
+                      MessageType{static_cast<uint32_t>(kTypesCount - 1)},
+                  "MessageType values must be contiguous and start at zero");
 
-    self_t &onAccepted(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::Accepted, f));
-        return *this;
-    }
+    self_t &onBadRequest(func_t f) { return on<MessageType::BadRequest>(std::move(f)); }
 
-    self_t &onVersion(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::Version, f));
-        return *this;
-    }
+    self_t &onNotSupported(func_t f) { return on<MessageType::NotSupported>(std::move(f)); }
 
-    self_t &onGetUpdates(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::GetUpdates, f));
-        return *this;
-    }
+    self_t &onAccepted(func_t f) { return on<MessageType::Accepted>(std::move(f)); }
 
-    self_t &onVersionUpdatesAvailable(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::VersionUpdatesAvailable, f));
-        return *this;
-    }
+    self_t &onHello(func_t f) { return on<MessageType::Hello>(std::move(f)); }
 
-    self_t &onUpdates(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::Updates, f));
-        return *this;
-    }
+    self_t &onVersion(func_t f) { return on<MessageType::Version>(std::move(f)); }
 
-    self_t &onPushSettings(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::PushSettings, f));
-        return *this;
+    self_t &onGetUpdates(func_t f) { return on<MessageType::GetUpdates>(std::move(f)); }
+
+    self_t &onVersionUpdatesAvailable(func_t f) {
+        return on<MessageType::VersionUpdatesAvailable>(std::move(f));
     }
 
-    self_t &onDeprecated(handle_func_t f) {
-        handlers_.insert(std::make_pair(MessageType::Deprecated, f));
+    self_t &onUpdates(func_t f) { return on<MessageType::Updates>(std::move(f)); }
+
+    self_t &onPushSettings(func_t f) { return on<MessageType::PushSettings>(std::move(f)); }
+
+    self_t &onIngest(func_t f) { return on<MessageType::Ingest>(std::move(f)); }
+
+    self_t &onQuery(func_t f) { return on<MessageType::Query>(std::move(f)); }
+
+    self_t &onAck(func_t f) { return on<MessageType::Ack>(std::move(f)); }
+
+    self_t &onAggregates(func_t f) { return on<MessageType::Aggregates>(std::move(f)); }
+
+    self_t &onDeprecated(func_t f) { return on<MessageType::Deprecated>(std::move(f)); }
+
+    self_t &onNotModified(func_t f) { return on<MessageType::NotModified>(std::move(f)); }
+
+    self_t &onBatch(func_t f) { return on<MessageType::Batch>(std::move(f)); }
+
+    template <MessageType Type> self_t &on(func_t f) {
+        std::get<std::to_underlying(Type)>(handlers_) = std::move(f);
         return *this;
     }
 
-    [[nodiscard]] std::optional<Message> process(Message &&message) const {
-        Message response;
+    [[nodiscard]] std::optional<Message> process(Context &...context, Message &&message) const {
+        auto const index = std::to_underlying(message.type);
 
-        if (!handlers_.contains(message.type)) {
+        if (index >= kTypesCount || !handlers_[index]) {
+            EPS_LOG_DEBUG("No handler for {} messages", magic_enum::enum_name(message.type));
+            Message response;
             response.type = MessageType::NotSupported;
-            response.payload = message.payload;
+            response.id = message.id;
+            response.payload = std::move(message.payload);
+            response.version = std::move(message.version);
+            response.metrics = std::move(message.metrics);
             return response;
         }
-        auto runHandler = handlers_.at(message.type);
-        return runHandler(std::move(message));
+        auto const id = message.id;
+        auto response = handlers_[index](context..., std::move(message));
+
+        if (response && !response->id) {
+            response->id = id;
+        }
+        return response;
     }
 
-    std::unordered_map<MessageType, handle_func_t> handlers_;
+    std::array<func_t, kTypesCount> handlers_;
 };
 
+using MessageHandler = BasicMessageHandler<>;
+
 } // namespace eps::proto
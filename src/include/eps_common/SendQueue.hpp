@@ -0,0 +1,243 @@
+
+#pragma once
+
+#include "Protocol.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace eps {
+
+/**
+ * What a connection does with a frame that does not fit in its send queue
+ */
+enum class OverflowPolicy : uint8_t {
+    // The frame is lost, the connection goes on
+    Drop,
+    // The connection is closed, a peer that far behind is better off starting over
+    Disconnect
+};
+
+struct SendQueueSettings {
+    // Bytes sent and not yet written to the peer past which the connection stops sending and
+    // queues the frames instead, until they are down to the low watermark
+    std::size_t highWatermark{1'024 * 1'024};
+    std::size_t lowWatermark{256 * 1'024};
+    // Bytes the queue holds at most, the policy applies to the frames past them
+    std::size_t maxQueued{4 * 1'024 * 1'024};
+    OverflowPolicy overflow{OverflowPolicy::Disconnect};
+    // Peers that never confirm what they were written: their bytes are assumed written at
+    // legacyRate bytes per second, the policy applies to the frames past legacyBudget in flight
+    std::size_t legacyBudget{4 * 1'024 * 1'024};
+    std::size_t legacyRate{1'024 * 1'024};
+};
+
+/**
+ * Outgoing frames of a connection, bounded in bytes.
+ *
+ * The frames wait in the queue while the transport is not writable: once the bytes in flight, sent
+ * and not yet confirmed written, reach the high watermark, the connection is only writable again
+ * when they are down to the low watermark, so it does not flip on every confirmation. A frame
+ * may supersede the queued one of the same kind (e.g. the latest VersionUpdatesAvailable is the
+ * only one worth sending), it then takes its place in the queue.
+ *
+ * Not thread-safe, the connection owning it serializes the calls.
+ */
+class SendQueue {
+public:
+    struct Frame {
+        std::string bytes;
+        bool binary{false};
+        // Frames of the same kind supersede each other, the others never do
+        std::optional<proto::MessageType> kind;
+    };
+
+    enum class Push : uint8_t { Sent, Queued, Coalesced, Overflow };
+
+    explicit SendQueue(SendQueueSettings settings = {}) : settings_{settings} {}
+
+    [[nodiscard]] SendQueueSettings const &settings() const { return settings_; }
+
+    /**
+     * Takes a frame to send: it leaves right away while the transport is writable and no frame
+     * waits before it, it is queued otherwise. A peer that never confirms what it was written
+     * stops being writable past the high watermark, and then overflows the queue.
+     *
+     * @return Sent when the caller sends the frame now, its bytes are then in flight
+     */
+    Push offer(std::string const &bytes, bool binary,
+               std::optional<proto::MessageType> kind = std::nullopt) {
+        if (writable_ && frames_.empty()) {
+            sent(bytes.size());
+            return Push::Sent;
+        }
+        return push({.bytes = bytes, .binary = binary, .kind = kind});
+    }
+
+    /**
+     * @return Overflow when the frame does not fit, the queue is left as it was
+     */
+    Push push(Frame frame) {
+        if (frame.kind) {
+            auto const it = std::ranges::find(frames_, frame.kind, &Frame::kind);
+
+            if (it != frames_.end() &&
+                queued_ - it->bytes.size() + frame.bytes.size() <= settings_.maxQueued) {
+                queued_ = queued_ - it->bytes.size() + frame.bytes.size();
+                // The superseded frame leaves its place, the latest one goes after the frames
+                // queued meanwhile
+                frames_.erase(it);
+                frames_.push_back(std::move(frame));
+                ++coalesced_;
+                return Push::Coalesced;
+            }
+        }
+        if (queued_ + frame.bytes.size() > settings_.maxQueued) {
+            ++overflows_;
+            return Push::Overflow;
+        }
+        queued_ += frame.bytes.size();
+        frames_.push_back(std::move(frame));
+        return Push::Queued;
+    }
+
+    [[nodiscard]] bool empty() const { return frames_.empty(); }
+
+    [[nodiscard]] Frame const &front() const { return frames_.front(); }
+
+    /**
+     * Takes the first frame out to send it, its bytes are in flight until written()
+     */
+    Frame pop() {
+        auto frame = std::move(frames_.front());
+        frames_.pop_front();
+        queued_ -= frame.bytes.size();
+        sent(frame.bytes.size());
+        return frame;
+    }
+
+    /**
+     * Counts the bytes of a frame sent without going through the queue
+     */
+    void sent(std::size_t bytes) {
+        inFlight_ += bytes;
+
+        if (inFlight_ >= settings_.highWatermark) {
+            writable_ = false;
+        }
+    }
+
+    /**
+     * Confirms bytes sent earlier reached the peer
+     */
+    void written(std::size_t bytes) {
+        inFlight_ -= std::min(bytes, inFlight_);
+
+        if (inFlight_ <= settings_.lowWatermark) {
+            writable_ = true;
+        }
+    }
+
+    /**
+     * Whether a frame can be sent now, instead of queued
+     */
+    [[nodiscard]] bool writable() const { return writable_; }
+
+    [[nodiscard]] std::size_t size() const { return frames_.size(); }
+
+    [[nodiscard]] std::size_t queuedBytes() const { return queued_; }
+
+    [[nodiscard]] std::size_t inFlightBytes() const { return inFlight_; }
+
+    [[nodiscard]] uint64_t coalesced() const { return coalesced_; }
+
+    [[nodiscard]] uint64_t overflows() const { return overflows_; }
+
+    /**
+     * Drops the queued frames, e.g. when the connection is lost. What was in flight is lost too.
+     */
+    void clear() {
+        frames_.clear();
+        queued_ = 0;
+        inFlight_ = 0;
+        writable_ = true;
+    }
+
+private:
+    SendQueueSettings const settings_;
+    std::deque<Frame> frames_;
+    std::size_t queued_{0};
+    std::size_t inFlight_{0};
+    bool writable_{true};
+    uint64_t coalesced_{0};
+    uint64_t overflows_{0};
+};
+
+/**
+ * Bound of a peer that never confirms what it was written, e.g. a client older than the Ack.
+ *
+ * Its bytes are assumed written at a steady rate, and a frame that would take the estimate of
+ * the bytes in flight past the budget does not go. A peer that stopped reading piles up at most
+ * the budget at once and the rate over time, there is nothing to wait for before sending the
+ * frames again so they are never queued.
+ *
+ * Not thread-safe, the connection owning it serializes the calls.
+ */
+class SendBudget {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    SendBudget(std::size_t budget, std::size_t bytesPerSecond)
+        : budget_{budget}
+        , rate_{bytesPerSecond} {}
+
+    /**
+     * @return whether the frame can be sent, its bytes are then in flight
+     */
+    bool spend(std::size_t bytes, clock_t::time_point now = clock_t::now()) {
+        drain(now);
+
+        if (inFlight_ + bytes > budget_) {
+            ++overflows_;
+            return false;
+        }
+        inFlight_ += bytes;
+        return true;
+    }
+
+    /**
+     * Estimate of the bytes sent and not yet written, as of the last frame
+     */
+    [[nodiscard]] std::size_t inFlightBytes() const { return inFlight_; }
+
+    [[nodiscard]] uint64_t overflows() const { return overflows_; }
+
+private:
+    void drain(clock_t::time_point now) {
+        if (now <= drainedAt_) {
+            return;
+        }
+        auto const elapsed = std::chrono::duration<double>(now - drainedAt_).count();
+        auto const drained = static_cast<std::size_t>(elapsed * static_cast<double>(rate_));
+
+        // The time of less than a byte is kept for the next frame
+        if (drained > 0) {
+            inFlight_ -= std::min(drained, inFlight_);
+            drainedAt_ = now;
+        }
+    }
+
+    std::size_t const budget_;
+    std::size_t const rate_;
+    std::size_t inFlight_{0};
+    clock_t::time_point drainedAt_{clock_t::now()};
+    uint64_t overflows_{0};
+};
+
+} // namespace eps
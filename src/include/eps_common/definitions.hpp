@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 namespace eps::defs {
@@ -13,6 +14,13 @@ namespace ws {
     static constexpr std::string kServerCertificate = "server.crt";
     static constexpr std::string kServerKey = "server.key";
     static constexpr std::string kServerPem = "server.pem";
+    static constexpr std::string kWireFormatHeader = "X-Eps-Wire-Format";
+    static constexpr std::string kCompressionHeader = "X-Eps-Compression";
+    // A client sending kFlowControlAck in this header acknowledges the bytes it read every
+    // kAckInterval, the server then only lets so many in flight to it
+    static constexpr std::string kFlowControlHeader = "X-Eps-Flow-Control";
+    static constexpr std::string kFlowControlAck = "ack";
+    static constexpr std::size_t kAckInterval = 64 * 1'024;
 }
 
 } // namespace eps::defs
@@ -0,0 +1,254 @@
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+// The AVX2 kernels are built on every x86-64 build and only run when the CPU has AVX2
+#if defined(__x86_64__) || defined(_M_X64)
+#define EPS_AVX2_KERNELS
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+// GCC and Clang only emit AVX2 instructions in the functions that ask for it, MSVC anywhere
+#define EPS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#include <intrin.h>
+#define EPS_TARGET_AVX2
+#endif
+#endif
+
+namespace eps {
+
+/**
+ * Count, sum, min and max of a set of samples. Aggregates merge, so the aggregate of a window is
+ * the merge of the aggregates of its pieces.
+ */
+struct Aggregate {
+    std::size_t count{0};
+    double sum{0};
+    double min{std::numeric_limits<double>::infinity()};
+    double max{-std::numeric_limits<double>::infinity()};
+
+    void add(double value) {
+        ++count;
+        sum += value;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void merge(Aggregate const &other) {
+        count += other.count;
+        sum += other.sum;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    [[nodiscard]] double mean() const { return count > 0 ? sum / static_cast<double>(count) : 0; }
+};
+
+//--------------------------------------------------------------------------------
+// Scalar kernels, the baseline and the fallback
+//--------------------------------------------------------------------------------
+
+namespace scalar {
+
+template <typename T> Aggregate aggregate(std::span<T const> values) {
+    Aggregate result;
+
+    for (auto const value : values) {
+        result.add(static_cast<double>(value));
+    }
+    return result;
+}
+
+/**
+ * Aggregates the values whose time is at or after from
+ */
+template <typename T>
+Aggregate aggregateSince(std::span<int64_t const> times, std::span<T const> values, int64_t from) {
+    Aggregate result;
+
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        if (times[i] >= from) {
+            result.add(static_cast<double>(values[i]));
+        }
+    }
+    return result;
+}
+
+} // namespace scalar
+
+//--------------------------------------------------------------------------------
+// Vectorized kernels
+//--------------------------------------------------------------------------------
+
+#if defined(EPS_AVX2_KERNELS)
+
+/**
+ * Whether the CPU runs the AVX2 kernels, checked once
+ */
+inline bool hasAvx2() {
+    static bool const supported = [] {
+#if defined(__AVX2__)
+        return true;
+#elif defined(__GNUC__)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+#else
+        // AVX2 in the CPU, and the OS saving the YMM registers
+        std::array<int, 4> info{};
+        __cpuid(info.data(), 1);
+
+        if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 0x6) != 0x6) {
+            return false;
+        }
+        __cpuidex(info.data(), 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#endif
+    }();
+    return supported;
+}
+
+namespace avx2 {
+
+EPS_TARGET_AVX2 inline Aggregate reduce(__m256d sum, __m256d min, __m256d max, std::size_t count) {
+    std::array<double, 4> sums{};
+    std::array<double, 4> mins{};
+    std::array<double, 4> maxs{};
+    _mm256_storeu_pd(sums.data(), sum);
+    _mm256_storeu_pd(mins.data(), min);
+    _mm256_storeu_pd(maxs.data(), max);
+
+    return Aggregate{.count = count,
+                     .sum = (sums[0] + sums[1]) + (sums[2] + sums[3]),
+                     .min = std::min(std::min(mins[0], mins[1]), std::min(mins[2], mins[3])),
+                     .max = std::max(std::max(maxs[0], maxs[1]), std::max(maxs[2], maxs[3]))};
+}
+
+EPS_TARGET_AVX2 inline Aggregate aggregate(std::span<double const> values) {
+    auto sum = _mm256_setzero_pd();
+    auto min = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    auto max = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    auto const *data = values.data();
+    std::size_t i = 0;
+
+    for (; i + 4 <= values.size(); i += 4) {
+        auto const v = _mm256_loadu_pd(data + i);
+        sum = _mm256_add_pd(sum, v);
+        min = _mm256_min_pd(min, v);
+        max = _mm256_max_pd(max, v);
+    }
+    auto result = reduce(sum, min, max, i);
+    result.merge(scalar::aggregate(values.subspan(i)));
+    return result;
+}
+
+EPS_TARGET_AVX2 inline Aggregate aggregateSince(std::span<int64_t const> times,
+                                                std::span<double const> values, int64_t from) {
+    if (from == std::numeric_limits<int64_t>::min()) {
+        return aggregate(values);
+    }
+    // times > from - 1, AVX2 only compares for greater
+    auto const threshold = _mm256_set1_epi64x(from - 1);
+    auto const inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    auto const minusInf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+    auto sum = _mm256_setzero_pd();
+    auto min = inf;
+    auto max = minusInf;
+    std::size_t count = 0;
+    std::size_t i = 0;
+
+    for (; i + 4 <= values.size(); i += 4) {
+        auto const t = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(times.data() + i));
+        auto const mask = _mm256_castsi256_pd(_mm256_cmpgt_epi64(t, threshold));
+        auto const v = _mm256_loadu_pd(values.data() + i);
+
+        sum = _mm256_add_pd(sum, _mm256_and_pd(mask, v));
+        min = _mm256_min_pd(min, _mm256_blendv_pd(inf, v, mask));
+        max = _mm256_max_pd(max, _mm256_blendv_pd(minusInf, v, mask));
+        count += static_cast<std::size_t>(std::popcount(
+            static_cast<unsigned>(_mm256_movemask_pd(mask))));
+    }
+    auto result = reduce(sum, min, max, count);
+    result.merge(scalar::aggregateSince(times.subspan(i), values.subspan(i), from));
+    return result;
+}
+
+} // namespace avx2
+
+#endif
+
+/**
+ * Aggregates a contiguous column, with AVX2 when the CPU has it. Integer columns go through the
+ * scalar kernel: AVX2 has no 64 bits integer min, max nor conversion to double.
+ */
+template <typename T> Aggregate aggregate(std::span<T const> values) {
+#if defined(EPS_AVX2_KERNELS)
+    if constexpr (std::is_same_v<T, double>) {
+        if (hasAvx2()) {
+            return avx2::aggregate(values);
+        }
+    }
+#endif
+    return scalar::aggregate(values);
+}
+
+template <typename T>
+Aggregate aggregateSince(std::span<int64_t const> times, std::span<T const> values, int64_t from) {
+#if defined(EPS_AVX2_KERNELS)
+    if constexpr (std::is_same_v<T, double>) {
+        if (hasAvx2()) {
+            return avx2::aggregateSince(times, values, from);
+        }
+    }
+#endif
+    return scalar::aggregateSince(times, values, from);
+}
+
+/**
+ * Nearest rank percentiles of the values, which are reordered
+ *
+ * @param ranks percentiles between 0 and 100
+ * @return one value per rank, in the order of the ranks
+ */
+inline std::vector<double> percentiles(std::vector<double> &values, std::span<double const> ranks) {
+    std::vector<double> result(ranks.size(), 0);
+
+    if (values.empty()) {
+        return result;
+    }
+    // Selecting from the lowest rank up, every selection only looks at the values above the last
+    std::vector<std::size_t> order(ranks.size());
+
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::ranges::sort(order, {}, [&](std::size_t i) { return ranks[i]; });
+    auto begin = values.begin();
+
+    for (auto const i : order) {
+        auto const rank = std::clamp(ranks[i], 0.0, 100.0);
+        auto const index = static_cast<std::size_t>(
+            std::ceil(rank / 100 * static_cast<double>(values.size())));
+        auto const nth = values.begin() +
+                         static_cast<std::ptrdiff_t>(std::min(index > 0 ? index - 1 : 0,
+                                                              values.size() - 1));
+        if (nth >= begin) {
+            std::nth_element(begin, nth, values.end());
+            begin = nth;
+        }
+        result[i] = *nth;
+    }
+    return result;
+}
+
+} // namespace eps
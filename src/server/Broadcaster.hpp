@@ -0,0 +1,101 @@
+
+#pragma once
+
+#include "ConnectionRegistry.hpp"
+#include "eps_common/Codec.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace eps {
+
+struct BroadcastReport {
+    std::size_t recipients{0};
+    // Connections closed between the snapshot of the registry and their turn to be sent
+    std::size_t skipped{0};
+    // Sum of the frames queued, deflated or not depending on the connection
+    std::size_t bytes{0};
+    std::chrono::microseconds encodeTime{0};
+    // Time until every connection had the frame queued on its IO thread
+    std::chrono::microseconds fanOutTime{0};
+};
+
+/**
+ * Sends one message to every open connection.
+ *
+ * The message is encoded (and deflated) once into an immutable frame shared by all the sends,
+ * and the connections are split among a few threads that hand the frame over to the IO thread
+ * owning each connection. The registry is only locked to take a snapshot of its sessions, so
+ * connections keep opening and closing while the broadcast runs.
+ */
+class Broadcaster {
+public:
+    // Below this many connections per thread it is cheaper to not spawn more threads
+    static constexpr std::size_t kMinConnectionsPerThread = 1'024;
+
+    explicit Broadcaster(ConnectionRegistry &registry,
+                         proto::CompressionSettings const &compression = {},
+                         std::size_t threadsCount = std::thread::hardware_concurrency())
+        : registry_{registry}
+        , compression_{compression}
+        , threadsCount_{std::max<std::size_t>(1, threadsCount)} {}
+
+    BroadcastReport broadcast(proto::Message const &message) {
+        using clock_t = std::chrono::steady_clock;
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+
+        BroadcastReport report;
+        auto const start = clock_t::now();
+        auto const frame = proto::freeze(message, compression_);
+        auto const encoded = clock_t::now();
+        auto const sessions = registry_.sessions();
+
+        auto const threadsCount = std::clamp<std::size_t>(
+            sessions.size() / kMinConnectionsPerThread, 1, threadsCount_);
+        auto const chunkSize = (sessions.size() + threadsCount - 1) / threadsCount;
+        std::atomic<std::size_t> sent{0};
+        std::atomic<std::size_t> bytes{0};
+
+        auto fanOut = [&](std::size_t begin, std::size_t end) {
+            std::size_t count = 0;
+            std::size_t size = 0;
+
+            for (auto i = begin; i < end; ++i) {
+                // A newer broadcast of the same type supersedes the one still queued
+                auto const frameSize = sessions[i]->send(*frame, message.type);
+                count += frameSize > 0 ? 1 : 0;
+                size += frameSize;
+            }
+            sent.fetch_add(count, std::memory_order_relaxed);
+            bytes.fetch_add(size, std::memory_order_relaxed);
+        };
+        {
+            std::vector<std::jthread> workers;
+
+            for (std::size_t begin = chunkSize; begin < sessions.size(); begin += chunkSize) {
+                workers.emplace_back(fanOut, begin, std::min(begin + chunkSize, sessions.size()));
+            }
+            fanOut(0, std::min(chunkSize, sessions.size()));
+        }
+        report.recipients = sent.load();
+        report.bytes = bytes.load();
+        report.skipped = sessions.size() - report.recipients;
+        report.encodeTime = duration_cast<microseconds>(encoded - start);
+        report.fanOutTime = duration_cast<microseconds>(clock_t::now() - encoded);
+        return report;
+    }
+
+private:
+    ConnectionRegistry &registry_;
+    proto::CompressionSettings const compression_;
+    std::size_t const threadsCount_;
+};
+
+} // namespace eps
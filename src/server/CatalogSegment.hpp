@@ -0,0 +1,161 @@
+
+#pragma once
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace eps {
+
+/**
+ * The catalog of the server in a shared memory segment: the control process publishes it, the
+ * worker processes map the segment read-only and follow it.
+ *
+ * The catalog is stored as the Updates record the StateLog keeps (version and metrics in
+ * MsgPack) behind a sequence lock: the sequence is odd while the control process writes, and a
+ * reader retries the copy it made when the sequence moved meanwhile. The writer never waits for
+ * the readers, which never write to the segment.
+ */
+class CatalogSegment {
+public:
+    // Bytes of the encoded catalog at most, thousands of metrics fit in it
+    static constexpr std::size_t kCapacity = 16U << 20U;
+    static constexpr uint64_t kMagic = 0x4550'5343'4154'0001; // "EPSCAT" and the layout version
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "The sequence is shared between processes, it needs lock-free atomics");
+
+    /**
+     * Creates the segment for the control process, or takes over the one a previous control
+     * process left behind
+     */
+    static CatalogSegment create(std::string name) {
+        namespace ipc = boost::interprocess;
+
+        ipc::shared_memory_object shm{ipc::open_or_create, name.c_str(), ipc::read_write, 0600};
+        shm.truncate(sizeof(Header) + kCapacity);
+        CatalogSegment segment{std::move(name), ipc::mapped_region{shm, ipc::read_write}};
+        new (segment.region_.get_address()) Header{};
+        return segment;
+    }
+
+    /**
+     * Maps the segment of the control process read-only, for a worker process
+     */
+    static CatalogSegment open(std::string name) {
+        namespace ipc = boost::interprocess;
+
+        ipc::shared_memory_object shm{ipc::open_only, name.c_str(), ipc::read_only};
+        CatalogSegment segment{std::move(name), ipc::mapped_region{shm, ipc::read_only}};
+
+        if (segment.region_.get_size() < sizeof(Header) + kCapacity ||
+            segment.header().magic.load(std::memory_order_acquire) != kMagic) {
+            throw std::runtime_error(
+                std::format("Not a catalog segment [{}]", segment.name_));
+        }
+        return segment;
+    }
+
+    /**
+     * Removes the segment, the processes that mapped it keep their mapping
+     */
+    static void remove(std::string const &name) {
+        boost::interprocess::shared_memory_object::remove(name.c_str());
+    }
+
+    [[nodiscard]] std::string const &name() const { return name_; }
+
+    /**
+     * Publishes a catalog, from the control process only
+     *
+     * @param record Updates message with the version and the metrics
+     */
+    void publish(proto::Message const &record) {
+        auto const bytes = proto::encode(record, proto::WireFormat::MsgPack);
+
+        if (bytes.size() > kCapacity) {
+            throw std::runtime_error(std::format(
+                "The catalog ({} bytes) does not fit in the segment [{}]", bytes.size(), name_));
+        }
+        auto &header = this->header();
+        auto const sequence = header.sequence.load(std::memory_order_relaxed);
+
+        header.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(data(), bytes.data(), bytes.size());
+        header.size.store(bytes.size(), std::memory_order_relaxed);
+        header.sequence.store(sequence + 2, std::memory_order_release);
+        header.magic.store(kMagic, std::memory_order_release);
+    }
+
+    /**
+     * Number of catalogs published, 0 before the first one
+     */
+    [[nodiscard]] uint64_t generation() const {
+        return header().sequence.load(std::memory_order_acquire) / 2;
+    }
+
+    /**
+     * Reads the catalog when it is newer than the one last read
+     *
+     * @param generation of the catalog last read, updated to the one returned
+     * @return nullopt when nothing was published since, or a catalog is being published
+     */
+    [[nodiscard]] std::optional<proto::Message> readNewer(uint64_t &generation) const {
+        auto const &header = this->header();
+        std::string bytes;
+
+        while (true) {
+            auto const before = header.sequence.load(std::memory_order_acquire);
+
+            // While the control process writes, the next call reads the catalog. It may have died
+            // halfway, waiting for it would never end
+            if (before % 2 == 1 || before / 2 == generation) {
+                return std::nullopt;
+            }
+            auto const size = std::min<std::size_t>(header.size.load(std::memory_order_relaxed),
+                                                    kCapacity);
+            bytes.assign(data(), size);
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (header.sequence.load(std::memory_order_relaxed) == before) {
+                generation = before / 2;
+                break;
+            }
+        }
+        return proto::decode(bytes, proto::WireFormat::MsgPack);
+    }
+
+private:
+    struct Header {
+        std::atomic<uint64_t> magic{0};
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> size{0};
+    };
+
+    CatalogSegment(std::string name, boost::interprocess::mapped_region region)
+        : name_{std::move(name)}, region_{std::move(region)} {}
+
+    Header &header() const { return *static_cast<Header *>(region_.get_address()); }
+
+    char *data() const { return static_cast<char *>(region_.get_address()) + sizeof(Header); }
+
+    std::string name_;
+    boost::interprocess::mapped_region region_;
+};
+
+} // namespace eps
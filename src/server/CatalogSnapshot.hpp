@@ -0,0 +1,139 @@
+
+#pragma once
+
+#include "MetricCatalog.hpp"
+#include "eps_common/Codec.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Immutable view of the metrics catalog for one server version.
+ *
+ * A new snapshot is published every time the catalog changes and readers share it through a
+ * reference counted pointer, so the GetUpdates responses are encoded once per catalog version
+ * instead of once per request.
+ *
+ * The catalog is identified by a hash of its version and metrics. Clients send back the hash they
+ * know and get either NotModified, the changes since that catalog when it is one of the recent
+ * ones, or the full catalog.
+ *
+ * The metrics keep the ids of the previous catalog, so the deltas and the comparisons with the
+ * catalog of a client are set operations.
+ */
+struct CatalogSnapshot {
+    using ptr_t = std::shared_ptr<CatalogSnapshot const>;
+
+    // How many previous catalogs get a pre-encoded delta
+    static constexpr std::size_t kDeltaHistory = 8;
+
+    proto::Version version;
+    MetricCatalog metrics;
+    std::string hash;
+    proto::frame_ptr_t updates;
+    proto::frame_ptr_t notModified;
+    // Updates with only the changes since an older catalog, keyed by the hash of that catalog
+    std::unordered_map<std::string, proto::frame_ptr_t> deltas;
+
+    static ptr_t make(proto::Version version, proto::metrics_umap_t metrics,
+                      proto::CompressionSettings const &compression = {},
+                      std::span<ptr_t const> history = {}) {
+        CatalogSnapshot snapshot{
+            .version = std::move(version),
+            .metrics = MetricCatalog::make(metrics, history.empty() ? nullptr
+                                                                    : &history.back()->metrics)};
+        snapshot.hash = hashOf(snapshot.version, snapshot.metrics);
+
+        proto::Message updates{.type = proto::MessageType::Updates,
+                               .version = snapshot.version.value.to_string(),
+                               .metrics = std::vector<proto::Metric>{}};
+        updates.metrics->reserve(snapshot.metrics.size());
+        snapshot.metrics.forEach([&](proto::Metric const &m) { updates.metrics->push_back(m); });
+        updates.payload[proto::keys::kHash] = snapshot.hash;
+        snapshot.updates = proto::freeze(updates, compression);
+
+        proto::Message notModified{.type = proto::MessageType::NotModified};
+        notModified.payload[proto::keys::kHash] = snapshot.hash;
+        snapshot.notModified = proto::freeze(notModified);
+
+        for (auto const &previous : history | std::views::reverse) {
+            if (snapshot.deltas.size() == kDeltaHistory) {
+                break;
+            }
+            if (previous->hash != snapshot.hash && snapshot.metrics.sharesIds(previous->metrics)) {
+                auto delta = proto::freeze(snapshot.deltaFrom(*previous), compression);
+                snapshot.deltas.emplace(previous->hash, std::move(delta));
+            }
+        }
+        return std::make_shared<CatalogSnapshot const>(std::move(snapshot));
+    }
+
+    /**
+     * FNV-1a over the version and the metrics sorted by name, so equal catalogs hash the same
+     * whatever the order of the map
+     */
+    static std::string hashOf(proto::Version const &version, MetricCatalog const &metrics) {
+        std::vector<proto::Metric const *> sorted;
+        sorted.reserve(metrics.size());
+        metrics.forEach([&](proto::Metric const &m) { sorted.push_back(&m); });
+
+        std::ranges::sort(sorted, {}, &proto::Metric::name);
+
+        uint64_t hash = 14'695'981'039'346'656'037ULL;
+        auto mix = [&hash](std::string_view bytes) {
+            for (char c : bytes) {
+                hash = (hash ^ static_cast<uint8_t>(c)) * 1'099'511'628'211ULL;
+            }
+            // Separator, so ("ab", "c") and ("a", "bc") differ
+            hash = (hash ^ 0xFFU) * 1'099'511'628'211ULL;
+        };
+        mix(version.value.to_string());
+
+        for (auto const *m : sorted) {
+            mix(m->name);
+            mix(m->description);
+            mix(magic_enum::enum_name(m->type));
+        }
+        return std::format("{:016x}", hash);
+    }
+
+private:
+    /**
+     * Only for a base sharing the ids of the metrics
+     */
+    proto::Message deltaFrom(CatalogSnapshot const &base) const {
+        proto::Message delta{.type = proto::MessageType::Updates,
+                             .version = version.value.to_string(),
+                             .metrics = std::vector<proto::Metric>{}};
+        nlohmann::json removed = nlohmann::json::array();
+
+        (metrics.members() - base.metrics.members()).forEach([&](MetricCatalog::id_t id) {
+            delta.metrics->push_back(metrics[id]);
+        });
+        (metrics.members() & base.metrics.members()).forEach([&](MetricCatalog::id_t id) {
+            if (metrics[id] != base.metrics[id]) {
+                delta.metrics->push_back(metrics[id]);
+            }
+        });
+        (base.metrics.members() - metrics.members()).forEach([&](MetricCatalog::id_t id) {
+            removed.push_back(metrics.ids().name(id));
+        });
+        delta.payload[proto::keys::kHash] = hash;
+        delta.payload[proto::keys::kBase] = base.hash;
+        delta.payload[proto::keys::kRemoved] = removed;
+        return delta;
+    }
+};
+
+} // namespace eps
@@ -0,0 +1,93 @@
+
+#pragma once
+
+#include "Session.hpp"
+
+#include <crow.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Keeps the open websocket connections and their sessions.
+ *
+ * Connections are spread over independent shards, each one with its own lock, so connections
+ * opening and closing on different IO threads rarely wait for each other. The message hot path
+ * does not use the registry at all: it reaches the session through the connection userdata.
+ */
+class ConnectionRegistry {
+public:
+    using session_ptr_t = std::shared_ptr<Session>;
+
+    static constexpr std::size_t kShardsCount = 16;
+
+    void add(crow::websocket::connection &conn, session_ptr_t session) {
+        auto &shard = shardOf(conn);
+        std::lock_guard<std::mutex> _{shard.mtx};
+        shard.sessions.emplace(&conn, std::move(session));
+        size_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the session of the connection, null when the connection was never added
+     */
+    session_ptr_t remove(crow::websocket::connection &conn) {
+        auto &shard = shardOf(conn);
+        std::lock_guard<std::mutex> _{shard.mtx};
+
+        auto const it = shard.sessions.find(&conn);
+
+        if (it == shard.sessions.end()) {
+            return nullptr;
+        }
+        auto session = std::move(it->second);
+        shard.sessions.erase(it);
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return session;
+    }
+
+    /**
+     * Copies the sessions of every shard, locking one shard at a time. The sessions stay alive
+     * while the caller holds them even if their connections close meanwhile.
+     */
+    [[nodiscard]] std::vector<session_ptr_t> sessions() {
+        std::vector<session_ptr_t> all;
+        all.reserve(size());
+
+        for (auto &shard : shards_) {
+            std::lock_guard<std::mutex> _{shard.mtx};
+
+            for (auto &&[conn, session] : shard.sessions) {
+                all.push_back(session);
+            }
+        }
+        return all;
+    }
+
+    [[nodiscard]] std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        std::unordered_map<crow::websocket::connection *, session_ptr_t> sessions;
+    };
+
+    Shard &shardOf(crow::websocket::connection &conn) {
+        // Heap addresses are aligned, so mix their bits before picking a shard
+        auto const address = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(&conn));
+        return shards_[(address * 0x9E3779B97F4A7C15ULL >> 32) % kShardsCount];
+    }
+
+    std::array<Shard, kShardsCount> shards_;
+    std::atomic<std::size_t> size_{0};
+};
+
+} // namespace eps
@@ -0,0 +1,244 @@
+
+#pragma once
+
+#include "eps_common/Logger.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Runs a task of an executor. An exception it lets out is logged and goes no further: it would
+ * end the process from the worker thread, or leave a SerialQueue waiting for a turn that never
+ * ends.
+ */
+inline void runTask(std::function<void()> const &task) noexcept {
+    try {
+        task();
+    } catch (std::exception const &ex) {
+        EPS_LOG_ERROR("A task failed: {}", ex.what());
+    } catch (...) {
+        EPS_LOG_ERROR("A task failed with an unknown exception");
+    }
+}
+
+/**
+ * Fixed set of threads running tasks, each thread with its own queue.
+ *
+ * Tasks submitted from outside the pool are spread round robin over the queues, the ones a worker
+ * submits go to its own queue. A worker out of tasks steals from the others before sleeping, so
+ * one slow task only delays the tasks queued behind it until another worker takes them.
+ *
+ * Stopping the pool runs every task queued before, a task submitted once the workers looked at its
+ * queue for the last time runs on the submitting thread, so no task is ever lost.
+ */
+class WorkStealingPool {
+public:
+    using task_t = std::function<void()>;
+
+    explicit WorkStealingPool(std::size_t threadsCount = std::thread::hardware_concurrency())
+        : queues_(std::max<std::size_t>(1, threadsCount)) {
+        workers_.reserve(queues_.size());
+
+        for (std::size_t i = 0; i < queues_.size(); ++i) {
+            workers_.emplace_back([this, i] { work(i); });
+        }
+    }
+
+    WorkStealingPool(WorkStealingPool const &) = delete;
+    WorkStealingPool &operator=(WorkStealingPool const &) = delete;
+
+    /**
+     * Runs the tasks already submitted, then joins the workers
+     */
+    ~WorkStealingPool() {
+        stopping_.store(true, std::memory_order_release);
+        wakeups_.fetch_add(1, std::memory_order_release);
+        wakeups_.notify_all();
+        workers_.clear();
+    }
+
+    /**
+     * Queues a task from any thread, or runs it right away when the pool stopped
+     */
+    void submit(task_t task) {
+        auto const &current = Current::get();
+        auto const index = current.pool == this
+                               ? current.index
+                               : next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        {
+            auto &queue = queues_[index];
+            std::unique_lock lock{queue.mtx};
+
+            // Checked under the lock the workers take for their last look at the queue
+            if (stopping_.load(std::memory_order_acquire)) {
+                lock.unlock();
+                runTask(task);
+                return;
+            }
+            queue.tasks.push_back(std::move(task));
+            pending_.fetch_add(1, std::memory_order_relaxed);
+        }
+        wakeups_.fetch_add(1, std::memory_order_release);
+        wakeups_.notify_one();
+    }
+
+    [[nodiscard]] std::size_t threadsCount() const { return queues_.size(); }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex mtx;
+        std::deque<task_t> tasks;
+    };
+
+    // The worker the calling thread is, to keep the tasks a worker submits local
+    struct Current {
+        WorkStealingPool const *pool{nullptr};
+        std::size_t index{0};
+
+        static Current &get() {
+            thread_local Current current;
+            return current;
+        }
+    };
+
+    void work(std::size_t index) {
+        Current::get() = Current{.pool = this, .index = index};
+
+        while (true) {
+            // Read before looking for a task, a task submitted after the look changes it
+            auto const wakeups = wakeups_.load(std::memory_order_acquire);
+            auto const stopping = stopping_.load(std::memory_order_acquire);
+            auto task = take(index, false);
+
+            // Queued tasks behind busy locks, or the last look before stopping: wait for the locks
+            if (!task && (stopping || pending_.load(std::memory_order_relaxed) > 0)) {
+                task = take(index, true);
+            }
+            if (task) {
+                runTask(*task);
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
+            wakeups_.wait(wakeups, std::memory_order_acquire);
+        }
+    }
+
+    /**
+     * @param wait whether to wait for the locks of the other queues, or skip the busy ones
+     * @return the oldest task of the worker queue, or else one stolen from the newest of another
+     */
+    std::optional<task_t> take(std::size_t index, bool wait) {
+        {
+            auto &own = queues_[index];
+            std::lock_guard<std::mutex> _{own.mtx};
+
+            if (!own.tasks.empty()) {
+                auto task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                // Uncounted under the lock it was counted under, the count never goes below 0
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        for (std::size_t i = 1; i < queues_.size(); ++i) {
+            auto &victim = queues_[(index + i) % queues_.size()];
+            std::unique_lock lock{victim.mtx, std::defer_lock};
+
+            if (wait) {
+                lock.lock();
+            } else if (!lock.try_lock()) {
+                continue;
+            }
+            if (!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                pending_.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<Queue> queues_;
+    // Tasks in the queues, changed under the lock of the queue
+    std::atomic<std::size_t> pending_{0};
+    // Bumped by every submit and by the stop, the idle workers wait for it to change
+    std::atomic<uint64_t> wakeups_{0};
+    std::atomic<std::size_t> next_{0};
+    std::atomic<bool> stopping_{false};
+    // Last, so the workers stop before the queues go away
+    std::vector<std::jthread> workers_;
+};
+
+/**
+ * Runs its tasks one at a time and in order on a WorkStealingPool, e.g. the messages of one
+ * connection. Only one task of the queue is in the pool at a time, and after kTasksPerTurn tasks
+ * the queue goes back at the end of the pool so a busy connection does not hold a worker.
+ */
+class SerialQueue : public std::enable_shared_from_this<SerialQueue> {
+public:
+    using task_t = WorkStealingPool::task_t;
+
+    static constexpr std::size_t kTasksPerTurn = 16;
+
+    explicit SerialQueue(WorkStealingPool &pool) : pool_{pool} {}
+
+    void post(task_t task) {
+        {
+            std::lock_guard<std::mutex> _{mtx_};
+            tasks_.push_back(std::move(task));
+
+            if (scheduled_) {
+                return;
+            }
+            scheduled_ = true;
+        }
+        schedule();
+    }
+
+private:
+    void schedule() {
+        pool_.submit([self = shared_from_this()] { self->run(); });
+    }
+
+    void run() {
+        for (std::size_t i = 0; i < kTasksPerTurn; ++i) {
+            task_t task;
+            {
+                std::lock_guard<std::mutex> _{mtx_};
+
+                if (tasks_.empty()) {
+                    scheduled_ = false;
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            runTask(task);
+        }
+        schedule();
+    }
+
+    WorkStealingPool &pool_;
+    std::mutex mtx_;
+    std::deque<task_t> tasks_;
+    // Whether a turn of the queue is in the pool
+    bool scheduled_{false};
+};
+
+} // namespace eps
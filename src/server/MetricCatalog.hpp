@@ -0,0 +1,241 @@
+
+#pragma once
+
+#include "eps_common/Protocol.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Set of metric ids, one bit per id, so comparing two catalogs is a few word operations
+ */
+class MetricSet {
+public:
+    using id_t = uint32_t;
+
+    void insert(id_t id) {
+        if (id / 64 >= words_.size()) {
+            words_.resize(id / 64 + 1);
+        }
+        words_[id / 64] |= bit(id);
+    }
+
+    [[nodiscard]] bool contains(id_t id) const {
+        return id / 64 < words_.size() && (words_[id / 64] & bit(id)) != 0;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        std::size_t count = 0;
+
+        for (auto word : words_) {
+            count += std::popcount(word);
+        }
+        return count;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return std::ranges::all_of(words_, [](auto word) { return word == 0; });
+    }
+
+    /**
+     * @return the ids of this set missing from other
+     */
+    [[nodiscard]] MetricSet operator-(MetricSet const &other) const {
+        auto difference = *this;
+
+        for (std::size_t i = 0; i < std::min(words_.size(), other.words_.size()); ++i) {
+            difference.words_[i] &= ~other.words_[i];
+        }
+        return difference;
+    }
+
+    [[nodiscard]] MetricSet operator&(MetricSet const &other) const {
+        MetricSet intersection;
+        intersection.words_.resize(std::min(words_.size(), other.words_.size()));
+
+        for (std::size_t i = 0; i < intersection.words_.size(); ++i) {
+            intersection.words_[i] = words_[i] & other.words_[i];
+        }
+        return intersection;
+    }
+
+    /**
+     * Calls f(id) for every id of the set, in increasing order
+     */
+    template <typename F> void forEach(F &&f) const {
+        for (std::size_t i = 0; i < words_.size(); ++i) {
+            for (auto word = words_[i]; word != 0; word &= word - 1) {
+                f(static_cast<id_t>(i * 64 + std::countr_zero(word)));
+            }
+        }
+    }
+
+private:
+    static constexpr uint64_t bit(id_t id) { return uint64_t{1} << (id % 64); }
+
+    std::vector<uint64_t> words_;
+};
+
+/**
+ * Dense ids of the metric names. An id is never reused, so the MetricSets of the catalogs sharing
+ * the ids compare; a catalog with new names gets an extended copy of the ids of the previous one,
+ * the ones published are never changed.
+ */
+class MetricIds {
+public:
+    using id_t = MetricSet::id_t;
+
+    [[nodiscard]] std::optional<id_t> find(std::string_view name) const {
+        if (auto const it = ids_.find(name); it != ids_.end()) {
+            return it->second;
+        }
+        return std::nullopt;
+    }
+
+    id_t intern(std::string const &name) {
+        auto const [it, added] = ids_.try_emplace(name, static_cast<id_t>(names_.size()));
+
+        if (added) {
+            names_.push_back(name);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] std::string const &name(id_t id) const { return names_[id]; }
+
+    [[nodiscard]] std::size_t size() const { return names_.size(); }
+
+    /**
+     * Ids with the same generation come from the same first catalog, they mean the same names
+     */
+    [[nodiscard]] uint64_t generation() const { return generation_; }
+
+private:
+    // Looks names up by string_view without building a string
+    struct Hash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    static inline std::atomic<uint64_t> nextGeneration_{0};
+
+    std::unordered_map<std::string, id_t, Hash, std::equal_to<>> ids_;
+    std::vector<std::string> names_;
+    uint64_t generation_{nextGeneration_.fetch_add(1, std::memory_order_relaxed)};
+};
+
+/**
+ * Metrics catalog on interned ids: the descriptors sit in an array indexed by id and the
+ * membership is a MetricSet. Immutable once made.
+ */
+class MetricCatalog {
+public:
+    using id_t = MetricIds::id_t;
+
+    // Past this many ids that are not in the catalog anymore, a catalog starts over with new ids
+    // instead of extending the previous ones, which then compare no more
+    static constexpr std::size_t kMaxStaleIds = 4'096;
+
+    MetricCatalog() = default;
+
+    /**
+     * @param previous catalog whose ids to keep, so the sets of the two compare
+     */
+    static MetricCatalog make(proto::metrics_umap_t const &metrics,
+                              MetricCatalog const *previous = nullptr) {
+        MetricCatalog catalog;
+
+        if (previous != nullptr && previous->ids_->size() <= metrics.size() + kMaxStaleIds) {
+            catalog.ids_ = previous->ids_;
+        }
+        // Copied on write, the previous catalog may be read meanwhile
+        std::shared_ptr<MetricIds> extended;
+
+        for (auto &&[name, metric] : metrics) {
+            auto id = catalog.ids_->find(name);
+
+            if (!id) {
+                if (!extended) {
+                    extended = std::make_shared<MetricIds>(*catalog.ids_);
+                    catalog.ids_ = extended;
+                }
+                id = extended->intern(name);
+            }
+            catalog.members_.insert(*id);
+        }
+        catalog.descriptors_.resize(catalog.ids_->size());
+
+        for (auto &&[name, metric] : metrics) {
+            catalog.descriptors_[*catalog.ids_->find(name)] = metric;
+        }
+        return catalog;
+    }
+
+    [[nodiscard]] MetricSet const &members() const { return members_; }
+
+    [[nodiscard]] MetricIds const &ids() const { return *ids_; }
+
+    [[nodiscard]] std::size_t size() const { return members_.size(); }
+
+    /**
+     * Whether the sets of the two catalogs compare, their ids mean the same names
+     */
+    [[nodiscard]] bool sharesIds(MetricCatalog const &other) const {
+        return ids_->generation() == other.ids_->generation();
+    }
+
+    /**
+     * Only valid for an id of the catalog
+     */
+    [[nodiscard]] proto::Metric const &operator[](id_t id) const { return descriptors_[id]; }
+
+    [[nodiscard]] proto::Metric const *find(std::string_view name) const {
+        auto const id = ids_->find(name);
+        return id && members_.contains(*id) ? &descriptors_[*id] : nullptr;
+    }
+
+    /**
+     * @return the ids of the metrics named like one of the catalog, the other names are skipped
+     */
+    [[nodiscard]] MetricSet setOf(std::span<proto::Metric const> metrics) const {
+        MetricSet set;
+
+        for (auto const &metric : metrics) {
+            if (auto const id = ids_->find(metric.name); id) {
+                set.insert(*id);
+            }
+        }
+        return set;
+    }
+
+    /**
+     * Calls f(metric) for every metric of the catalog, in the order of their ids
+     */
+    template <typename F> void forEach(F &&f) const {
+        members_.forEach([&](id_t id) { f(descriptors_[id]); });
+    }
+
+private:
+    std::shared_ptr<MetricIds const> ids_{std::make_shared<MetricIds const>()};
+    // Indexed by id, only the members are set
+    std::vector<proto::Metric> descriptors_;
+    MetricSet members_;
+};
+
+} // namespace eps
@@ -0,0 +1,443 @@
+
+#pragma once
+
+#include "Aggregation.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace eps {
+
+//--------------------------------------------------------------------------------
+// Columns
+//--------------------------------------------------------------------------------
+
+/**
+ * Fixed size ring of samples kept as two parallel columns, the times and the values. The samples
+ * of the ring are contiguous in at most two pieces, so they can be scanned without gathering.
+ *
+ * The ring is split in blocks that keep a summary of their samples up to date on every push: the
+ * time range and, for numbers, the Aggregate. A window query takes the summary of the blocks
+ * entirely inside the window and only scans the blocks across its start, so polling a window does
+ * not scan its history again. A block restarts empty when the ring wraps onto it.
+ */
+template <typename T> class SampleRing {
+public:
+    using value_t = T;
+
+    static constexpr bool kNumeric = std::is_arithmetic_v<T>;
+
+    // Upper bound of the samples of a block, rings are split in about kBlocksCount blocks
+    static constexpr std::size_t kMaxBlockSize = 1'024;
+    static constexpr std::size_t kBlocksCount = 8;
+    // Bytes a sample takes in the columns, not counting what a string allocates
+    static constexpr std::size_t kSampleBytes = sizeof(int64_t) + sizeof(T);
+
+    struct BlockSummary {
+        int64_t minTime{std::numeric_limits<int64_t>::max()};
+        int64_t maxTime{std::numeric_limits<int64_t>::min()};
+        Aggregate aggregate;
+    };
+
+    SampleRing() = default;
+
+    explicit SampleRing(std::size_t capacity)
+        : blockSize_{std::clamp<std::size_t>(capacity / kBlocksCount, 1, kMaxBlockSize)}
+        , times_((capacity + blockSize_ - 1) / blockSize_ * blockSize_)
+        , values_(times_.size())
+        , blocks_(times_.size() / blockSize_) {}
+
+    void push(int64_t time, T value) {
+        auto const slot = written_ % times_.size();
+        auto &block = blocks_[slot / blockSize_];
+
+        if (slot % blockSize_ == 0) {
+            block = BlockSummary{};
+        }
+        block.minTime = std::min(block.minTime, time);
+        block.maxTime = std::max(block.maxTime, time);
+
+        if constexpr (kNumeric) {
+            block.aggregate.add(static_cast<double>(value));
+        } else {
+            ++block.aggregate.count;
+        }
+        times_[slot] = time;
+        values_[slot] = std::move(value);
+        ++written_;
+    }
+
+    /**
+     * Aggregates the samples at or after from. When values is set it also gets their values,
+     * to compute percentiles.
+     */
+    Aggregate aggregateSince(int64_t from, std::vector<double> *values) const
+        requires kNumeric
+    {
+        Aggregate result;
+
+        for (std::size_t b = 0; b < blocks_.size(); ++b) {
+            auto const &block = blocks_[b];
+
+            if (block.aggregate.count == 0 || block.maxTime < from) {
+                continue;
+            }
+            auto const offset = b * blockSize_;
+            auto const blockTimes = std::span{times_}.subspan(offset, block.aggregate.count);
+            auto const blockValues = std::span{values_}.subspan(offset, block.aggregate.count);
+
+            if (block.minTime >= from) {
+                result.merge(block.aggregate);
+
+                if (values != nullptr) {
+                    values->insert(values->end(), blockValues.begin(), blockValues.end());
+                }
+                continue;
+            }
+            result.merge(eps::aggregateSince(blockTimes, blockValues, from));
+
+            if (values != nullptr) {
+                for (std::size_t i = 0; i < blockValues.size(); ++i) {
+                    if (blockTimes[i] >= from) {
+                        values->push_back(static_cast<double>(blockValues[i]));
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return static_cast<std::size_t>(std::min<uint64_t>(written_, times_.size()));
+    }
+
+    [[nodiscard]] std::size_t capacity() const { return times_.size(); }
+
+    /**
+     * Samples pushed since the ring was created, the oldest ones are overwritten once it is full
+     */
+    [[nodiscard]] uint64_t written() const { return written_; }
+
+    /**
+     * Calls f(times, values) with the samples from the oldest to the newest, in one or two pieces
+     */
+    template <typename F> void forEachPiece(F &&f) const {
+        auto const count = size();
+
+        if (count == 0) {
+            return;
+        }
+        auto const start = static_cast<std::size_t>((written_ - count) % capacity());
+        auto const first = std::min(count, capacity() - start);
+        f(std::span{times_}.subspan(start, first), std::span{values_}.subspan(start, first));
+
+        if (first < count) {
+            f(std::span{times_}.first(count - first), std::span{values_}.first(count - first));
+        }
+    }
+
+private:
+    std::size_t blockSize_{1};
+    std::vector<int64_t> times_;
+    std::vector<T> values_;
+    std::vector<BlockSummary> blocks_;
+    uint64_t written_{0};
+};
+
+/**
+ * The samples of one metric in the column of its type.
+ *
+ * Writers are spread over shards picked by thread, each one with its own lock, so connections
+ * ingesting the same metric from different IO threads do not wait for each other. Readers visit
+ * the shards one at a time. A shard only allocates its ring on its first write: most metrics are
+ * written from a few threads, and many never are.
+ */
+class MetricColumns {
+public:
+    static constexpr std::size_t kShardsCount = 16;
+
+    // A shard holds no ring until it is written to
+    using column_t = std::variant<std::monostate, SampleRing<int64_t>, SampleRing<double>,
+                                  SampleRing<std::string>>;
+
+    MetricColumns(proto::MetricType type, std::size_t capacityPerShard)
+        : type_{type}, capacity_{capacityPerShard} {}
+
+    [[nodiscard]] proto::MetricType type() const { return type_; }
+
+    /**
+     * Appends the values of a series to the shard of the calling thread. Values without a time
+     * get receivedAt.
+     *
+     * @return why the series was rejected, empty when it was stored
+     */
+    std::string_view append(proto::Series &&series, int64_t receivedAt) {
+        switch (type_) {
+        case proto::MetricType::Integer:
+            if (!series.doubles.empty() || !series.strings.empty()) {
+                return "the metric expects integer values";
+            }
+            return push(series, series.integers, receivedAt);
+        case proto::MetricType::Double:
+            if (!series.strings.empty()) {
+                return "the metric expects numeric values";
+            }
+            if (!series.integers.empty()) {
+                series.doubles.assign(series.integers.begin(), series.integers.end());
+            }
+            // The aggregates would not mean anything anymore
+            if (!std::ranges::all_of(series.doubles, [](double v) { return std::isfinite(v); })) {
+                return "the values must be finite";
+            }
+            return push(series, series.doubles, receivedAt);
+        case proto::MetricType::String:
+            if (!series.integers.empty() || !series.doubles.empty()) {
+                return "the metric expects string values";
+            }
+            return push(series, series.strings, receivedAt);
+        }
+        return "unknown metric type";
+    }
+
+    [[nodiscard]] bool numeric() const { return type_ != proto::MetricType::String; }
+
+    /**
+     * Aggregates the samples of every shard at or after from, only for numeric metrics. When
+     * values is set it also gets their values.
+     */
+    Aggregate aggregateSince(int64_t from, std::vector<double> *values = nullptr) const {
+        Aggregate result;
+        auto const merge = [&](auto const &ring) {
+            result.merge(ring.aggregateSince(from, values));
+        };
+        if (type_ == proto::MetricType::Integer) {
+            visit<int64_t>(merge);
+        } else if (type_ == proto::MetricType::Double) {
+            visit<double>(merge);
+        }
+        return result;
+    }
+
+    /**
+     * Calls f(ring) for every shard written to, while holding its lock
+     */
+    template <typename T, typename F> void visit(F &&f) const {
+        for (auto const &shard : shards_) {
+            std::lock_guard<std::mutex> _{shard.mtx};
+
+            if (auto const *ring = std::get_if<SampleRing<T>>(&shard.column)) {
+                f(*ring);
+            }
+        }
+    }
+
+    /**
+     * Samples a shard keeps once it is written to
+     */
+    [[nodiscard]] std::size_t capacityPerShard() const { return capacity_; }
+
+private:
+    struct alignas(64) Shard {
+        mutable std::mutex mtx;
+        column_t column;
+    };
+
+    template <typename T>
+    std::string_view push(proto::Series const &series, std::vector<T> &values,
+                          int64_t receivedAt) {
+        if (values.empty()) {
+            return {};
+        }
+        auto &shard = shards_[shardIndex()];
+        std::lock_guard<std::mutex> _{shard.mtx};
+
+        if (std::holds_alternative<std::monostate>(shard.column)) {
+            shard.column.emplace<SampleRing<T>>(capacity_);
+        }
+        auto &ring = std::get<SampleRing<T>>(shard.column);
+
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            ring.push(series.times.empty() ? receivedAt : series.times[i], std::move(values[i]));
+        }
+        return {};
+    }
+
+    static std::size_t shardIndex() {
+        static thread_local std::size_t const index =
+            std::hash<std::thread::id>{}(std::this_thread::get_id()) % kShardsCount;
+        return index;
+    }
+
+    proto::MetricType const type_;
+    std::size_t const capacity_;
+    std::array<Shard, kShardsCount> shards_;
+};
+
+//--------------------------------------------------------------------------------
+// Store
+//--------------------------------------------------------------------------------
+
+/**
+ * Keeps the ingested samples of every metric of the catalog.
+ *
+ * The index from metric names to columns is immutable and swapped when the catalog changes, so
+ * ingesting never takes a store wide lock: it finds the columns without locking and then only
+ * locks one shard of each metric it writes to.
+ *
+ * The samples of all the metrics share a memory budget: a metric gets an even part of it when the
+ * catalog adds it, split between its shards, so the store stays within the budget even when every
+ * shard of every metric is written to. A metric keeps the shard capacity it got when the catalog
+ * grows, the budget holds again once the catalog stops growing and the old metrics are replaced.
+ */
+class MetricStore {
+public:
+    using columns_ptr_t = std::shared_ptr<MetricColumns>;
+
+    // Bytes the samples of the whole catalog take at most, the strings they allocate aside
+    static constexpr std::size_t kDefaultMemoryBudget = 512U << 20U;
+    // Samples kept per metric and per shard, whatever the budget
+    static constexpr std::size_t kMinCapacity = 64;
+    static constexpr std::size_t kMaxCapacity = 1U << 14U;
+
+    struct IngestReport {
+        std::size_t accepted{0};
+        // Metric and reason of every rejected series
+        std::vector<std::pair<std::string, std::string>> rejected;
+    };
+
+    /**
+     * @param maxCapacity samples a shard of a metric keeps at most, however large the budget
+     */
+    explicit MetricStore(std::size_t memoryBudget = kDefaultMemoryBudget,
+                         std::size_t maxCapacity = kMaxCapacity)
+        : memoryBudget_{memoryBudget}
+        , maxCapacity_{std::max(kMinCapacity, maxCapacity)}
+        , index_{std::make_shared<index_t const>()} {}
+
+    /**
+     * Makes the columns of the metrics of the catalog. The metrics already tracked keep their
+     * samples, unless their type changed, and the ones gone from the catalog are dropped. Called
+     * by the thread publishing the catalog.
+     */
+    void track(proto::metrics_umap_t const &metrics) {
+        auto const current = index_.load(std::memory_order_acquire);
+        auto next = std::make_shared<index_t>();
+        next->reserve(metrics.size());
+
+        for (auto &&[name, metric] : metrics) {
+            if (auto it = current->find(name); it != current->end() &&
+                                                 it->second->type() == metric.type) {
+                next->emplace(name, it->second);
+            } else {
+                auto const capacity = capacityPerShard(metric.type, metrics.size());
+                next->emplace(name, std::make_shared<MetricColumns>(metric.type, capacity));
+            }
+        }
+        index_.store(std::move(next), std::memory_order_release);
+    }
+
+    /**
+     * Stores the series of an Ingest message, from any thread. Every series is accepted or
+     * rejected on its own.
+     */
+    IngestReport ingest(std::vector<proto::Series> &&series) {
+        auto const receivedAt = now();
+        auto const index = index_.load(std::memory_order_acquire);
+        IngestReport report;
+
+        for (auto &&s : series) {
+            auto const count = s.size();
+            std::string_view error = s.malformed();
+
+            if (error.empty()) {
+                if (auto it = index->find(s.metric); it == index->end()) {
+                    error = "unknown metric";
+                } else {
+                    error = it->second->append(std::move(s), receivedAt);
+                }
+            }
+            if (error.empty()) {
+                report.accepted += count;
+            } else {
+                report.rejected.emplace_back(std::move(s.metric), error);
+            }
+        }
+        return report;
+    }
+
+    /**
+     * Gives the current time to the series sent without times, the ones that ingest would time
+     * on reception
+     */
+    static void stamp(std::vector<proto::Series> &series) {
+        auto const receivedAt = now();
+
+        for (auto &s : series) {
+            if (s.times.empty()) {
+                s.times.assign(s.size(), receivedAt);
+            }
+        }
+    }
+
+    /**
+     * @return the columns of a metric, null when the catalog does not have it
+     */
+    [[nodiscard]] columns_ptr_t find(std::string const &metric) const {
+        auto const index = index_.load(std::memory_order_acquire);
+        auto const it = index->find(metric);
+        return it != index->end() ? it->second : nullptr;
+    }
+
+    /**
+     * Samples kept per metric at most, by all the shards together
+     */
+    [[nodiscard]] std::size_t retention() const {
+        return maxCapacity_ * MetricColumns::kShardsCount;
+    }
+
+private:
+    using index_t = std::unordered_map<std::string, columns_ptr_t>;
+
+    /**
+     * Samples a shard of a metric keeps for its part of the budget
+     */
+    [[nodiscard]] std::size_t capacityPerShard(proto::MetricType type,
+                                               std::size_t metricsCount) const {
+        auto const sampleBytes = type == proto::MetricType::String
+                                     ? SampleRing<std::string>::kSampleBytes
+                                     : SampleRing<double>::kSampleBytes;
+        auto const shardBytes =
+            memoryBudget_ / std::max<std::size_t>(1, metricsCount) / MetricColumns::kShardsCount;
+        return std::clamp(shardBytes / sampleBytes, kMinCapacity, maxCapacity_);
+    }
+
+    static int64_t now() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    }
+
+    std::size_t const memoryBudget_;
+    std::size_t const maxCapacity_;
+    std::atomic<std::shared_ptr<index_t const>> index_;
+};
+
+} // namespace eps
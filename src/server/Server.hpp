@@ -1,5 +1,20 @@
 
+#pragma once
+
+#include "Broadcaster.hpp"
+#include "CatalogSegment.hpp"
+#include "CatalogSnapshot.hpp"
+#include "ConnectionRegistry.hpp"
+#include "Executor.hpp"
+#include "MetricStore.hpp"
+#include "Session.hpp"
+#include "StateLog.hpp"
+#include "Telemetry.hpp"
+#include "TlsSessions.hpp"
+#include "eps_common/Codec.hpp"
 #include "eps_common/CommandLineInterface.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/Logger.hpp"
 #include "eps_common/Protocol.hpp"
 #include "eps_common/definitions.hpp"
 
@@ -8,164 +23,577 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cmath>
+#include <exception>
 #include <filesystem>
-#include <iostream> // TODO delete this line once we have a logger
 #include <latch>
-#include <mutex>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
 #include <thread>
-#include <unordered_set>
+#include <tuple>
+#include <vector>
 
 namespace eps {
 
+/**
+ * Hands the Crow logs over to the asynchronous logger instead of writing them to stdout
+ */
+class CrowLogHandler : public crow::ILogHandler {
+public:
+    void log(std::string message, crow::LogLevel level) override {
+        auto const logLevel = toLevel(level);
+
+        if (log::enabled(logLevel)) {
+            if (auto const suppressed = rateLimit_.admit(); suppressed) {
+                log::Logger::instance().write(logLevel, "crow", 0, *suppressed,
+                                              std::move(message));
+            }
+        }
+    }
+
+private:
+    static log::Level toLevel(crow::LogLevel level) {
+        switch (level) {
+        case crow::LogLevel::Debug:
+            return log::Level::Debug;
+        case crow::LogLevel::Info:
+            return log::Level::Info;
+        case crow::LogLevel::Warning:
+            return log::Level::Warning;
+        default:
+            return log::Level::Error;
+        }
+    }
+
+    log::RateLimit rateLimit_;
+};
+
+/**
+ * Threads of the server, 0 for one per core
+ */
+struct ThreadSettings {
+    // Crow threads reading and writing the sockets
+    std::size_t io{0};
+    // Threads running the message handlers
+    std::size_t handlers{0};
+};
+
+/**
+ * Set when the server is one of the worker processes of a Supervisor
+ */
+struct WorkerSettings {
+    // Shared memory segment the control process publishes the catalog to
+    std::string catalogSegment;
+    // Ticket keys shared by the workers, so a client resumes its TLS session on any of them
+    std::filesystem::path ticketKeys;
+};
+
 class Server {
 public:
-    explicit Server(int port)
-        : version_{semver::version{defs::kInitialServerVersion}}, port_{port} {
-        initMetrics();
+    static constexpr std::string_view kTicketKeysFile = "tls-ticket.keys";
+
+    /**
+     * @param stateDirectory where the catalog, the samples and the TLS ticket keys persist across
+     * restarts, they only live in memory when empty
+     * @param worker set for a worker process: it has no CLI and follows the catalog the control
+     * process publishes
+     */
+    explicit Server(int port, proto::CompressionSettings compression = {},
+                    std::filesystem::path const &stateDirectory = {},
+                    ThreadSettings threads = {}, SendQueueSettings sendQueue = {},
+                    std::optional<WorkerSettings> const &worker = std::nullopt)
+        : version_{semver::version{defs::kInitialServerVersion}}
+        , port_{port}
+        , tlsSessions_{worker                    ? worker->ticketKeys
+                       : stateDirectory.empty() ? std::filesystem::path{}
+                                                : stateDirectory / kTicketKeysFile}
+        , compression_{compression}
+        , threads_{threads}
+        , sendQueue_{acknowledgeable(sendQueue)}
+        , handlerPool_{threads.handlers > 0 ? threads.handlers
+                                            : std::thread::hardware_concurrency()} {
+        if (worker) {
+            catalogSegment_.emplace(CatalogSegment::open(worker->catalogSegment));
+        }
+        initMetrics(stateDirectory);
         initMessageHandler();
         app_.loglevel(crow::LogLevel::Warning);
+        crow::logger::setHandler(&crowLogHandler_);
 
         CROW_ROUTE(app_, "/ws")
             .websocket()
+            .onaccept([&](crow::request const &req, void **userdata) {
+                // The client opts into a wire format, compression and Ack flow control through
+                // handshake headers
+                *userdata = new Session{
+                    proto::toWireFormat(req.get_header_value(defs::ws::kWireFormatHeader)),
+                    std::make_shared<SerialQueue>(handlerPool_),
+                    proto::negotiateCompression(
+                        req.get_header_value(defs::ws::kCompressionHeader), compression_),
+                    sendQueue_, &sendQueues_,
+                    req.get_header_value(defs::ws::kFlowControlHeader) ==
+                        defs::ws::kFlowControlAck};
+                return true;
+            })
             .onopen([&](crow::websocket::connection &conn) {
-                CROW_LOG_INFO << "new websocket connection from " << conn.get_remote_ip();
-                std::lock_guard<std::mutex> _{connectionsMtx_};
-                users_.insert(&conn);
+                EPS_LOG_DEBUG("new websocket connection from {}", conn.get_remote_ip());
+                // From now on the registry owns the session created in onaccept
+                auto *session = static_cast<Session *>(conn.userdata());
+                session->attach(conn);
+                connections_.add(conn, ConnectionRegistry::session_ptr_t{session});
             })
             .onclose([&](crow::websocket::connection &conn, const std::string &reason) {
-                CROW_LOG_INFO << "websocket connection closed: " << reason;
-                std::lock_guard<std::mutex> _{connectionsMtx_};
-                users_.erase(&conn);
+                auto session = connections_.remove(conn);
+
+                // Closed before it opened (Crow also closes the connections failing with an
+                // error), nothing but the userdata holds the session created in onaccept
+                if (!session) {
+                    delete static_cast<Session *>(conn.userdata());
+                    return;
+                }
+                session->detach();
+                // Behind the frames still queued, which own the client state
+                session->queue().post([session, reason] {
+                    auto const &client = session->client();
+                    EPS_LOG_DEBUG("websocket connection closed: {}, after {} messages ({} bytes "
+                                  "received, {} sent) in {}s",
+                                  reason, client.messages, client.bytesReceived, client.bytesSent,
+                                  std::chrono::duration_cast<std::chrono::seconds>(
+                                      ClientState::clock_t::now() - client.connectedAt)
+                                      .count());
+                });
             })
             .onmessage(
                 [&](crow::websocket::connection &conn, const std::string &data, bool isBinary) {
-                    std::lock_guard<std::mutex> _{connectionsMtx_};
-                    if (!isBinary) {
-                        try {
-                            std::cout << "Received: " << data << std::endl;
-                            nlohmann::json const dataJson = nlohmann::json::parse(data);
-                            auto message = proto::toMessage(dataJson);
-
-                            if (auto const response = messageHandler_.process(std::move(message));
-                                response) {
-                                conn.send_text(proto::toString(response.value()));
-                            }
-                        } catch (nlohmann::json::exception const &ex) {
-                            nlohmann::json p = nlohmann::json::object();
-                            p[proto::keys::kRequest] = data;
-                            proto::Message response{.type = proto::MessageType::BadRequest,
-                                                    .payload = p};
-                            conn.send_text(proto::toString(response));
-                        }
-                    }
+                    // The IO thread only hands the frame over: a slow handler must not hold the
+                    // other sockets of the thread. The session queue keeps the frames of the
+                    // connection in order
+                    auto session = static_cast<Session *>(conn.userdata())->shared_from_this();
+                    session->queue().post([this, session, data, isBinary,
+                                           received = Telemetry::clock_t::now()] {
+                        handleFrame(*session, data, isBinary, received);
+                    });
                 });
+
+        // Scraped by Prometheus, over the same TLS port as the websocket
+        CROW_ROUTE(app_, "/metrics")([&] {
+            crow::response response{telemetry_.render(
+                connections_.size(), tlsSessions_.counters(), sendQueues_.counters(),
+                stateLog_ ? stateLog_->shed() : 0)};
+            response.set_header("Content-Type", "text/plain; version=0.0.4");
+            return response;
+        });
     }
 
     ~Server() { shutdown(); }
 
     void run() {
-        std::latch workersLatch{2U};
-        cmdLineIfaceThr_ = std::jthread([&](std::stop_token st) { runCLI(st, workersLatch); });
+        // A worker is driven by the control process, not by a CLI of its own
+        std::latch workersLatch{catalogSegment_ ? 1U : 2U};
+
+        if (!catalogSegment_) {
+            cmdLineIfaceThr_ =
+                std::jthread([&](std::stop_token st) { runCLI(st, workersLatch); });
+        }
         webServerThr_ = std::jthread([&](std::stop_token st) { runWebService(st, workersLatch); });
         workersLatch.wait();
     }
 
+    /**
+     * Asks the server to stop, from a signal handler
+     */
+    static void requestStop() noexcept { stopRequested_.test_and_set(std::memory_order_relaxed); }
+
+    /**
+     * Catalog of a server without state to restore
+     */
+    static proto::metrics_umap_t initialMetrics() {
+        auto metrics = proto::kMetricsDefault;
+
+        // Simulate changes in Metrics for the current server version
+        metrics.insert({"os_name",
+                        {.name = "os_name",
+                         .description = "Operational system name",
+                         .type = proto::MetricType::String}});
+        return metrics;
+    }
+
+    /**
+     * Moves a catalog to the new server version, what the CLI option does
+     */
+    static void upgradeCatalog(proto::Version &version, proto::metrics_umap_t &metrics) {
+        version.value = semver::version{defs::kServerNewVersion};
+        metrics.insert({"user_satisfaction",
+                        {.name = "user_satisfaction",
+                         .description = "The user satisfaction",
+                         .type = proto::MetricType::Double}});
+    }
+
+    /**
+     * The catalog as an Updates message, the way the StateLog and the CatalogSegment keep it
+     */
+    static proto::Message catalogRecord(proto::Version const &version,
+                                        proto::metrics_umap_t const &metrics) {
+        proto::Message record{.type = proto::MessageType::Updates,
+                              .version = version.value.to_string(),
+                              .metrics = std::vector<proto::Metric>{}};
+        record.metrics->reserve(metrics.size());
+
+        for (auto &&[name, metric] : metrics) {
+            record.metrics->push_back(metric);
+        }
+        return record;
+    }
+
+    /**
+     * Hash of a catalog, the one its CatalogSnapshot gets
+     */
+    static std::string catalogHash(proto::Version const &version,
+                                   proto::metrics_umap_t const &metrics) {
+        return CatalogSnapshot::hashOf(version, MetricCatalog::make(metrics, nullptr));
+    }
+
+    /**
+     * Takes the catalog of an Updates record
+     *
+     * @return false when the record carries no catalog
+     */
+    static bool restoreCatalog(proto::Message &&record, proto::Version &version,
+                               proto::metrics_umap_t &metrics) {
+        if (record.type != proto::MessageType::Updates || !record.version || !record.metrics) {
+            return false;
+        }
+        version.value = semver::version{*record.version};
+        metrics.clear();
+
+        for (auto &&metric : *record.metrics) {
+            metrics.emplace(metric.name, std::move(metric));
+        }
+        return true;
+    }
+
 private:
+    /**
+     * Decodes, handles and answers a frame of a connection, from its serial queue. Responses
+     * mirror the format of the request they answer
+     */
+    void handleFrame(Session &session, std::string const &data, bool isBinary,
+                     Telemetry::clock_t::time_point received) {
+        auto format = proto::frameFormat(isBinary);
+        auto const start = Telemetry::clock_t::now();
+        Telemetry::Sample sample{.queue = start - received, .received = data.size()};
+        auto &client = session.client();
+        ++client.messages;
+        client.bytesReceived += data.size();
+        client.lastMessageAt = received;
+
+        try {
+            std::string_view bytes = data;
+
+            if (proto::isDeflated(data, isBinary)) {
+                std::tie(bytes, format) = session.inflater().inflate(data);
+            } else if (!isBinary) {
+                EPS_LOG_DEBUG("Received: {}", data);
+            }
+            auto message = proto::decode(bytes, format);
+            auto const decoded = Telemetry::clock_t::now();
+            sample.parse = decoded - start;
+            sample.type = message.type;
+
+            // No lock here: the handlers read the shared state from the catalog snapshot
+            auto const response = messageHandler_.process(session, std::move(message));
+            auto const handled = Telemetry::clock_t::now();
+            sample.handler = handled - decoded;
+
+            if (response) {
+                sample.sent = session.respond(format, response.value());
+                sample.serialize = Telemetry::clock_t::now() - handled;
+            }
+        } catch (nlohmann::json::exception const &ex) {
+            sample.sent = session.respond(format, badFrame(data, isBinary));
+        } catch (proto::CompressionError const &ex) {
+            sample.sent = session.respond(format, badFrame(data, isBinary));
+        } catch (std::exception const &ex) {
+            // Whatever else a handler let out only fails its frame, not the connection
+            EPS_LOG_ERROR("Unable to handle a frame: {}", ex.what());
+            sample.sent = session.respond(format, badFrame(data, isBinary));
+        }
+        client.bytesSent += sample.sent;
+        telemetry_.record(sample);
+    }
+
+    /**
+     * Keeps the high watermark above what a client reads before it acknowledges, or a connection
+     * waiting for an Ack would never get one
+     */
+    static SendQueueSettings acknowledgeable(SendQueueSettings settings) {
+        settings.highWatermark = std::max(settings.highWatermark, 2 * defs::ws::kAckInterval);
+        settings.lowWatermark = std::min(settings.lowWatermark, settings.highWatermark / 2);
+        return settings;
+    }
+
+    /**
+     * BadRequest echoing a frame that could not be decoded
+     */
+    static proto::Message badFrame(std::string const &data, bool isBinary) {
+        nlohmann::json p = nlohmann::json::object();
+
+        if (isBinary) {
+            p[proto::keys::kRequest] =
+                nlohmann::json::binary(std::vector<std::uint8_t>{data.begin(), data.end()});
+        } else {
+            p[proto::keys::kRequest] = data;
+        }
+        return proto::Message{.type = proto::MessageType::BadRequest, .payload = p};
+    }
+
     void initMessageHandler() {
         messageHandler_
-            .onVersion([&](proto::Message &&message) {
-                proto::Message response{.type = proto::MessageType::Accepted};
+            .onHello([&](Session &session, proto::Message &&message) {
+                // Fills the client state once, the next messages of the connection rely on it
+                auto const clientVersion = session.clientVersion(message.version);
+
+                if (!clientVersion) {
+                    return badRequest(message);
+                }
+                auto const catalog = catalog_.load(std::memory_order_acquire);
 
-                if (!message.payload.contains(proto::keys::kVersion)) {
-                    response.type = proto::MessageType::BadRequest;
-                    nlohmann::json data = {};
-                    data[proto::keys::kRequest] = message.payload;
-                    response.payload = data;
-                    return response;
+                if (auto clientHash = proto::stringEntry(message.payload, proto::keys::kHash);
+                    clientHash) {
+                    session.client().catalogHash = std::move(*clientHash);
                 }
-                semver::version const clientVersion{
-                    message.payload[proto::keys::kVersion].get<std::string>()};
+                proto::Message response{.type = proto::MessageType::Accepted,
+                                        .version = catalog->version.value.to_string()};
 
-                if (clientVersion < version_.value) {
+                if (*clientVersion < catalog->version.value) {
                     response.type = proto::MessageType::VersionUpdatesAvailable;
-                    nlohmann::json payload = {};
-                    payload[proto::keys::kVersion] = version_.value.to_string();
-                    response.payload = payload;
                 }
+                // The client compares it with its own to know whether to ask for updates
+                response.payload[proto::keys::kHash] = catalog->hash;
                 return response;
             })
-            .onGetUpdates([&](proto::Message &&message) {
-                proto::Message response{.type = proto::MessageType::Updates};
+            .onVersion([&](Session &session, proto::Message &&message) {
+                auto const clientVersion = session.clientVersion(message.version);
 
-                nlohmann::json metricsArray = nlohmann::json::array();
+                if (!clientVersion) {
+                    return badRequest(message);
+                }
+                proto::Message response{.type = proto::MessageType::Accepted};
+                auto const catalog = catalog_.load(std::memory_order_acquire);
 
-                for (auto &&[k, m] : metrics_) {
-                    metricsArray.push_back(m);
+                if (*clientVersion < catalog->version.value) {
+                    response.type = proto::MessageType::VersionUpdatesAvailable;
+                    response.version = catalog->version.value.to_string();
                 }
-                response.payload[proto::keys::kMetrics] = metricsArray;
-                response.payload[proto::keys::kVersion] = version_.value.to_string();
                 return response;
             })
-            .onNotSupported([&](proto::Message&& message){
+            .onGetUpdates([&](Session &session, proto::Message &&message) {
+                // Every response was encoded when the catalog was published
+                auto const catalog = catalog_.load(std::memory_order_acquire);
+                session.client().catalogHash = catalog->hash;
+                proto::Message response{.type = proto::MessageType::Updates,
+                                        .frame = catalog->updates};
+
+                if (auto const clientHash = proto::stringEntry(message.payload, proto::keys::kHash);
+                    clientHash) {
+                    if (*clientHash == catalog->hash) {
+                        response.type = proto::MessageType::NotModified;
+                        response.frame = catalog->notModified;
+                    } else if (auto it = catalog->deltas.find(*clientHash);
+                               it != catalog->deltas.end()) {
+                        response.frame = it->second;
+                    }
+                }
+                return response;
+            })
+            .onIngest([&](Session &, proto::Message &&message) {
+                if (!message.series) {
+                    return badRequest(message);
+                }
+                if (stateLog_) {
+                    // Restored samples keep the time they were received at
+                    MetricStore::stamp(*message.series);
+                    stateLog_->append(message);
+                }
+                auto const report = store_.ingest(std::move(*message.series));
+                proto::Message response{.type = proto::MessageType::Accepted};
+                response.payload[proto::keys::kAccepted] = report.accepted;
+
+                if (!report.rejected.empty()) {
+                    auto &rejected = response.payload[proto::keys::kRejected] =
+                        nlohmann::json::array();
+
+                    for (auto &&[metric, error] : report.rejected) {
+                        nlohmann::json entry = nlohmann::json::object();
+                        entry[proto::keys::kMetric] = metric;
+                        entry[proto::keys::kError] = error;
+                        rejected.push_back(std::move(entry));
+                    }
+                }
+                return response;
+            })
+            .onQuery([&](Session &, proto::Message &&message) { return query(message); })
+            .onAck([&](Session &session, proto::Message &&message) {
+                // Never answered, the client would have to acknowledge the answer
+                if (auto const bytes = proto::unsignedEntry(message.payload, proto::keys::kBytes);
+                    bytes) {
+                    session.acknowledge(*bytes);
+                }
+                return std::nullopt;
+            })
+            .onBatch([&](Session &session, proto::Message &&batch) {
+                // One response per sub-message, in the same order, so a failing one only fails
+                // its own slot
+                proto::Message response{.type = proto::MessageType::Batch,
+                                        .messages = std::vector<proto::Message>{}};
+                auto items = proto::unbatch(std::move(batch));
+                response.messages->reserve(items.size());
+
+                for (auto &&item : items) {
+                    if (!item.message) {
+                        response.messages->push_back(batchError(std::move(item.error)));
+                    } else if (item.message->type == proto::MessageType::Batch) {
+                        response.messages->push_back(
+                            batchError("Batches cannot be nested", item.message->id));
+                    } else {
+                        auto const id = item.message->id;
+                        auto subResponse =
+                            messageHandler_.process(session, std::move(*item.message));
+                        response.messages->push_back(
+                            subResponse ? std::move(*subResponse)
+                                        : proto::Message{.type = proto::MessageType::Accepted,
+                                                         .id = id});
+                    }
+                }
+                return response;
+            })
+            .onNotSupported([&](Session &, proto::Message&& message){
                 proto::Message response{.type = proto::MessageType::BadRequest};
                 return response;
             })
-            .onPushSettings([&](proto::Message &&message) {
-                proto::metrics_umap_t clientMetrics;
-                for (auto &&m : message.payload[proto::keys::kMetrics]) {
-                    proto::Metric metric = m;
-                    clientMetrics.emplace(std::make_pair(metric.name, std::move(metric)));
+            .onPushSettings([&](Session &session, proto::Message &&message) {
+                auto const clientVersion = session.clientVersion(message.version);
+
+                if (!clientVersion) {
+                    return badRequest(message);
+                }
+                auto const catalog = catalog_.load(std::memory_order_acquire);
+                auto clientHash = proto::stringEntry(message.payload, proto::keys::kHash);
+
+                // The catalog the client fetched earlier only stands for a push without metrics,
+                // the metrics it lists are always the ones compared
+                if (!clientHash && !message.metrics) {
+                    clientHash = session.client().catalogHash;
+                }
+                // A client already holding the current catalog has nothing to diff
+                if (*clientVersion >= catalog->version.value && clientHash == catalog->hash) {
+                    return proto::Message{.type = proto::MessageType::Accepted};
                 }
                 std::string error;
-                auto const missingMetrics =
-                    findMissingMetrics<std::string, proto::Metric>(clientMetrics);
+                auto const clientMetrics =
+                    message.metrics ? catalog->metrics.setOf(*message.metrics) : MetricSet{};
 
-                if (!missingMetrics.empty()) {
+                if (auto const missing = catalog->metrics.members() - clientMetrics;
+                    !missing.empty()) {
                     error = "Missing metrics: ";
 
-                    for (auto &&[m, _] : missingMetrics) {
-                        error += m + " ";
-                    }
+                    missing.forEach([&](MetricSet::id_t id) {
+                        error += catalog->metrics.ids().name(id) + " ";
+                    });
                 }
-                semver::version const clientVersion{
-                    message.payload[proto::keys::kVersion].get<std::string>()};
-
-                if (clientVersion < version_.value) {
-                    error += std::string{
-                        std::format("| Deprecated version. Your version ({}), the server ({})",
-                                    clientVersion.to_string(), version_.value.to_string())};
+                if (*clientVersion < catalog->version.value) {
+                    error += std::string{std::format(
+                        "| Deprecated version. Your version ({}), the server ({})",
+                        clientVersion->to_string(), catalog->version.value.to_string())};
                 }
                 proto::Message response{.type = proto::MessageType::Accepted};
 
                 if (!error.empty()) {
                     response.type = proto::MessageType::Deprecated;
-                    nlohmann::json payload = {};
-                    payload[proto::keys::kVersion] = version_.value.to_string();
-                    payload[proto::keys::kError] = error;
-                    response.payload = payload;
+                    response.version = catalog->version.value.to_string();
+                    response.payload[proto::keys::kError] = error;
                 }
                 return response;
             });
     }
 
-    template <typename K, typename V> struct NotFoundInMapPred {
-        using map_t = std::unordered_map<K, V>;
-        map_t const &map;
-
-        explicit NotFoundInMapPred(map_t const &other) : map{other} {}
+    /**
+     * Aggregates of a metric over the last window seconds, the percentiles are only computed when
+     * they are asked for
+     */
+    proto::Message query(proto::Message const &message) const {
+        auto const metric = proto::stringEntry(message.payload, proto::keys::kMetric);
+        auto const window = message.payload.is_object() ? message.payload.find(proto::keys::kWindow)
+                                                        : message.payload.end();
+        auto const columns = metric ? store_.find(*metric) : nullptr;
+
+        // Past the bound the window would overflow the microseconds it is converted to
+        if (!columns || !columns->numeric() || window == message.payload.end() ||
+            !window->is_number() || !std::isfinite(window->get<double>()) ||
+            window->get<double>() <= 0 ||
+            window->get<double>() > static_cast<double>(kMaxQueryWindow.count())) {
+            return badRequest(message);
+        }
+        std::vector<double> ranks;
 
-        bool operator()(std::pair<K, V> const &element) const {
-            return map.find(element.first) == map.end();
+        if (auto it = message.payload.find(proto::keys::kPercentiles);
+            it != message.payload.end()) {
+            if (!it->is_array() || it->size() > kMaxQueryPercentiles) {
+                return badRequest(message);
+            }
+            for (auto const &rank : *it) {
+                // A NaN rank has no place in the order the percentiles are selected in
+                if (!rank.is_number() || !std::isfinite(rank.get<double>()) ||
+                    rank.get<double>() < 0 || rank.get<double>() > 100) {
+                    return badRequest(message);
+                }
+                ranks.push_back(rank.get<double>());
+            }
+        }
+        using namespace std::chrono;
+
+        auto const now = duration_cast<microseconds>(system_clock::now().time_since_epoch());
+        auto const from =
+            now - duration_cast<microseconds>(duration<double>{window->get<double>()});
+        std::vector<double> values;
+        auto const aggregate =
+            columns->aggregateSince(from.count(), ranks.empty() ? nullptr : &values);
+
+        proto::Message response{.type = proto::MessageType::Aggregates};
+        response.payload[proto::keys::kMetric] = *metric;
+        response.payload[proto::keys::kWindow] = *window;
+        response.payload[proto::keys::kCount] = aggregate.count;
+
+        if (aggregate.count > 0) {
+            response.payload[proto::keys::kMin] = aggregate.min;
+            response.payload[proto::keys::kMax] = aggregate.max;
+            response.payload[proto::keys::kMean] = aggregate.mean();
+        }
+        if (!ranks.empty()) {
+            auto &percentiles = response.payload[proto::keys::kPercentiles] =
+                nlohmann::json::object();
+            auto const results = eps::percentiles(values, ranks);
+
+            for (std::size_t i = 0; i < ranks.size(); ++i) {
+                percentiles[std::format("{}", ranks[i])] =
+                    aggregate.count > 0 ? nlohmann::json(results[i]) : nlohmann::json{};
+            }
         }
-    };
+        return response;
+    }
 
-    template <typename K, typename V>
-    std::vector<std::pair<K, V>> findMissingMetrics(proto::metrics_umap_t const &clientMetrics) {
-        std::vector<std::pair<K, V>> diff;
+    static proto::Message batchError(std::string error, std::optional<uint64_t> id = {}) {
+        proto::Message response{.type = proto::MessageType::BadRequest, .id = id};
+        response.payload[proto::keys::kError] = std::move(error);
+        return response;
+    }
 
-        std::copy_if(metrics_.begin(), metrics_.end(), std::back_inserter(diff),
-                     NotFoundInMapPred<K, V>(clientMetrics));
-        return diff;
+    static proto::Message badRequest(proto::Message const &message) {
+        proto::Message response{.type = proto::MessageType::BadRequest};
+        response.payload[proto::keys::kRequest] = proto::toPayloadJson(message);
+        return response;
     }
 
     void runCLI(std::stop_token stopToken, std::latch &workersLatch) {
@@ -175,14 +603,16 @@ private:
                               .action = [&] {
                                   updateVersion();
                                   notifyNewVersion();
-                              }});
+                              }})
+            .option({.label = "Report the compression memory",
+                     .action = [&] { reportCompressionMemory(); }});
 
         while (!stopToken.stop_requested()) {
             auto const title = std::string{
                 std::format("[MENU] Server (v{}) port: {}", version_.value.to_string(), strPort)};
 
             if (!cmdLineIface_.tryToExecuteAction(title)) {
-                std::cout << "\n\nShutdown has been requested, bye!\n\n";
+                EPS_LOG_INFO("Shutdown has been requested, bye!");
                 quitLock_.test_and_set(std::memory_order_acquire);
                 break;
             }
@@ -197,68 +627,204 @@ private:
         fs::path cert = fs::current_path() / defs::ws::kServerCertificate;
         fs::path key = fs::current_path() / defs::ws::kServerKey;
 
-        auto futureApp =
-            app_.port(port_).multithreaded().ssl_file(cert.string(), key.string()).run_async();
+        crow::ssl_context_t tls{crow::ssl_context_t::sslv23};
+        tls.set_options(crow::ssl_context_t::default_workarounds | crow::ssl_context_t::no_sslv2 |
+                        crow::ssl_context_t::no_sslv3);
+        tls.use_certificate_file(cert.string(), crow::ssl_context_t::pem);
+        tls.use_private_key_file(key.string(), crow::ssl_context_t::pem);
+        tlsSessions_.configure(tls.native_handle());
+
+        auto const ioThreads = threads_.io > 0 ? threads_.io : std::thread::hardware_concurrency();
+        auto futureApp = app_.port(port_)
+                             .concurrency(static_cast<std::uint16_t>(ioThreads))
+                             .ssl(std::move(tls))
+                             .run_async();
 
         do {
             if (auto status = futureApp.wait_for(500ms);
                 status == std::future_status::timeout &&
-                quitLock_.test(std::memory_order_relaxed)) {
+                (quitLock_.test(std::memory_order_relaxed) ||
+                 stopRequested_.test(std::memory_order_relaxed))) {
 
                 workersLatch.count_down();
                 app_.stop();
                 break;
             }
+            followCatalog();
         } while (!stopToken.stop_requested());
     }
 
     void shutdown() {
         cmdLineIfaceThr_.request_stop();
         webServerThr_.request_stop();
-        cmdLineIfaceThr_.join();
-        webServerThr_.join();
+
+        // A worker has no CLI thread
+        if (cmdLineIfaceThr_.joinable()) {
+            cmdLineIfaceThr_.join();
+        }
+        if (webServerThr_.joinable()) {
+            webServerThr_.join();
+        }
     }
 
-    void initMetrics() {
-        metrics_ = proto::kMetricsDefault;
+    void initMetrics(std::filesystem::path const &stateDirectory) {
+        metrics_ = initialMetrics();
 
-        // Simulate changes in Metrics for the current server version
-        metrics_.insert({"os_name",
-                         {.name = "os_name",
-                          .description = "Operational system name",
-                          .type = proto::MetricType::String}});
+        if (!stateDirectory.empty()) {
+            stateLog_ = std::make_unique<StateLog>(stateDirectory, store_.retention());
+            restoreState();
+        }
+        // A worker starts with the catalog of the control process, the restored one may be older
+        if (!followCatalog()) {
+            publishCatalog();
+        }
+    }
+
+    /**
+     * Publishes the catalog of the control process when it changed, and notifies the clients of
+     * a new version. From the web service thread of a worker, every time it checks for the quit.
+     *
+     * @return whether a catalog was published
+     */
+    bool followCatalog() {
+        if (!catalogSegment_) {
+            return false;
+        }
+        auto record = catalogSegment_->readNewer(catalogGeneration_);
+        auto const previous = version_.value;
+
+        if (!record || !restoreCatalog(std::move(*record), version_, metrics_)) {
+            return false;
+        }
+        auto const notify = catalog_.load(std::memory_order_acquire) && previous < version_.value;
+        publishCatalog();
+
+        if (notify) {
+            notifyNewVersion();
+        }
+        return true;
+    }
+
+    /**
+     * Takes back the catalog and the samples of the previous run. A catalog record comes before
+     * the samples of its metrics, so the store tracks them by the time they are ingested.
+     */
+    void restoreState() {
+        auto const start = std::chrono::steady_clock::now();
+        std::size_t samples = 0;
+        bool restored = false;
+
+        stateLog_->replay([&](proto::Message &&message) {
+            if (message.type == proto::MessageType::Updates) {
+                if (restoreCatalog(std::move(message), version_, metrics_)) {
+                    store_.track(metrics_);
+                    restored = true;
+                }
+            } else if (message.type == proto::MessageType::Ingest && message.series) {
+                samples += store_.ingest(std::move(*message.series)).accepted;
+            }
+        });
+        stateLog_->start();
+
+        if (restored) {
+            persistedHash_ = catalogHash(version_, metrics_);
+        }
+
+        auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+        EPS_LOG_INFO("Restored v{} with {} metrics and {} samples in {}ms",
+                     version_.value.to_string(), metrics_.size(), samples, elapsed.count());
     }
 
     void updateVersion() {
-        version_.value = semver::version{defs::kServerNewVersion};
-        metrics_.insert({"user_satisfaction",
-                         {.name = "user_satisfaction",
-                          .description = "The user satisfaction",
-                          .type = proto::MetricType::Double}});
+        upgradeCatalog(version_, metrics_);
+        publishCatalog();
+    }
+
+    void publishCatalog() {
+        store_.track(metrics_);
+        auto catalog = CatalogSnapshot::make(version_, metrics_, compression_, history_);
+
+        // Not again for the catalog restored on start, the log has it
+        if (stateLog_ && catalog->hash != persistedHash_) {
+            stateLog_->append(catalogRecord(version_, metrics_));
+            persistedHash_ = catalog->hash;
+        }
+
+        if (history_.size() == CatalogSnapshot::kDeltaHistory) {
+            history_.erase(history_.begin());
+        }
+        history_.push_back(catalog);
+        catalog_.store(std::move(catalog), std::memory_order_release);
     }
 
     void notifyNewVersion() {
-        proto::Message message{.type = proto::MessageType::VersionUpdatesAvailable};
-        nlohmann::json payload = {};
-        payload[proto::keys::kVersion] = version_.value.to_string();
-        message.payload = payload;
-        auto const messageStr = proto::toString(message);
-
-        for (auto &&conn : users_) {
-            conn->send_text(messageStr);
+        proto::Message message{.type = proto::MessageType::VersionUpdatesAvailable,
+                               .version = version_.value.to_string()};
+
+        auto const report = broadcaster_.broadcast(message);
+        telemetry_.record({.fanOut = report.fanOutTime, .sent = report.bytes});
+        EPS_LOG_INFO("Notified {} clients ({} closed meanwhile): encoded in {}us, fanned out in "
+                     "{}us",
+                     report.recipients, report.skipped, report.encodeTime.count(),
+                     report.fanOutTime.count());
+    }
+
+    void reportCompressionMemory() {
+        std::size_t total = 0;
+        auto const sessions = connections_.sessions();
+
+        for (auto const &session : sessions) {
+            total += session->compressionMemory();
         }
+        EPS_LOG_INFO("{} connections keep {} KiB of compression state ({} KiB per connection on "
+                     "average)",
+                     sessions.size(), total / 1'024,
+                     sessions.empty() ? 0 : total / sessions.size() / 1'024);
     }
 
+    // Bound for the percentiles of a Query, each one is a selection over the window
+    static constexpr std::size_t kMaxQueryPercentiles = 16;
+    // Bound for the window of a Query, far more than the store keeps of any metric
+    static constexpr std::chrono::seconds kMaxQueryWindow{std::chrono::hours{24 * 365}};
+
+    inline static std::atomic_flag stopRequested_ = ATOMIC_FLAG_INIT;
+
+    // Only the CLI thread changes version_ and metrics_, the web service thread of a worker
+    // instead. The IO threads read catalog_
     proto::Version version_;
     int port_{0};
+    CrowLogHandler crowLogHandler_;
+    // Before the app, its TLS context counts the handshakes in there
+    TlsSessions tlsSessions_;
     crow::SimpleApp app_;
-    std::unordered_set<crow::websocket::connection *> users_;
+    proto::CompressionSettings const compression_;
+    ConnectionRegistry connections_;
+    Telemetry telemetry_;
+    Broadcaster broadcaster_{connections_, compression_};
     std::jthread cmdLineIfaceThr_;
     std::jthread webServerThr_;
-    std::mutex connectionsMtx_;
     std::atomic_flag quitLock_ = ATOMIC_FLAG_INIT;
-    proto::MessageHandler messageHandler_;
+    proto::BasicMessageHandler<Session> messageHandler_;
     proto::metrics_umap_t metrics_;
+    std::atomic<CatalogSnapshot::ptr_t> catalog_;
+    // Samples of the metrics in the catalog, written by the IO threads
+    MetricStore store_;
+    // The last published catalogs, oldest first, to build the deltas from
+    std::vector<CatalogSnapshot::ptr_t> history_;
+    // Persists the catalog and the samples when the server has a state directory
+    std::unique_ptr<StateLog> stateLog_;
+    // Hash of the last catalog appended to the state log, or restored from it
+    std::string persistedHash_;
+    // Catalog of the control process when the server is a worker, and the last one taken from it
+    std::optional<CatalogSegment> catalogSegment_;
+    uint64_t catalogGeneration_{0};
+    ThreadSettings const threads_;
+    SendQueueSettings const sendQueue_;
+    // Totals of the send queues of the sessions
+    SendQueueGauge sendQueues_;
+    // Last, so the handlers still running finish before the state they use goes away
+    WorkStealingPool handlerPool_;
     CommandLineInterface cmdLineIface_;
 };
 } // namespace eps
\ No newline at end of file
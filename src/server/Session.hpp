@@ -0,0 +1,357 @@
+
+#pragma once
+
+#include "Executor.hpp"
+#include "Telemetry.hpp"
+#include "eps_common/Codec.hpp"
+#include "eps_common/Compression.hpp"
+#include "eps_common/Logger.hpp"
+#include "eps_common/SendQueue.hpp"
+
+#include <crow.h>
+#include <semver.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace eps {
+
+/**
+ * Totals of the send queues of every session, kept up to date by the sessions so a scrape does
+ * not walk the connections
+ */
+class SendQueueGauge {
+public:
+    [[nodiscard]] SendQueueCounters counters() const {
+        return {.queuedBytes = queuedBytes.load(std::memory_order_relaxed),
+                .queuedFrames = queuedFrames.load(std::memory_order_relaxed),
+                .inFlightBytes = inFlightBytes.load(std::memory_order_relaxed),
+                .blocked = blocked.load(std::memory_order_relaxed),
+                .coalesced = coalesced.load(std::memory_order_relaxed),
+                .dropped = dropped.load(std::memory_order_relaxed),
+                .disconnected = disconnected.load(std::memory_order_relaxed)};
+    }
+
+    std::atomic<int64_t> queuedBytes{0};
+    std::atomic<int64_t> queuedFrames{0};
+    std::atomic<int64_t> inFlightBytes{0};
+    std::atomic<int64_t> blocked{0};
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> disconnected{0};
+};
+
+/**
+ * What the server learns of a client while it is connected
+ */
+struct ClientState {
+    using clock_t = std::chrono::steady_clock;
+
+    // Set by the Hello, or by the first message carrying a version
+    std::optional<semver::version> version;
+    std::string versionText;
+    // Catalog the client holds as far as the server knows, empty when unknown
+    std::string catalogHash;
+    bool greeted{false};
+    uint64_t messages{0};
+    uint64_t bytesReceived{0};
+    uint64_t bytesSent{0};
+    clock_t::time_point connectedAt{clock_t::now()};
+    clock_t::time_point lastMessageAt{};
+};
+
+/**
+ * State kept for every websocket connection. It is created when the handshake is accepted and
+ * travels with the Crow connection through its userdata, and the handlers receive it with every
+ * message of the connection.
+ *
+ * The messages of the connection are handled in order on its serial queue, so the inflater, the
+ * encoder, the compression context and the client state are only ever used by one thread at a
+ * time.
+ *
+ * Crow queues whatever it is given to send without a bound and tells nothing of what it wrote, so
+ * the server bounds what it hands over:
+ *  - a client announcing Acks in its handshake (defs::ws::kFlowControlHeader) acknowledges the
+ *    bytes it reads every defs::ws::kAckInterval, and its frames go through a SendQueue. Past the
+ *    high watermark of bytes not acknowledged, the frames wait in the session, a broadcast
+ *    replaces the queued one of the same type and the overflow policy applies once the queue is
+ *    full;
+ *  - the frames of any other client go to Crow right away within a SendBudget, its bytes are
+ *    assumed read at the legacy rate and the overflow policy applies past the legacy budget.
+ */
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    explicit Session(proto::WireFormat format, std::shared_ptr<SerialQueue> queue,
+                     proto::CompressionSettings compression = {},
+                     SendQueueSettings sendQueue = {}, SendQueueGauge *gauge = nullptr,
+                     bool acknowledging = false)
+        : format_{format}
+        , compressed_{compression.enabled}
+        , acknowledging_{acknowledging}
+        , queue_{std::move(queue)}
+        , outbox_{sendQueue}
+        , legacy_{sendQueue.legacyBudget, sendQueue.legacyRate}
+        , gauge_{gauge} {
+        if (compressed_) {
+            deflater_.emplace(compression);
+        }
+    }
+
+    [[nodiscard]] proto::WireFormat format() const { return format_; }
+
+    /**
+     * Queue running the messages of the connection in order
+     */
+    [[nodiscard]] SerialQueue &queue() const { return *queue_; }
+
+    /**
+     * Inflater for the deflated frames the client sends, only used from the serial queue
+     */
+    proto::Inflater &inflater() { return inflater_; }
+
+    /**
+     * What the server knows of the client, only used from the serial queue
+     */
+    [[nodiscard]] ClientState &client() { return client_; }
+
+    [[nodiscard]] ClientState const &client() const { return client_; }
+
+    /**
+     * Version of the client, the text of a message is only parsed when it differs from the one
+     * already known. A client that said Hello may leave it out of its next messages.
+     *
+     * @return nullopt when the client never sent a version, or the text is not a semantic version
+     */
+    std::optional<semver::version> clientVersion(std::optional<std::string> const &text) {
+        if (text && *text != client_.versionText) {
+            client_.version = semver::from_string_noexcept(*text);
+            client_.versionText = *text;
+        }
+        return client_.version;
+    }
+
+    /**
+     * Sends a response from the serial queue. Responses are deflated with the connection context
+     * when the client negotiated compression, shared frames too once the id of the request is
+     * spliced in. The encoding happens before taking the connection lock.
+     *
+     * @return the size of the frame queued, 0 when the connection is already closed or the
+     * response did not fit in the send queue
+     */
+    std::size_t respond(proto::WireFormat format, proto::Message const &message) {
+        if (message.frame && !message.id) {
+            std::lock_guard<std::mutex> _{connMtx_};
+            return sendFrame(format, *message.frame, std::nullopt);
+        }
+        auto const &bytes = encoder_.encode(message, format);
+        auto const *deflated = deflater_ ? deflater_->compress(bytes, format) : nullptr;
+
+        std::lock_guard<std::mutex> _{connMtx_};
+
+        if (deflated != nullptr) {
+            return enqueue(*deflated, true, std::nullopt);
+        }
+        return enqueue(bytes, proto::isBinary(format), std::nullopt);
+    }
+
+    /**
+     * Takes an Ack of the client, from the serial queue. The frames queued meanwhile leave once the
+     * connection is writable again. Ignored from a client that did not announce its Acks, its
+     * frames never wait for one.
+     *
+     * @param received bytes the client read since the connection opened
+     */
+    void acknowledge(uint64_t received) {
+        if (!acknowledging_) {
+            return;
+        }
+        std::lock_guard<std::mutex> _{connMtx_};
+        // A client never read more than it was sent
+        auto const acknowledged = std::min(received, sent_);
+
+        if (acknowledged > acknowledged_) {
+            outbox_.written(acknowledged - acknowledged_);
+            acknowledged_ = acknowledged;
+        }
+        while (conn_ != nullptr && outbox_.writable() && !outbox_.empty()) {
+            auto const frame = outbox_.pop();
+            handOver(frame.bytes, frame.binary);
+        }
+        report();
+    }
+
+    /**
+     * Memory kept by the compression streams of the connection
+     */
+    [[nodiscard]] std::size_t compressionMemory() const {
+        return (deflater_ ? deflater_->memory() : 0) + inflater_.memory();
+    }
+
+    void attach(crow::websocket::connection &conn) {
+        std::lock_guard<std::mutex> _{connMtx_};
+        conn_ = &conn;
+    }
+
+    /**
+     * Called when the connection closes, after that the session never touches it again
+     */
+    void detach() {
+        std::lock_guard<std::mutex> _{connMtx_};
+        conn_ = nullptr;
+        outbox_.clear();
+        report();
+    }
+
+    /**
+     * Sends a frame from any thread in the negotiated format. Crow queues the bytes on the IO
+     * thread that owns the connection.
+     *
+     * @param kind set for a notification, it replaces the queued one of the same kind
+     * @return the size of the frame queued, 0 when the connection is already closed or the frame
+     * did not fit in the send queue
+     */
+    std::size_t send(proto::EncodedFrame const &frame,
+                     std::optional<proto::MessageType> kind = std::nullopt) {
+        std::lock_guard<std::mutex> _{connMtx_};
+        return sendFrame(format_, frame, kind);
+    }
+
+private:
+    /**
+     * Shared frames carry a standalone deflated copy, they never touch the connection context
+     */
+    std::size_t sendFrame(proto::WireFormat format, proto::EncodedFrame const &frame,
+                          std::optional<proto::MessageType> kind) {
+        if (compressed_ && !frame.deflated(format).empty()) {
+            return enqueue(frame.deflated(format), true, kind);
+        }
+        return enqueue(frame.bytes(format), proto::isBinary(format), kind);
+    }
+
+    /**
+     * Hands a frame over to Crow, or queues it while the client is behind. Under connMtx_.
+     *
+     * @return the size of the frame sent or queued, 0 when it is not
+     */
+    std::size_t enqueue(std::string const &bytes, bool binary,
+                        std::optional<proto::MessageType> kind) {
+        if (conn_ == nullptr) {
+            return 0;
+        }
+        if (!acknowledging_) {
+            if (!legacy_.spend(bytes.size())) {
+                return overflow(legacy_.inFlightBytes());
+            }
+            handOver(bytes, binary);
+            return bytes.size();
+        }
+        switch (outbox_.offer(bytes, binary, kind)) {
+        case SendQueue::Push::Sent:
+            handOver(bytes, binary);
+            break;
+        case SendQueue::Push::Queued:
+            break;
+        case SendQueue::Push::Coalesced:
+            count(&SendQueueGauge::coalesced);
+            break;
+        case SendQueue::Push::Overflow:
+            return overflow(outbox_.inFlightBytes() + outbox_.queuedBytes());
+        }
+        report();
+        return bytes.size();
+    }
+
+    /**
+     * Applies the overflow policy to a frame that does not fit, under connMtx_
+     *
+     * @param behind bytes the client has yet to read
+     * @return 0, the frame is not sent
+     */
+    std::size_t overflow(std::size_t behind) {
+        if (outbox_.settings().overflow == OverflowPolicy::Disconnect) {
+            EPS_LOG_WARNING("Closing a connection {} bytes behind", behind);
+            count(&SendQueueGauge::disconnected);
+            conn_->close("send queue overflow");
+            // Nothing else is sent, the connection is going away
+            conn_ = nullptr;
+            outbox_.clear();
+        } else {
+            count(&SendQueueGauge::dropped);
+        }
+        report();
+        return 0;
+    }
+
+    /**
+     * Gives Crow a frame the send queue counted in flight
+     */
+    void handOver(std::string const &bytes, bool binary) {
+        if (binary) {
+            conn_->send_binary(bytes);
+        } else {
+            conn_->send_text(bytes);
+        }
+        sent_ += bytes.size();
+    }
+
+    void count(std::atomic<uint64_t> SendQueueGauge::*counter) {
+        if (gauge_ != nullptr) {
+            (gauge_->*counter).fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Brings the gauge in line with the send queue, under connMtx_
+     */
+    void report() {
+        if (gauge_ == nullptr) {
+            return;
+        }
+        SendQueueCounters const now{
+            .queuedBytes = static_cast<int64_t>(outbox_.queuedBytes()),
+            .queuedFrames = static_cast<int64_t>(outbox_.size()),
+            .inFlightBytes = static_cast<int64_t>(outbox_.inFlightBytes()),
+            .blocked = outbox_.writable() ? 0 : 1};
+
+        auto const update = [](std::atomic<int64_t> &total, int64_t &last, int64_t value) {
+            if (value != last) {
+                total.fetch_add(value - last, std::memory_order_relaxed);
+                last = value;
+            }
+        };
+        update(gauge_->queuedBytes, reported_.queuedBytes, now.queuedBytes);
+        update(gauge_->queuedFrames, reported_.queuedFrames, now.queuedFrames);
+        update(gauge_->inFlightBytes, reported_.inFlightBytes, now.inFlightBytes);
+        update(gauge_->blocked, reported_.blocked, now.blocked);
+    }
+
+    proto::WireFormat const format_;
+    bool const compressed_;
+    bool const acknowledging_;
+    std::shared_ptr<SerialQueue> const queue_;
+    proto::MessageEncoder encoder_;
+    std::optional<proto::Deflater> deflater_;
+    proto::Inflater inflater_;
+    ClientState client_;
+    std::mutex connMtx_;
+    crow::websocket::connection *conn_{nullptr};
+    // The state below is guarded by connMtx_ too
+    SendQueue outbox_;
+    // Bounds the frames of a client that does not acknowledge, they never go through outbox_
+    SendBudget legacy_;
+    SendQueueGauge *const gauge_;
+    // What this session last added to the gauge
+    SendQueueCounters reported_;
+    // Bytes handed over to Crow and acknowledged by the client since the connection opened
+    uint64_t sent_{0};
+    uint64_t acknowledged_{0};
+};
+
+} // namespace eps
@@ -0,0 +1,482 @@
+
+#pragma once
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Logger.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Durable server state: an append-only log of protocol messages in a memory-mapped file, and a
+ * compacted snapshot of it.
+ *
+ * The log keeps an Updates message every time the catalog is published and the Ingest messages.
+ * Appending only encodes the message and queues it, a writer thread copies the records into the
+ * mapping and flushes it, so the IO threads never wait for the disk. When the disk cannot keep up,
+ * the samples past the bound of the queue are shed (they stay in the MetricStore, only a restart
+ * loses them) and counted, the catalogs are always queued. Once the log is big enough
+ * the writer thread compacts it into a new snapshot with the last catalog and the newest samples
+ * of every metric, and starts the log over.
+ *
+ * Every record has a sequence number and the snapshot records carry the last one they cover, so a
+ * restart maps the snapshot and only replays the records of the log after it, even when the
+ * server stopped between writing a snapshot and clearing the log. Replaying stops at the first
+ * torn or corrupted record.
+ */
+class StateLog {
+public:
+    static constexpr std::string_view kLogFile = "state.log";
+    static constexpr std::string_view kSnapshotFile = "state.snapshot";
+
+    // The log file grows by this much when a record does not fit in it
+    static constexpr std::size_t kGrowth = 4U << 20U;
+    static constexpr std::size_t kDefaultCompactionThreshold = 64U << 20U;
+    // Bytes of records waiting for the writer thread, past them the samples are shed
+    static constexpr std::size_t kDefaultMaxPendingBytes = 64U << 20U;
+    // Samples per Ingest record of a snapshot
+    static constexpr std::size_t kSnapshotSeriesSize = 4'096;
+
+    struct Header {
+        // Bytes of the payload, 0 after the last record of the log
+        uint32_t size;
+        uint32_t checksum;
+        uint64_t sequence;
+    };
+
+    /**
+     * @param retention samples kept per metric by the snapshots
+     */
+    StateLog(std::filesystem::path directory, std::size_t retention,
+             std::size_t compactionThreshold = kDefaultCompactionThreshold,
+             std::size_t maxPendingBytes = kDefaultMaxPendingBytes)
+        : logPath_{directory / kLogFile}
+        , snapshotPath_{directory / kSnapshotFile}
+        , retention_{retention}
+        , compactionThreshold_{compactionThreshold}
+        , maxPendingBytes_{maxPendingBytes} {
+        std::filesystem::create_directories(directory);
+    }
+
+    StateLog(StateLog const &) = delete;
+    StateLog &operator=(StateLog const &) = delete;
+
+    /**
+     * Writes the records still queued before returning
+     */
+    ~StateLog() {
+        writer_.request_stop();
+
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+    }
+
+    /**
+     * Calls f(Message&&) with the messages of the snapshot and then the ones of the log after
+     * it, in the order they were appended. Called once, before start.
+     */
+    template <typename F> void replay(F &&f) {
+        uint64_t covered = 0;
+
+        if (auto const snapshot = map(snapshotPath_); snapshot) {
+            covered = readRecords(bytesOf(*snapshot), 0, f).sequence;
+        }
+        if (auto const log = map(logPath_); log) {
+            sequence_ = std::max(covered, readRecords(bytesOf(*log), covered, f).sequence);
+        } else {
+            sequence_ = covered;
+        }
+        written_ = sequence_;
+    }
+
+    /**
+     * Maps the log for appending after its last valid record and starts the writer thread
+     */
+    void start() {
+        if (!std::filesystem::exists(logPath_)) {
+            std::ofstream{logPath_, std::ios::binary};
+        }
+        if (std::filesystem::file_size(logPath_) < kGrowth) {
+            std::filesystem::resize_file(logPath_, kGrowth);
+        }
+        remap();
+        auto const bytes = bytesOf(region_);
+        end_ = readRecords(bytes, std::numeric_limits<uint64_t>::max(), [](auto &&) {}).end;
+
+        // Whatever follows is a torn record, it would be read back after the next ones otherwise
+        std::memset(static_cast<char *>(region_.get_address()) + end_, 0, bytes.size() - end_);
+        region_.flush();
+
+        writer_ = std::jthread([this](std::stop_token st) { write(st); });
+    }
+
+    /**
+     * Queues a message for the writer thread, from any thread. A catalog is always queued, samples
+     * only while the queue holds less than the max pending bytes.
+     *
+     * @return whether the message was queued, false when it was shed
+     */
+    bool append(proto::Message const &message) {
+        auto bytes = proto::encode(message, proto::WireFormat::MsgPack);
+        {
+            std::lock_guard<std::mutex> _{mtx_};
+
+            if (message.type != proto::MessageType::Updates &&
+                pendingBytes_ + bytes.size() > maxPendingBytes_) {
+                shed_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            pendingBytes_ += bytes.size();
+            pending_.push_back(Record{.sequence = ++sequence_, .bytes = std::move(bytes)});
+        }
+        cv_.notify_one();
+        return true;
+    }
+
+    /**
+     * Records shed since the start, the writer thread was behind
+     */
+    [[nodiscard]] uint64_t shed() const { return shed_.load(std::memory_order_relaxed); }
+
+private:
+    using mapping_t = boost::interprocess::file_mapping;
+    using region_t = boost::interprocess::mapped_region;
+
+    struct Record {
+        uint64_t sequence;
+        std::string bytes;
+    };
+
+    struct ReadResult {
+        // Offset after the last valid record
+        std::size_t end{0};
+        // Highest sequence number read
+        uint64_t sequence{0};
+    };
+
+    /**
+     * Folds records into the last catalog and the newest samples of the metrics in it
+     */
+    class Compactor {
+    public:
+        explicit Compactor(std::size_t retention) : retention_{retention} {}
+
+        void operator()(proto::Message &&message) {
+            if (message.type == proto::MessageType::Updates && message.metrics) {
+                std::erase_if(samples_, [&](auto const &entry) {
+                    return std::ranges::none_of(*message.metrics, [&](auto const &metric) {
+                        return metric.name == entry.first;
+                    });
+                });
+                catalog_ = std::move(message);
+            } else if (message.type == proto::MessageType::Ingest && message.series) {
+                for (auto &&series : *message.series) {
+                    add(std::move(series));
+                }
+            }
+        }
+
+        /**
+         * The catalog first, so replaying the snapshot knows the metrics of the samples
+         */
+        std::vector<proto::Message> messages() {
+            std::vector<proto::Message> result;
+
+            if (!catalog_) {
+                return result;
+            }
+            result.push_back(std::move(*catalog_));
+
+            for (auto &&[metric, series] : samples_) {
+                trim(series, retention_);
+
+                for (std::size_t i = 0; i < series.size(); i += kSnapshotSeriesSize) {
+                    result.push_back(proto::Message{
+                        .type = proto::MessageType::Ingest,
+                        .series = std::vector<proto::Series>{slice(series, i)}});
+                }
+            }
+            return result;
+        }
+
+    private:
+        void add(proto::Series &&series) {
+            if (!series.malformed().empty() || series.times.empty()) {
+                return;
+            }
+            auto &current = samples_[series.metric];
+
+            // The type of the metric changed, the store dropped the older samples too
+            if (current.strings.empty() != series.strings.empty() && current.size() > 0) {
+                current = proto::Series{};
+            }
+            current.metric = series.metric;
+            current.times.insert(current.times.end(), series.times.begin(), series.times.end());
+            current.strings.insert(current.strings.end(),
+                                   std::make_move_iterator(series.strings.begin()),
+                                   std::make_move_iterator(series.strings.end()));
+            // Keeps the order of the numbers when integers and doubles mix
+            if (series.doubles.empty()) {
+                for (auto const value : series.integers) {
+                    current.addNumber(value);
+                }
+            } else {
+                for (auto const value : series.doubles) {
+                    current.addNumber(value);
+                }
+            }
+            // Trims once in a while only, erasing from the front moves the whole column
+            if (current.size() > 2 * retention_) {
+                trim(current, retention_);
+            }
+        }
+
+        static void trim(proto::Series &series, std::size_t retention) {
+            if (series.size() <= retention) {
+                return;
+            }
+            auto const count = static_cast<std::ptrdiff_t>(series.size() - retention);
+            auto const eraseFront = [&](auto &column) {
+                if (!column.empty()) {
+                    column.erase(column.begin(), column.begin() + count);
+                }
+            };
+            eraseFront(series.times);
+            eraseFront(series.integers);
+            eraseFront(series.doubles);
+            eraseFront(series.strings);
+        }
+
+        static proto::Series slice(proto::Series const &series, std::size_t offset) {
+            auto const count = std::min(kSnapshotSeriesSize, series.size() - offset);
+            auto const copy = [&](auto const &column) {
+                using column_t = std::remove_cvref_t<decltype(column)>;
+                return column.empty() ? column_t{}
+                                      : column_t(column.begin() + offset,
+                                                 column.begin() + offset + count);
+            };
+            return proto::Series{.metric = series.metric,
+                                 .times = copy(series.times),
+                                 .integers = copy(series.integers),
+                                 .doubles = copy(series.doubles),
+                                 .strings = copy(series.strings)};
+        }
+
+        std::size_t const retention_;
+        std::optional<proto::Message> catalog_;
+        std::unordered_map<std::string, proto::Series> samples_;
+    };
+
+    static uint32_t checksumOf(std::string_view bytes) {
+        // FNV-1a
+        uint32_t hash = 2'166'136'261U;
+
+        for (auto const c : bytes) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 16'777'619U;
+        }
+        return hash;
+    }
+
+    static std::span<char const> bytesOf(region_t const &region) {
+        return {static_cast<char const *>(region.get_address()), region.get_size()};
+    }
+
+    /**
+     * @return a read only mapping of a file, none when it is missing or empty
+     */
+    static std::optional<region_t> map(std::filesystem::path const &path) {
+        std::error_code error;
+
+        if (std::filesystem::file_size(path, error) == 0 || error) {
+            return std::nullopt;
+        }
+        mapping_t const mapping{path.string().c_str(), boost::interprocess::read_only};
+        return region_t{mapping, boost::interprocess::read_only};
+    }
+
+    /**
+     * Calls f(Message&&) for the records with a sequence number after the given one
+     */
+    template <typename F>
+    static ReadResult readRecords(std::span<char const> bytes, uint64_t after, F &&f) {
+        ReadResult result;
+
+        while (result.end + sizeof(Header) <= bytes.size()) {
+            Header header{};
+            std::memcpy(&header, bytes.data() + result.end, sizeof(Header));
+
+            if (header.size == 0 || header.size > bytes.size() - result.end - sizeof(Header)) {
+                break;
+            }
+            std::string_view const payload{bytes.data() + result.end + sizeof(Header),
+                                           header.size};
+
+            if (checksumOf(payload) != header.checksum) {
+                break;
+            }
+            if (header.sequence > after) {
+                try {
+                    f(proto::decode(payload, proto::WireFormat::MsgPack));
+                } catch (nlohmann::json::exception const &) {
+                    break;
+                }
+            }
+            result.sequence = std::max(result.sequence, header.sequence);
+            result.end += sizeof(Header) + header.size;
+        }
+        return result;
+    }
+
+    static void writeRecord(char *to, uint64_t sequence, std::string_view bytes) {
+        Header const header{.size = static_cast<uint32_t>(bytes.size()),
+                            .checksum = checksumOf(bytes),
+                            .sequence = sequence};
+        std::memcpy(to, &header, sizeof(Header));
+        std::memcpy(to + sizeof(Header), bytes.data(), bytes.size());
+    }
+
+    void remap() {
+        region_ = region_t{};
+        mapping_ = mapping_t{logPath_.string().c_str(), boost::interprocess::read_write};
+        region_ = region_t{mapping_, boost::interprocess::read_write};
+    }
+
+    void write(std::stop_token stopToken) {
+        while (true) {
+            std::vector<Record> records;
+            {
+                std::unique_lock lock{mtx_};
+                cv_.wait(lock, stopToken, [&] { return !pending_.empty(); });
+                records.swap(pending_);
+                pendingBytes_ = 0;
+            }
+            // Stopping only once the queue is drained
+            if (records.empty()) {
+                break;
+            }
+            auto const from = end_;
+
+            for (auto const &record : records) {
+                auto const size = sizeof(Header) + record.bytes.size();
+
+                if (end_ + size > region_.get_size()) {
+                    std::filesystem::resize_file(logPath_, region_.get_size() + size + kGrowth);
+                    remap();
+                }
+                writeRecord(static_cast<char *>(region_.get_address()) + end_, record.sequence,
+                            record.bytes);
+                end_ += size;
+                written_ = record.sequence;
+            }
+            region_.flush(from, end_ - from, true);
+
+            if (auto const shed = shed_.load(std::memory_order_relaxed); shed != reportedShed_) {
+                EPS_LOG_WARNING("The disk is behind, {} sample records not persisted so far",
+                                shed);
+                reportedShed_ = shed;
+            }
+            if (end_ >= compactionThreshold_) {
+                compact();
+            }
+        }
+    }
+
+    /**
+     * Folds the snapshot and the log into a new snapshot, then clears the log. The snapshot is
+     * written next to the current one and renamed over it, so there is always a complete one.
+     */
+    void compact() {
+        Compactor compactor{retention_};
+        uint64_t covered = 0;
+
+        if (auto const snapshot = map(snapshotPath_); snapshot) {
+            covered = readRecords(bytesOf(*snapshot), 0, compactor).sequence;
+        }
+        readRecords(bytesOf(region_).first(end_), covered, compactor);
+
+        std::vector<std::string> records;
+        std::size_t total = 0;
+
+        for (auto const &message : compactor.messages()) {
+            records.push_back(proto::encode(message, proto::WireFormat::MsgPack));
+            total += sizeof(Header) + records.back().size();
+        }
+        // Without a catalog the samples could not be replayed, the log keeps them
+        if (records.empty()) {
+            return;
+        }
+        auto next = snapshotPath_;
+        next += ".next";
+        std::ofstream{next, std::ios::binary | std::ios::trunc};
+        std::filesystem::resize_file(next, total);
+        {
+            mapping_t const mapping{next.string().c_str(), boost::interprocess::read_write};
+            region_t region{mapping, boost::interprocess::read_write};
+            auto *to = static_cast<char *>(region.get_address());
+
+            for (auto const &record : records) {
+                writeRecord(to, written_, record);
+                to += sizeof(Header) + record.size();
+            }
+            region.flush();
+        }
+        std::filesystem::rename(next, snapshotPath_);
+
+        std::memset(region_.get_address(), 0, end_);
+        region_.flush(0, end_, false);
+        end_ = 0;
+    }
+
+    std::filesystem::path const logPath_;
+    std::filesystem::path const snapshotPath_;
+    std::size_t const retention_;
+    std::size_t const compactionThreshold_;
+    std::size_t const maxPendingBytes_;
+
+    std::mutex mtx_;
+    std::condition_variable_any cv_;
+    std::vector<Record> pending_;
+    std::size_t pendingBytes_{0};
+    // Last sequence number given to a record, guarded by mtx_
+    uint64_t sequence_{0};
+    std::atomic<uint64_t> shed_{0};
+
+    // Only the writer thread uses these once it started
+    mapping_t mapping_;
+    region_t region_;
+    std::size_t end_{0};
+    uint64_t written_{0};
+    // Shed count the last warning gave
+    uint64_t reportedShed_{0};
+
+    std::jthread writer_;
+};
+
+} // namespace eps
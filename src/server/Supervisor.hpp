@@ -0,0 +1,281 @@
+
+#pragma once
+
+#include "CatalogSegment.hpp"
+#include "Server.hpp"
+#include "StateLog.hpp"
+#include "TlsSessions.hpp"
+#include "eps_common/CommandLineInterface.hpp"
+#include "eps_common/Logger.hpp"
+#include "eps_common/Protocol.hpp"
+#include "eps_common/definitions.hpp"
+
+// Worker processes need SO_REUSEPORT, prctl and posix_spawn, elsewhere the server is one process
+#ifdef __linux__
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern char **environ;
+
+namespace eps {
+
+/**
+ * Control process of a server running as worker processes, one event loop and one set of IO
+ * threads each, so the sockets, the sessions and the allocations of a worker never contend with
+ * the other ones.
+ *
+ * The workers all listen on the port with SO_REUSEPORT (crow::reuse_port, a hook src/cmake adds to
+ * the Crow sources) and the kernel spreads the connections over them, so the clients need not
+ * know there are workers. The workers share what the clients must find on any of them:
+ *  - the catalog, which the control process owns and publishes to a CatalogSegment the workers
+ *    check every time they check for the quit, so a new version reaches them within half a second
+ *    and each one notifies its own clients;
+ *  - the TLS ticket keys, created here before the workers start, so a client resumes its session
+ *    on a worker it never talked to.
+ * The samples a worker ingests stay in that worker, each one persists its state in its own
+ * directory.
+ *
+ * The workers are the server binary run again, not forks of this process, so they do not inherit
+ * the threads of the logger. A worker that dies is restarted, a bit later every time it dies
+ * again soon after its start.
+ */
+class Supervisor {
+public:
+    static constexpr std::string_view kControlDirectory = "control";
+    static constexpr std::chrono::milliseconds kReapInterval{200};
+    static constexpr std::chrono::milliseconds kMinRestartDelay{100};
+    static constexpr std::chrono::milliseconds kMaxRestartDelay{30'000};
+    // A worker up for that long is healthy, the next time it dies it restarts after the least delay
+    static constexpr std::chrono::seconds kHealthyUptime{60};
+
+    /**
+     * @param workerArgs command line of the server, every worker runs with it and its index
+     */
+    Supervisor(int port, std::size_t workers, std::filesystem::path stateDirectory,
+               std::vector<std::string> workerArgs)
+        : version_{semver::version{defs::kInitialServerVersion}}
+        , metrics_{Server::initialMetrics()}
+        , port_{port}
+        , workerArgs_{std::move(workerArgs)}
+        , workers_(workers)
+        , segment_{CatalogSegment::create(segmentName(port))} {
+        if (!stateDirectory.empty()) {
+            stateLog_ = std::make_unique<StateLog>(stateDirectory / kControlDirectory, 0);
+            bool restored = false;
+
+            stateLog_->replay([&](proto::Message &&message) {
+                restored |= Server::restoreCatalog(std::move(message), version_, metrics_);
+            });
+            stateLog_->start();
+
+            if (restored) {
+                persistedHash_ = Server::catalogHash(version_, metrics_);
+            }
+            TlsSessions{stateDirectory / Server::kTicketKeysFile}.provision();
+        }
+        publishCatalog();
+    }
+
+    Supervisor(Supervisor const &) = delete;
+    Supervisor &operator=(Supervisor const &) = delete;
+
+    ~Supervisor() { shutdown(); }
+
+    /**
+     * Name of the catalog segment of the server listening on a port
+     */
+    static std::string segmentName(int port) { return std::format("eps-catalog-{}", port); }
+
+    /**
+     * Where a worker persists its state, nowhere when the server keeps it in memory
+     */
+    static std::filesystem::path workerDirectory(std::filesystem::path const &stateDirectory,
+                                                 std::size_t index) {
+        return stateDirectory.empty() ? std::filesystem::path{}
+                                      : stateDirectory / std::format("worker-{}", index);
+    }
+
+    /**
+     * Starts the workers and runs the CLI until quit, the workers stop with it
+     */
+    void run() {
+        for (std::size_t i = 0; i < workers_.size(); ++i) {
+            start(i);
+        }
+        reaperThr_ = std::jthread([&](std::stop_token st) { reap(st); });
+
+        cmdLineIface_.option({.label = std::format("Update to version {} and notify clients",
+                                                   defs::kServerNewVersion),
+                              .action = [&] {
+                                  Server::upgradeCatalog(version_, metrics_);
+                                  publishCatalog();
+                              }});
+
+        while (cmdLineIface_.tryToExecuteAction(
+            std::format("[MENU] Server (v{}) port: {}, {} workers", version_.value.to_string(),
+                        port_, workers_.size()))) {
+        }
+        EPS_LOG_INFO("Shutdown has been requested, bye!");
+        shutdown();
+    }
+
+private:
+    struct Worker {
+        using clock_t = std::chrono::steady_clock;
+
+        // 0 while the worker is down
+        pid_t pid{0};
+        clock_t::time_point startedAt;
+        clock_t::time_point restartAt;
+        std::chrono::milliseconds restartDelay{0};
+    };
+
+    /**
+     * Persists the catalog and hands it over to the workers
+     */
+    void publishCatalog() {
+        auto const record = Server::catalogRecord(version_, metrics_);
+
+        // Not again for the catalog restored on start, the log has it
+        if (auto hash = Server::catalogHash(version_, metrics_);
+            stateLog_ && hash != persistedHash_) {
+            stateLog_->append(record);
+            persistedHash_ = std::move(hash);
+        }
+        segment_.publish(record);
+    }
+
+    void start(std::size_t index) {
+        auto &worker = workers_[index];
+        auto args = workerArgs_;
+        args.emplace_back("--worker");
+        args.emplace_back(std::to_string(index));
+
+        std::vector<char *> argv;
+        argv.reserve(args.size() + 1);
+
+        for (auto &arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+
+        worker.startedAt = Worker::clock_t::now();
+
+        // The binary of this process, whatever the path it was started with
+        if (auto const error = ::posix_spawn(&worker.pid, "/proc/self/exe", nullptr, nullptr,
+                                             argv.data(), environ);
+            error != 0) {
+            worker.pid = 0;
+            scheduleRestart(worker);
+            EPS_LOG_ERROR("Unable to start worker {} [{}], retrying in {}ms", index,
+                          std::strerror(error), worker.restartDelay.count());
+            return;
+        }
+        EPS_LOG_INFO("Worker {} (pid {}) listening on port {}", index, worker.pid, port_);
+    }
+
+    void scheduleRestart(Worker &worker) {
+        auto const now = Worker::clock_t::now();
+
+        worker.restartDelay = now - worker.startedAt >= kHealthyUptime
+                                  ? kMinRestartDelay
+                                  : std::clamp(2 * worker.restartDelay, kMinRestartDelay,
+                                               kMaxRestartDelay);
+        worker.restartAt = now + worker.restartDelay;
+    }
+
+    /**
+     * Restarts the workers that died, until the supervisor stops
+     */
+    void reap(std::stop_token stopToken) {
+        while (!stopToken.stop_requested()) {
+            int status = 0;
+
+            for (pid_t pid = ::waitpid(-1, &status, WNOHANG); pid > 0;
+                 pid = ::waitpid(-1, &status, WNOHANG)) {
+                auto const it = std::ranges::find(workers_, pid, &Worker::pid);
+
+                if (it == workers_.end()) {
+                    continue;
+                }
+                it->pid = 0;
+                scheduleRestart(*it);
+                EPS_LOG_WARNING("Worker {} (pid {}) {}, restarting it in {}ms",
+                                it - workers_.begin(), pid, describe(status),
+                                it->restartDelay.count());
+            }
+            auto const now = Worker::clock_t::now();
+
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                if (workers_[i].pid == 0 && workers_[i].restartAt <= now) {
+                    start(i);
+                }
+            }
+            std::this_thread::sleep_for(kReapInterval);
+        }
+    }
+
+    static std::string describe(int status) {
+        if (WIFSIGNALED(status)) {
+            return std::format("was killed by signal {}", WTERMSIG(status));
+        }
+        return std::format("exited with status {}", WEXITSTATUS(status));
+    }
+
+    /**
+     * Stops the workers and waits for them, then removes the catalog segment
+     */
+    void shutdown() {
+        if (reaperThr_.joinable()) {
+            reaperThr_.request_stop();
+            reaperThr_.join();
+        }
+        for (auto const &worker : workers_) {
+            if (worker.pid > 0) {
+                ::kill(worker.pid, SIGTERM);
+            }
+        }
+        for (auto &worker : workers_) {
+            if (worker.pid > 0) {
+                ::waitpid(worker.pid, nullptr, 0);
+                worker.pid = 0;
+            }
+        }
+        CatalogSegment::remove(segment_.name());
+    }
+
+    // Only the CLI changes version_ and metrics_, the reaper thread owns workers_ while it runs
+    proto::Version version_;
+    proto::metrics_umap_t metrics_;
+    int const port_;
+    std::vector<std::string> const workerArgs_;
+    std::vector<Worker> workers_;
+    CatalogSegment segment_;
+    // Persists the catalog when the server has a state directory
+    std::unique_ptr<StateLog> stateLog_;
+    // Hash of the last catalog appended to the state log, or restored from it
+    std::string persistedHash_;
+    CommandLineInterface cmdLineIface_;
+    std::jthread reaperThr_;
+};
+
+} // namespace eps
+
+#endif
@@ -0,0 +1,400 @@
+
+#pragma once
+
+#include "eps_common/Protocol.hpp"
+
+#include <magic_enum.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace eps {
+
+/**
+ * Histogram of durations in power of two buckets of nanoseconds, the layout of a Prometheus
+ * histogram. It is a few hundred bytes, so every thread keeps one per message type, unlike the
+ * LatencyHistogram of the load generator that trades memory for percentiles within 2%.
+ */
+class DurationHistogram {
+public:
+    using duration_t = std::chrono::nanoseconds;
+
+    // The first bucket ends at 256ns and the last finite one at about 1s
+    static constexpr unsigned kFirstBucketBits = 8;
+    static constexpr std::size_t kBucketsCount = 23;
+
+    void record(duration_t duration) {
+        auto const value = static_cast<uint64_t>(std::max<duration_t::rep>(duration.count(), 0));
+        ++counts_[indexOf(value)];
+        sum_ += value;
+    }
+
+    void merge(DurationHistogram const &other) {
+        for (std::size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        sum_ += other.sum_;
+    }
+
+    [[nodiscard]] uint64_t count() const {
+        uint64_t total = 0;
+
+        for (auto const c : counts_) {
+            total += c;
+        }
+        return total;
+    }
+
+    [[nodiscard]] duration_t sum() const { return duration_t{sum_}; }
+
+    /**
+     * @return the upper bound of a finite bucket
+     */
+    static duration_t boundOf(std::size_t bucket) {
+        return duration_t{int64_t{1} << (kFirstBucketBits + bucket)};
+    }
+
+    /**
+     * Calls f(bound, cumulative count) for every finite bucket and then f(nullopt, count)
+     */
+    template <typename F> void forEachBucket(F &&f) const {
+        uint64_t cumulative = 0;
+
+        for (std::size_t i = 0; i < kBucketsCount; ++i) {
+            cumulative += counts_[i];
+            f(std::optional{boundOf(i)}, cumulative);
+        }
+        f(std::optional<duration_t>{}, cumulative + counts_[kBucketsCount]);
+    }
+
+private:
+    static std::size_t indexOf(uint64_t value) {
+        if (value <= (uint64_t{1} << kFirstBucketBits)) {
+            return 0;
+        }
+        // A power of two falls in the bucket it bounds
+        auto const index = static_cast<std::size_t>(std::bit_width(value - 1)) - kFirstBucketBits;
+        return std::min(index, kBucketsCount);
+    }
+
+    // The last count is the overflow bucket
+    std::array<uint64_t, kBucketsCount + 1> counts_{};
+    uint64_t sum_{0};
+};
+
+/**
+ * TLS handshakes the server completed, and how many of them resumed a session
+ */
+struct HandshakeCounters {
+    uint64_t completed{0};
+    uint64_t resumed{0};
+};
+
+/**
+ * Totals of the send queues of the connections
+ */
+struct SendQueueCounters {
+    int64_t queuedBytes{0};
+    int64_t queuedFrames{0};
+    // Sent to the clients that acknowledge and not acknowledged yet
+    int64_t inFlightBytes{0};
+    // Connections over their high watermark, queueing their frames
+    int64_t blocked{0};
+    uint64_t coalesced{0};
+    uint64_t dropped{0};
+    uint64_t disconnected{0};
+};
+
+/**
+ * Counters and histograms of the server, exposed in the Prometheus text format.
+ *
+ * Every thread records into its own shard, so the IO threads never share a cache line while
+ * handling messages; a shard lock is only ever contended by a scrape, which merges the shards
+ * one at a time. What a thread recorded stays in the totals after it exits.
+ */
+class Telemetry {
+public:
+    using clock_t = std::chrono::steady_clock;
+    using duration_t = DurationHistogram::duration_t;
+
+    static constexpr std::size_t kMessageTypesCount = magic_enum::enum_count<proto::MessageType>();
+
+    struct Stats {
+        // Indexed by the type of the request
+        std::array<DurationHistogram, kMessageTypesCount> handlers;
+        // From the IO thread handing a frame over to a handler thread taking it
+        DurationHistogram queue;
+        DurationHistogram parse;
+        DurationHistogram serialize;
+        DurationHistogram fanOut;
+        uint64_t bytesIn{0};
+        uint64_t bytesOut{0};
+
+        void merge(Stats const &other) {
+            for (std::size_t i = 0; i < handlers.size(); ++i) {
+                handlers[i].merge(other.handlers[i]);
+            }
+            queue.merge(other.queue);
+            parse.merge(other.parse);
+            serialize.merge(other.serialize);
+            fanOut.merge(other.fanOut);
+            bytesIn += other.bytesIn;
+            bytesOut += other.bytesOut;
+        }
+    };
+
+    /**
+     * What happened to one message, recorded at once to lock the shard once
+     */
+    struct Sample {
+        std::optional<proto::MessageType> type;
+        std::optional<duration_t> queue;
+        std::optional<duration_t> parse;
+        std::optional<duration_t> handler;
+        std::optional<duration_t> serialize;
+        std::optional<duration_t> fanOut;
+        std::size_t received{0};
+        std::size_t sent{0};
+    };
+
+    Telemetry() = default;
+    Telemetry(Telemetry const &) = delete;
+    Telemetry &operator=(Telemetry const &) = delete;
+
+    void record(Sample const &sample) {
+        auto &shard = local();
+        std::lock_guard<std::mutex> _{shard.mtx};
+        auto &stats = shard.stats;
+
+        if (sample.type && sample.handler) {
+            stats.handlers[magic_enum::enum_index(*sample.type).value_or(0)].record(
+                *sample.handler);
+        }
+        if (sample.queue) {
+            stats.queue.record(*sample.queue);
+        }
+        if (sample.parse) {
+            stats.parse.record(*sample.parse);
+        }
+        if (sample.serialize) {
+            stats.serialize.record(*sample.serialize);
+        }
+        if (sample.fanOut) {
+            stats.fanOut.record(*sample.fanOut);
+        }
+        stats.bytesIn += sample.received;
+        stats.bytesOut += sample.sent;
+    }
+
+    /**
+     * Merges the shards of every thread
+     */
+    [[nodiscard]] Stats collect() const {
+        std::lock_guard<std::mutex> _{registry_->mtx};
+        Stats stats = registry_->retired;
+
+        for (auto const &shard : registry_->shards) {
+            std::lock_guard<std::mutex> __{shard->mtx};
+            stats.merge(shard->stats);
+        }
+        return stats;
+    }
+
+    /**
+     * @return the Prometheus text exposition of the stats
+     */
+    [[nodiscard]] std::string render(std::size_t openConnections,
+                                     HandshakeCounters const &handshakes = {},
+                                     SendQueueCounters const &sendQueues = {},
+                                     uint64_t stateLogShed = 0) const {
+        auto const stats = collect();
+        std::string out;
+
+        header(out, "eps_handler_duration_seconds", "histogram",
+               "Time spent in the message handlers, by request type");
+        for (std::size_t i = 0; i < stats.handlers.size(); ++i) {
+            if (stats.handlers[i].count() > 0) {
+                auto const type = magic_enum::enum_value<proto::MessageType>(i);
+                histogram(out, "eps_handler_duration_seconds",
+                          std::format("type=\"{}\"", magic_enum::enum_name(type)),
+                          stats.handlers[i]);
+            }
+        }
+        header(out, "eps_handler_queue_duration_seconds", "histogram",
+               "Time a received frame waits for a handler thread");
+        histogram(out, "eps_handler_queue_duration_seconds", "", stats.queue);
+
+        header(out, "eps_parse_duration_seconds", "histogram",
+               "Time to inflate and decode a received frame");
+        histogram(out, "eps_parse_duration_seconds", "", stats.parse);
+
+        header(out, "eps_serialize_duration_seconds", "histogram",
+               "Time to encode, deflate and queue a response");
+        histogram(out, "eps_serialize_duration_seconds", "", stats.serialize);
+
+        header(out, "eps_broadcast_fanout_duration_seconds", "histogram",
+               "Time to hand a broadcast over to every connection");
+        histogram(out, "eps_broadcast_fanout_duration_seconds", "", stats.fanOut);
+
+        header(out, "eps_received_bytes_total", "counter", "Bytes of the received frames");
+        out += std::format("eps_received_bytes_total {}\n", stats.bytesIn);
+
+        header(out, "eps_sent_bytes_total", "counter", "Bytes of the frames queued to send");
+        out += std::format("eps_sent_bytes_total {}\n", stats.bytesOut);
+
+        header(out, "eps_open_connections", "gauge", "Open websocket connections");
+        out += std::format("eps_open_connections {}\n", openConnections);
+
+        header(out, "eps_tls_handshakes_total", "counter",
+               "TLS handshakes completed, by whether they resumed a session");
+        out += std::format("eps_tls_handshakes_total{{resumed=\"false\"}} {}\n",
+                           handshakes.completed - handshakes.resumed);
+        out += std::format("eps_tls_handshakes_total{{resumed=\"true\"}} {}\n",
+                           handshakes.resumed);
+
+        header(out, "eps_send_queue_bytes", "gauge",
+               "Bytes for the clients, waiting in the send queues or not acknowledged yet");
+        out += std::format("eps_send_queue_bytes{{state=\"queued\"}} {}\n",
+                           sendQueues.queuedBytes);
+        out += std::format("eps_send_queue_bytes{{state=\"unacknowledged\"}} {}\n",
+                           sendQueues.inFlightBytes);
+
+        header(out, "eps_send_queue_frames", "gauge", "Frames waiting in the send queues");
+        out += std::format("eps_send_queue_frames {}\n", sendQueues.queuedFrames);
+
+        header(out, "eps_send_queue_blocked_connections", "gauge",
+               "Connections past their high watermark, queueing their frames");
+        out += std::format("eps_send_queue_blocked_connections {}\n", sendQueues.blocked);
+
+        header(out, "eps_send_queue_coalesced_total", "counter",
+               "Queued frames replaced by a newer one of the same type");
+        out += std::format("eps_send_queue_coalesced_total {}\n", sendQueues.coalesced);
+
+        header(out, "eps_send_queue_overflows_total", "counter",
+               "Frames that did not fit in a send queue, by what the policy did");
+        out += std::format("eps_send_queue_overflows_total{{policy=\"drop\"}} {}\n",
+                           sendQueues.dropped);
+        out += std::format("eps_send_queue_overflows_total{{policy=\"disconnect\"}} {}\n",
+                           sendQueues.disconnected);
+
+        header(out, "eps_state_log_shed_records_total", "counter",
+               "Ingest records not persisted, the state log writer was behind");
+        out += std::format("eps_state_log_shed_records_total {}\n", stateLogShed);
+        return out;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mtx;
+        Stats stats;
+    };
+
+    struct Registry {
+        std::mutex mtx;
+        std::vector<std::unique_ptr<Shard>> shards;
+        // What the threads that exited recorded
+        Stats retired;
+    };
+
+    /**
+     * Owned by a thread, folds its shard into the retired stats when the thread exits
+     */
+    class Handle {
+    public:
+        Handle(std::weak_ptr<Registry> registry, Shard *shard)
+            : registry_{std::move(registry)}, shard_{shard} {}
+
+        Handle(Handle const &) = delete;
+        Handle &operator=(Handle const &) = delete;
+
+        ~Handle() {
+            auto const registry = registry_.lock();
+
+            if (!registry) {
+                return;
+            }
+            std::lock_guard<std::mutex> _{registry->mtx};
+            {
+                std::lock_guard<std::mutex> __{shard_->mtx};
+                registry->retired.merge(shard_->stats);
+            }
+            std::erase_if(registry->shards,
+                          [&](auto const &shard) { return shard.get() == shard_; });
+        }
+
+        [[nodiscard]] Shard *shard() const { return shard_; }
+
+    private:
+        std::weak_ptr<Registry> registry_;
+        Shard *shard_;
+    };
+
+    Shard &local() {
+        // The ids are never reused, a thread cannot mistake a new instance for a destroyed one
+        thread_local uint64_t lastId = 0;
+        thread_local Shard *last = nullptr;
+
+        if (lastId == id_) {
+            return *last;
+        }
+        thread_local std::unordered_map<uint64_t, Handle> handles;
+        auto it = handles.find(id_);
+
+        if (it == handles.end()) {
+            auto shard = std::make_unique<Shard>();
+            auto *raw = shard.get();
+            {
+                std::lock_guard<std::mutex> _{registry_->mtx};
+                registry_->shards.push_back(std::move(shard));
+            }
+            it = handles.try_emplace(id_, registry_, raw).first;
+        }
+        lastId = id_;
+        last = it->second.shard();
+        return *last;
+    }
+
+    static void header(std::string &out, std::string_view name, std::string_view type,
+                       std::string_view help) {
+        out += std::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+    }
+
+    /**
+     * @param labels the labels common to every line, e.g. type="Version"
+     */
+    static void histogram(std::string &out, std::string_view name, std::string_view labels,
+                          DurationHistogram const &h) {
+        using seconds_t = std::chrono::duration<double>;
+
+        auto const separator = labels.empty() ? "" : ",";
+        h.forEachBucket([&](std::optional<duration_t> bound, uint64_t count) {
+            auto const le = bound ? std::format("{}", seconds_t{*bound}.count())
+                                  : std::string{"+Inf"};
+            out += std::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, separator, le,
+                               count);
+        });
+        auto const labelSet = labels.empty() ? std::string{} : std::format("{{{}}}", labels);
+        out += std::format("{}_sum{} {}\n", name, labelSet, seconds_t{h.sum()}.count());
+        out += std::format("{}_count{} {}\n", name, labelSet, h.count());
+    }
+
+    static inline std::atomic<uint64_t> nextId_{1};
+
+    uint64_t const id_{nextId_.fetch_add(1, std::memory_order_relaxed)};
+    std::shared_ptr<Registry> registry_{std::make_shared<Registry>()};
+};
+
+} // namespace eps
@@ -0,0 +1,154 @@
+
+#pragma once
+
+#include "Telemetry.hpp"
+
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace eps {
+
+/**
+ * Lets the clients resume their TLS session instead of running a full handshake, e.g. when they
+ * all come back at once after a restart: a session cache for the clients resuming by session id,
+ * and session tickets for the others, which is every TLS 1.3 client.
+ *
+ * The ticket keys are kept in a file, so the tickets outlive the process and every server using
+ * the same file accepts them. Deleting the file rotates the keys, the clients then run one full
+ * handshake.
+ */
+class TlsSessions {
+public:
+    static constexpr long kCacheSize = 20'480;
+    static constexpr std::chrono::seconds kLifetime{std::chrono::hours{24}};
+    // Name, HMAC secret and AES key of the tickets, the layout OpenSSL expects
+    static constexpr std::size_t kTicketKeysSize = 80;
+
+    using ticket_keys_t = std::array<unsigned char, kTicketKeysSize>;
+
+    /**
+     * @param ticketKeys file of the ticket keys, created when missing. With an empty path the keys
+     * only live in memory and the tickets die with the process.
+     */
+    explicit TlsSessions(std::filesystem::path ticketKeys = {})
+        : ticketKeys_{std::move(ticketKeys)} {}
+
+    TlsSessions(TlsSessions const &) = delete;
+    TlsSessions &operator=(TlsSessions const &) = delete;
+
+    /**
+     * Sets up the session resumption of a server context and counts its handshakes, the context
+     * must not outlive this object
+     */
+    void configure(SSL_CTX *ctx) {
+        // A session only resumes within the context id it was created in, the server has one
+        static constexpr std::string_view kContextId = "eps-server";
+
+        SSL_CTX_set_session_id_context(
+            ctx, reinterpret_cast<unsigned char const *>(kContextId.data()), kContextId.size());
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, kCacheSize);
+        SSL_CTX_set_timeout(ctx, kLifetime.count());
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+        // A client only keeps its last ticket, the second one OpenSSL sends by default is wasted
+        SSL_CTX_set_num_tickets(ctx, 1);
+
+        if (!ticketKeys_.empty()) {
+            auto keys = loadTicketKeys();
+
+            if (SSL_CTX_set_tlsext_ticket_keys(ctx, keys.data(), keys.size()) != 1) {
+                throw std::runtime_error("Unable to set the TLS ticket keys");
+            }
+        }
+        SSL_CTX_set_ex_data(ctx, index(), this);
+        SSL_CTX_set_info_callback(ctx, &TlsSessions::onInfo);
+    }
+
+    /**
+     * Creates the file of the ticket keys when missing, before the servers sharing it start and
+     * each write keys of their own
+     */
+    void provision() const {
+        if (!ticketKeys_.empty()) {
+            loadTicketKeys();
+        }
+    }
+
+    [[nodiscard]] HandshakeCounters counters() const {
+        return {.completed = completed_.load(std::memory_order_relaxed),
+                .resumed = resumed_.load(std::memory_order_relaxed)};
+    }
+
+private:
+    static int index() {
+        static int const index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static void onInfo(SSL const *ssl, int where, int) {
+        if ((where & SSL_CB_HANDSHAKE_DONE) == 0) {
+            return;
+        }
+        auto *self =
+            static_cast<TlsSessions *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), index()));
+
+        if (self != nullptr) {
+            self->completed_.fetch_add(1, std::memory_order_relaxed);
+
+            if (SSL_session_reused(ssl) == 1) {
+                self->resumed_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @return the keys of the file, or new ones written to it
+     */
+    ticket_keys_t loadTicketKeys() const {
+        namespace fs = std::filesystem;
+
+        ticket_keys_t keys{};
+
+        if (std::ifstream in{ticketKeys_, std::ios::binary};
+            in && in.read(reinterpret_cast<char *>(keys.data()), keys.size())) {
+            return keys;
+        }
+        if (RAND_bytes(keys.data(), static_cast<int>(keys.size())) != 1) {
+            throw std::runtime_error("Unable to generate the TLS ticket keys");
+        }
+        if (ticketKeys_.has_parent_path()) {
+            fs::create_directories(ticketKeys_.parent_path());
+        }
+        // Written aside and renamed, another server never reads half of the keys
+        auto next = ticketKeys_;
+        next += ".next";
+        {
+            std::ofstream out{next, std::ios::binary | std::ios::trunc};
+
+            if (!out.write(reinterpret_cast<char const *>(keys.data()), keys.size()).flush()) {
+                throw std::runtime_error(
+                    std::format("Unable to write the TLS ticket keys [{}]", next.string()));
+            }
+        }
+        fs::permissions(next, fs::perms::owner_read | fs::perms::owner_write);
+        fs::rename(next, ticketKeys_);
+        return keys;
+    }
+
+    std::filesystem::path const ticketKeys_;
+    std::atomic<uint64_t> completed_{0};
+    std::atomic<uint64_t> resumed_{0};
+};
+
+} // namespace eps
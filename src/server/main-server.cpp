@@ -1,11 +1,123 @@
 
 #include "Server.hpp"
 
+#ifdef __linux__
+#include "Supervisor.hpp"
+
+#include <sys/prctl.h>
+#endif
+
+#include <charconv>
+#include <csignal>
 #include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    // Usage: eps-server [--io-threads <n>] [--handler-threads <n>]
+    //                   [--send-high <bytes>] [--send-low <bytes>] [--send-max <bytes>]
+    //                   [--send-overflow drop|disconnect] [--send-legacy-budget <bytes>]
+    //                   [--send-legacy-rate <bytes per second>] [--workers <n> (Linux)]
+    //                   [off|<compression threshold in bytes>] [<state directory>|memory]
+    eps::proto::CompressionSettings compression{.enabled = true};
+    std::filesystem::path stateDirectory = std::filesystem::current_path() / "eps-state";
+    eps::ThreadSettings threads;
+    eps::SendQueueSettings sendQueue;
+    std::vector<std::string_view> positional;
+#ifdef __linux__
+    // Processes sharing kPort, with a control process running the CLI
+    std::size_t workers = 0;
+    // Set by the control process when it starts a worker
+    std::optional<std::size_t> worker;
+#endif
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view const arg{argv[i]};
+#ifdef __linux__
+        if ((arg == "--workers" || arg == "--worker") && i + 1 < argc) {
+            std::string_view const value{argv[++i]};
+            auto &count = arg == "--workers" ? workers : worker.emplace();
+            std::from_chars(value.data(), value.data() + value.size(), count);
+            continue;
+        }
+#endif
+        auto *count = arg == "--io-threads"           ? &threads.io
+                      : arg == "--handler-threads"    ? &threads.handlers
+                      : arg == "--send-high"          ? &sendQueue.highWatermark
+                      : arg == "--send-low"           ? &sendQueue.lowWatermark
+                      : arg == "--send-max"           ? &sendQueue.maxQueued
+                      : arg == "--send-legacy-budget" ? &sendQueue.legacyBudget
+                      : arg == "--send-legacy-rate"   ? &sendQueue.legacyRate
+                                                      : nullptr;
+        if (arg == "--send-overflow" && i + 1 < argc) {
+            sendQueue.overflow = std::string_view{argv[++i]} == "drop"
+                                     ? eps::OverflowPolicy::Drop
+                                     : eps::OverflowPolicy::Disconnect;
+        } else if (count == nullptr) {
+            positional.push_back(arg);
+        } else if (i + 1 < argc) {
+            std::string_view const value{argv[++i]};
+            std::from_chars(value.data(), value.data() + value.size(), *count);
+        }
+    }
+    if (!positional.empty()) {
+        auto const arg = positional[0];
+
+        if (arg == "off") {
+            compression.enabled = false;
+        } else {
+            std::from_chars(arg.data(), arg.data() + arg.size(), compression.threshold);
+        }
+    }
+    if (positional.size() > 1) {
+        auto const arg = positional[1];
+        stateDirectory = arg == "memory" ? std::filesystem::path{} : std::filesystem::path{arg};
+    }
+    auto const port = eps::defs::ws::kPort;
+
+#ifdef __linux__
+    if (worker) {
+        // The worker goes away with the control process, even when it is killed
+        ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+        std::signal(SIGTERM, [](int) { eps::Server::requestStop(); });
+        std::signal(SIGINT, [](int) { eps::Server::requestStop(); });
+        // The workers all bind the port, the kernel spreads the connections over them
+        crow::reuse_port = true;
 
-int main() {
-    eps::Server server{eps::defs::ws::kPort};
+        auto const ticketKeys = stateDirectory.empty()
+                                    ? std::filesystem::path{}
+                                    : stateDirectory / eps::Server::kTicketKeysFile;
+        eps::Server server{port,
+                           compression,
+                           eps::Supervisor::workerDirectory(stateDirectory, *worker),
+                           threads,
+                           sendQueue,
+                           eps::WorkerSettings{.catalogSegment =
+                                                   eps::Supervisor::segmentName(port),
+                                               .ticketKeys = ticketKeys}};
+        server.run();
+        return EXIT_SUCCESS;
+    }
+    if (workers > 0) {
+        // The workers run with the same arguments, but --workers
+        std::vector<std::string> workerArgs;
 
+        for (int i = 0; i < argc; ++i) {
+            if (std::string_view{argv[i]} == "--workers") {
+                ++i;
+            } else {
+                workerArgs.emplace_back(argv[i]);
+            }
+        }
+        eps::Supervisor supervisor{port, workers, stateDirectory, std::move(workerArgs)};
+        supervisor.run();
+        return EXIT_SUCCESS;
+    }
+#endif
+    eps::Server server{port, compression, stateDirectory, threads, sendQueue};
     server.run();
 
     return EXIT_SUCCESS;
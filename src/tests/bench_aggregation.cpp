@@ -0,0 +1,146 @@
+
+#include "server/Aggregation.hpp"
+#include "server/MetricStore.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_approx.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <format>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+struct Column {
+    std::vector<int64_t> times;
+    std::vector<double> values;
+};
+
+Column makeColumn(std::size_t samplesCount) {
+    std::minstd_rand random{42};
+    std::normal_distribution<double> value{0.5, 0.1};
+    Column column;
+
+    for (std::size_t i = 0; i < samplesCount; ++i) {
+        column.times.push_back(static_cast<int64_t>(i));
+        column.values.push_back(value(random));
+    }
+    return column;
+}
+
+void checkSame(Aggregate const &actual, Aggregate const &expected) {
+    CHECK(actual.count == expected.count);
+    CHECK(actual.sum == Catch::Approx(expected.sum));
+    CHECK(actual.min == expected.min);
+    CHECK(actual.max == expected.max);
+}
+
+} // namespace
+
+TEST_CASE("The kernels agree with the scalar baseline", "[aggregation]") {
+    auto const samplesCount = GENERATE(0, 1, 3, 4, 5, 1'000, 1'003);
+    auto const column = makeColumn(samplesCount);
+    std::span<int64_t const> const times{column.times};
+    std::span<double const> const values{column.values};
+    auto const from = static_cast<int64_t>(samplesCount / 3);
+
+    checkSame(aggregate(values), scalar::aggregate(values));
+    checkSame(aggregateSince(times, values, from), scalar::aggregateSince(times, values, from));
+}
+
+TEST_CASE("The AVX2 kernels give the scalar results", "[aggregation]") {
+    auto const samplesCount = GENERATE(0, 1, 3, 4, 5, 7, 1'000, 1'003);
+    auto const column = makeColumn(samplesCount);
+    std::span<int64_t const> const times{column.times};
+    std::span<double const> const values{column.values};
+
+#if defined(EPS_AVX2_KERNELS)
+    if (!hasAvx2()) {
+        SKIP("The CPU has no AVX2");
+    }
+    checkSame(avx2::aggregate(values), scalar::aggregate(values));
+
+    for (auto const from : {std::numeric_limits<int64_t>::min(), int64_t{0},
+                            static_cast<int64_t>(samplesCount / 3),
+                            static_cast<int64_t>(samplesCount)}) {
+        checkSame(avx2::aggregateSince(times, values, from),
+                  scalar::aggregateSince(times, values, from));
+    }
+#else
+    SKIP("The AVX2 kernels are only built for x86-64");
+#endif
+}
+
+TEST_CASE("Percentiles follow the nearest rank", "[aggregation]") {
+    std::vector<double> values(100);
+    std::iota(values.begin(), values.end(), 1.0);
+    std::vector<double> const ranks{99, 50, 0, 100};
+
+    CHECK(percentiles(values, ranks) == std::vector<double>{99, 50, 1, 100});
+}
+
+TEST_CASE("Window queries merge the block summaries", "[aggregation]") {
+    SampleRing<double> ring{64};
+
+    // Wraps the ring once, the first samples are gone
+    for (int64_t i = 0; i < 80; ++i) {
+        ring.push(i, static_cast<double>(i));
+    }
+    auto const all = ring.aggregateSince(0, nullptr);
+    CHECK(all.count == 64);
+    CHECK(all.min == 16);
+    CHECK(all.max == 79);
+
+    std::vector<double> values;
+    auto const window = ring.aggregateSince(70, &values);
+    CHECK(window.count == 10);
+    CHECK(window.mean() == Catch::Approx(74.5));
+    CHECK(values.size() == 10);
+}
+
+TEST_CASE("Aggregation kernels against the scalar baseline", "[aggregation][!benchmark]") {
+    auto const samplesCount = GENERATE(1'024, 65'536, 1'048'576);
+    auto const column = makeColumn(samplesCount);
+    std::span<int64_t const> const times{column.times};
+    std::span<double const> const values{column.values};
+    auto const from = static_cast<int64_t>(samplesCount / 2);
+
+    BENCHMARK(std::format("scalar aggregate {}", samplesCount)) {
+        return scalar::aggregate(values);
+    };
+    BENCHMARK(std::format("kernel aggregate {}", samplesCount)) { return aggregate(values); };
+
+    BENCHMARK(std::format("scalar aggregateSince {}", samplesCount)) {
+        return scalar::aggregateSince(times, values, from);
+    };
+    BENCHMARK(std::format("kernel aggregateSince {}", samplesCount)) {
+        return aggregateSince(times, values, from);
+    };
+}
+
+TEST_CASE("Window query: block summaries against a full scan", "[aggregation][!benchmark]") {
+    constexpr std::size_t kCapacity = 1U << 16U;
+    SampleRing<double> ring{kCapacity};
+    auto const column = makeColumn(kCapacity);
+
+    for (std::size_t i = 0; i < kCapacity; ++i) {
+        ring.push(column.times[i], column.values[i]);
+    }
+    // A dashboard polling the last tenth of the history
+    auto const from = static_cast<int64_t>(kCapacity - kCapacity / 10);
+
+    BENCHMARK("full scan of the ring") {
+        Aggregate result;
+        ring.forEachPiece([&](auto pieceTimes, auto pieceValues) {
+            result.merge(scalar::aggregateSince(pieceTimes, pieceValues, from));
+        });
+        return result;
+    };
+    BENCHMARK("block summaries") { return ring.aggregateSince(from, nullptr); };
+}
@@ -0,0 +1,114 @@
+
+#include "eps_common/Codec.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+
+namespace {
+std::atomic<std::size_t> allocationsCount{0};
+} // namespace
+
+void *operator new(std::size_t size) {
+    allocationsCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (auto *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+using namespace eps;
+
+namespace {
+
+constexpr std::size_t kMessagesCount = 1'000;
+
+proto::Message makeMessage(std::string_view kind) {
+    if (kind == "Version") {
+        return proto::Message{.type = proto::MessageType::Version, .version = "0.1.0"};
+    }
+    if (kind == "Deprecated") {
+        proto::Message m{.type = proto::MessageType::Deprecated, .version = "0.1.5"};
+        m.payload[proto::keys::kError] = "Missing metrics: os_name";
+        return m;
+    }
+    proto::Message m{.type = proto::MessageType::PushSettings,
+                     .version = "0.1.0",
+                     .metrics = std::vector<proto::Metric>{}};
+
+    for (auto &&[name, metric] : proto::kMetricsDefault) {
+        m.metrics->push_back(metric);
+    }
+    return m;
+}
+
+template <typename Encode> double allocationsPerMessage(Encode encode) {
+    auto const before = allocationsCount.load();
+
+    for (std::size_t i = 0; i < kMessagesCount; ++i) {
+        encode();
+    }
+    return static_cast<double>(allocationsCount.load() - before) / kMessagesCount;
+}
+
+} // namespace
+
+TEST_CASE("Reused encoder buffers do not allocate per message", "[allocations]") {
+    auto const kind = GENERATE(as<std::string>{}, "Version", "Deprecated", "PushSettings");
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    auto const message = makeMessage(kind);
+    proto::MessageEncoder encoder;
+    std::string sendQueue;
+
+    // Before: toString builds a payload string and the envelope string, then the send queue copy
+    auto const before = allocationsPerMessage([&] {
+        sendQueue = proto::toString(message);
+        return sendQueue.size();
+    });
+    // Warm up the buffer once, then every message is written into the same memory
+    encoder.encode(message, format);
+    auto const after =
+        allocationsPerMessage([&] { return encoder.encode(message, format).size(); });
+
+    std::cout << std::format("{} ({}): {:.2f} allocations per message before, {:.2f} after\n",
+                             kind, magic_enum::enum_name(format), before, after);
+    CHECK(after == 0.0);
+}
+
+TEST_CASE("Encoder output decodes back to the same message", "[allocations]") {
+    auto const kind = GENERATE(as<std::string>{}, "Version", "Deprecated", "PushSettings");
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    auto const message = makeMessage(kind);
+    proto::MessageEncoder encoder;
+
+    auto const decoded = proto::decode(encoder.encode(message, format), format);
+
+    CHECK(decoded.type == message.type);
+    CHECK(decoded.version == message.version);
+    CHECK(decoded.metrics == message.metrics);
+    CHECK(decoded.payload == message.payload);
+}
+
+TEST_CASE("Encoding cost", "[allocations][!benchmark]") {
+    auto const message = makeMessage("PushSettings");
+    proto::MessageEncoder encoder;
+
+    BENCHMARK("toString") { return proto::toString(message); };
+    BENCHMARK("MessageEncoder json") {
+        return encoder.encode(message, proto::WireFormat::Json).size();
+    };
+    BENCHMARK("MessageEncoder msgpack") {
+        return encoder.encode(message, proto::WireFormat::MsgPack).size();
+    };
+}
@@ -0,0 +1,130 @@
+
+#include "server/CatalogSnapshot.hpp"
+#include "server/MetricCatalog.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <algorithm>
+#include <format>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+proto::Metric makeMetric(std::string const &name) {
+    return {.name = name, .description = "Description " + name, .type = proto::MetricType::Double};
+}
+
+proto::metrics_umap_t makeMetrics(std::vector<std::string> const &names) {
+    proto::metrics_umap_t metrics;
+
+    for (auto const &name : names) {
+        metrics.emplace(name, makeMetric(name));
+    }
+    return metrics;
+}
+
+std::vector<std::string> namesOf(MetricCatalog const &catalog, MetricSet const &set) {
+    std::vector<std::string> names;
+    set.forEach([&](MetricSet::id_t id) { names.push_back(catalog.ids().name(id)); });
+    std::ranges::sort(names);
+    return names;
+}
+
+} // namespace
+
+TEST_CASE("A catalog keeps the ids of the previous one", "[catalog]") {
+    auto const first = MetricCatalog::make(makeMetrics({"a", "b", "c"}));
+    auto const second = MetricCatalog::make(makeMetrics({"b", "c", "d"}), &first);
+
+    REQUIRE(second.sharesIds(first));
+    CHECK(second.ids().find("b") == first.ids().find("b"));
+    CHECK(second.ids().find("c") == first.ids().find("c"));
+    CHECK(second.size() == 3);
+    // The ids of the published catalog are not touched by the next one
+    CHECK_FALSE(first.ids().find("d").has_value());
+
+    CHECK(namesOf(second, second.members() - first.members()) == std::vector<std::string>{"d"});
+    CHECK(namesOf(second, first.members() - second.members()) == std::vector<std::string>{"a"});
+    CHECK(namesOf(second, second.members() & first.members()) ==
+          std::vector<std::string>{"b", "c"});
+
+    REQUIRE(second.find("d") != nullptr);
+    CHECK(*second.find("d") == makeMetric("d"));
+    CHECK(second.find("a") == nullptr);
+
+    CHECK_FALSE(MetricCatalog::make(makeMetrics({"b"})).sharesIds(first));
+}
+
+TEST_CASE("The metrics a client lacks are a set difference", "[catalog]") {
+    auto const catalog = MetricCatalog::make(makeMetrics({"a", "b", "c", "d"}));
+    std::vector<proto::Metric> const client{makeMetric("b"), makeMetric("unknown"),
+                                            makeMetric("d")};
+
+    auto const missing = catalog.members() - catalog.setOf(client);
+
+    CHECK(missing.size() == 2);
+    CHECK(namesOf(catalog, missing) == std::vector<std::string>{"a", "c"});
+    CHECK((catalog.members() - catalog.setOf(std::vector{makeMetric("a"), makeMetric("b"),
+                                                         makeMetric("c"), makeMetric("d")}))
+              .empty());
+}
+
+TEST_CASE("A snapshot has a delta from the catalogs sharing its ids", "[catalog]") {
+    proto::Version const version{semver::version{"1.0.0"}};
+    auto const first = CatalogSnapshot::make(version, makeMetrics({"a", "b"}));
+    std::vector<CatalogSnapshot::ptr_t> history{first};
+
+    auto changed = makeMetrics({"b", "c"});
+    changed["b"].description = "Changed";
+    auto const second = CatalogSnapshot::make(version, changed, {}, history);
+
+    CHECK(second->deltas.contains(first->hash));
+    CHECK(second->hash != first->hash);
+    // The hash does not depend on the ids
+    CHECK(CatalogSnapshot::hashOf(version, MetricCatalog::make(changed)) == second->hash);
+}
+
+TEST_CASE("Catalog diff: hash map against bitset", "[catalog][!benchmark]") {
+    auto const metricsCount = GENERATE(100, 1'000, 10'000, 100'000);
+    proto::metrics_umap_t metrics;
+
+    for (int i = 0; i < metricsCount; ++i) {
+        auto name = std::format("metric_{}", i);
+        metrics.emplace(name, makeMetric(name));
+    }
+    auto const catalog = MetricCatalog::make(metrics);
+
+    // A client that lacks 1% of the catalog, the way it arrives in a PushSettings
+    std::vector<proto::Metric> client;
+
+    for (auto &&[name, metric] : metrics) {
+        if (std::hash<std::string>{}(name) % 100 != 0) {
+            client.push_back(metric);
+        }
+    }
+
+    BENCHMARK(std::format("findMissingMetrics {}", metricsCount)) {
+        proto::metrics_umap_t clientMetrics;
+
+        for (auto const &metric : client) {
+            clientMetrics.emplace(metric.name, metric);
+        }
+        return proto::findMissingMetrics<std::string, proto::Metric>(metrics, clientMetrics);
+    };
+
+    BENCHMARK(std::format("MetricSet difference {}", metricsCount)) {
+        return catalog.members() - catalog.setOf(client);
+    };
+
+    auto const clientSet = catalog.setOf(client);
+
+    BENCHMARK(std::format("MetricSet difference, client set known {}", metricsCount)) {
+        return catalog.members() - clientSet;
+    };
+}
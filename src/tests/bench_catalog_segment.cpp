@@ -0,0 +1,102 @@
+
+#include "server/CatalogSegment.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <format>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+/**
+ * Segment removed at the end of the test, named at random so parallel runs do not meet
+ */
+struct ScopedSegment {
+    explicit ScopedSegment(std::string const &test)
+        : name{std::format("eps-catalog-test-{}-{}", test, std::random_device{}())}
+        , segment{CatalogSegment::create(name)} {}
+
+    ~ScopedSegment() { CatalogSegment::remove(name); }
+
+    std::string name;
+    CatalogSegment segment;
+};
+
+proto::Message makeCatalog(std::string const &version, std::size_t metricsCount) {
+    proto::Message record{.type = proto::MessageType::Updates,
+                          .version = version,
+                          .metrics = std::vector<proto::Metric>{}};
+
+    for (std::size_t i = 0; i < metricsCount; ++i) {
+        auto name = std::format("metric_{}", i);
+        record.metrics->push_back({.name = name,
+                                   .description = "Description " + name,
+                                   .type = proto::MetricType::Double});
+    }
+    return record;
+}
+
+} // namespace
+
+TEST_CASE("A worker reads the catalog the control process publishes", "[catalog_segment]") {
+    ScopedSegment control{"publish"};
+    control.segment.publish(makeCatalog("0.1.5", 3));
+
+    auto const worker = CatalogSegment::open(control.name);
+    uint64_t generation = 0;
+
+    auto const first = worker.readNewer(generation);
+    REQUIRE(first.has_value());
+    CHECK(generation == 1);
+    CHECK(first->type == proto::MessageType::Updates);
+    CHECK(first->version == "0.1.5");
+    CHECK(first->metrics == makeCatalog("0.1.5", 3).metrics);
+
+    // Nothing new until the next catalog
+    CHECK_FALSE(worker.readNewer(generation).has_value());
+
+    control.segment.publish(makeCatalog("0.1.6", 4));
+    CHECK(worker.generation() == 2);
+
+    auto const second = worker.readNewer(generation);
+    REQUIRE(second.has_value());
+    CHECK(generation == 2);
+    CHECK(second->version == "0.1.6");
+    CHECK(second->metrics->size() == 4);
+}
+
+TEST_CASE("A catalog segment is only opened once published", "[catalog_segment]") {
+    CHECK_THROWS(CatalogSegment::open("eps-catalog-test-missing"));
+
+    ScopedSegment control{"unpublished"};
+    CHECK_THROWS(CatalogSegment::open(control.name));
+
+    control.segment.publish(makeCatalog("0.1.5", 1));
+    CHECK_NOTHROW(CatalogSegment::open(control.name));
+}
+
+TEST_CASE("Catalog segment: what a worker pays to follow the catalog",
+          "[catalog_segment][!benchmark]") {
+    ScopedSegment control{"benchmark"};
+    auto const catalog = makeCatalog("0.1.5", 1'000);
+    control.segment.publish(catalog);
+    auto const worker = CatalogSegment::open(control.name);
+
+    // Every half second, most of the time nothing changed
+    BENCHMARK("readNewer, unchanged") {
+        uint64_t generation = worker.generation();
+        return worker.readNewer(generation);
+    };
+
+    BENCHMARK("publish, 1000 metrics") { control.segment.publish(catalog); };
+
+    BENCHMARK("readNewer, 1000 metrics") {
+        uint64_t generation = 0;
+        return worker.readNewer(generation);
+    };
+}
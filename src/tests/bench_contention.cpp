@@ -0,0 +1,91 @@
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Protocol.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <atomic>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+constexpr std::size_t kMessagesPerThread = 2'000;
+
+/**
+ * Mirrors what the server does for a Version request: decode, handle against the shared version
+ * and encode the response
+ */
+struct Fixture {
+    Fixture() {
+        handler.onVersion([&](proto::Message &&message) {
+            auto const current = version.load(std::memory_order_acquire);
+            semver::version const clientVersion{*message.version};
+
+            proto::Message response{.type = proto::MessageType::Accepted};
+
+            if (clientVersion < current->value) {
+                response.type = proto::MessageType::VersionUpdatesAvailable;
+                response.version = current->value.to_string();
+            }
+            return response;
+        });
+        proto::Message request{.type = proto::MessageType::Version, .version = "0.1.0"};
+        frame = proto::encode(request, proto::WireFormat::Json);
+    }
+
+    std::size_t handleOne() const {
+        auto response = handler.process(proto::decode(frame, proto::WireFormat::Json));
+        return proto::encode(response.value(), proto::WireFormat::Json).size();
+    }
+
+    std::atomic<std::shared_ptr<proto::Version const>> version{
+        std::make_shared<proto::Version const>(proto::Version{semver::version{"0.1.5"}})};
+    proto::MessageHandler handler;
+    std::string frame;
+};
+
+template <typename Work> std::size_t runOnThreads(std::size_t threadsCount, Work work) {
+    std::atomic<std::size_t> bytes{0};
+    {
+        std::vector<std::jthread> threads;
+
+        for (std::size_t t = 0; t < threadsCount; ++t) {
+            threads.emplace_back([&] {
+                std::size_t sent = 0;
+
+                for (std::size_t i = 0; i < kMessagesPerThread; ++i) {
+                    sent += work();
+                }
+                bytes.fetch_add(sent, std::memory_order_relaxed);
+            });
+        }
+    }
+    return bytes.load();
+}
+
+} // namespace
+
+TEST_CASE("Message handling throughput per thread count", "[contention][!benchmark]") {
+    std::size_t const threadsCount = GENERATE(1, 2, 4, 8, 16);
+    Fixture fixture;
+    std::mutex globalMtx;
+
+    // Every iteration handles threadsCount * kMessagesPerThread messages
+    BENCHMARK(std::format("before: global mutex, {} threads", threadsCount)) {
+        return runOnThreads(threadsCount, [&] {
+            std::lock_guard<std::mutex> _{globalMtx};
+            return fixture.handleOne();
+        });
+    };
+    BENCHMARK(std::format("after: snapshot reads, {} threads", threadsCount)) {
+        return runOnThreads(threadsCount, [&] { return fixture.handleOne(); });
+    };
+}
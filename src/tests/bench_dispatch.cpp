@@ -0,0 +1,65 @@
+
+#include "eps_common/Protocol.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <unordered_map>
+
+using namespace eps;
+
+namespace {
+
+/**
+ * The previous dispatcher: a hash map looked up twice and a std::function copied per message
+ */
+struct HashMapHandler {
+    std::optional<proto::Message> process(proto::Message &&message) const {
+        if (!handlers.contains(message.type)) {
+            return proto::Message{.type = proto::MessageType::NotSupported};
+        }
+        auto runHandler = handlers.at(message.type);
+        return runHandler(std::move(message));
+    }
+
+    std::unordered_map<proto::MessageType, proto::handle_func_t> handlers;
+};
+
+std::optional<proto::Message> accept(proto::Message &&) {
+    return proto::Message{.type = proto::MessageType::Accepted};
+}
+
+} // namespace
+
+TEST_CASE("Handlers are dispatched by message type", "[dispatch]") {
+    proto::MessageHandler handler;
+    handler.onVersion(accept);
+
+    auto const handled = handler.process(proto::Message{.type = proto::MessageType::Version});
+    REQUIRE(handled.has_value());
+    CHECK(handled->type == proto::MessageType::Accepted);
+
+    auto const notHandled = handler.process(proto::Message{.type = proto::MessageType::Updates});
+    REQUIRE(notHandled.has_value());
+    CHECK(notHandled->type == proto::MessageType::NotSupported);
+}
+
+TEST_CASE("Dispatch cost", "[dispatch][!benchmark]") {
+    proto::MessageHandler arrayHandler;
+    arrayHandler.onVersion(accept).onGetUpdates(accept).onPushSettings(accept);
+
+    HashMapHandler hashMapHandler;
+    hashMapHandler.handlers.emplace(proto::MessageType::Version, accept);
+    hashMapHandler.handlers.emplace(proto::MessageType::GetUpdates, accept);
+    hashMapHandler.handlers.emplace(proto::MessageType::PushSettings, accept);
+
+    BENCHMARK("hash map dispatch") {
+        return hashMapHandler.process(proto::Message{.type = proto::MessageType::GetUpdates});
+    };
+    BENCHMARK("array dispatch") {
+        return arrayHandler.process(proto::Message{.type = proto::MessageType::GetUpdates});
+    };
+    BENCHMARK("array dispatch, unhandled type") {
+        return arrayHandler.process(proto::Message{.type = proto::MessageType::Deprecated});
+    };
+}
@@ -0,0 +1,161 @@
+
+#include "server/Executor.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace eps;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr std::size_t kConnections = 64;
+constexpr std::size_t kMessagesPerConnection = 200;
+
+/**
+ * Busy work standing for a handler
+ */
+void spin(std::chrono::nanoseconds duration) {
+    auto const end = std::chrono::steady_clock::now() + duration;
+
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+} // namespace
+
+TEST_CASE("A serial queue runs its tasks in order, one at a time", "[executor]") {
+    std::vector<std::vector<std::size_t>> seen(kConnections);
+    std::latch done{static_cast<std::ptrdiff_t>(kConnections * kMessagesPerConnection)};
+    std::atomic<bool> overlapped{false};
+    {
+        WorkStealingPool pool{4};
+        std::vector<std::shared_ptr<SerialQueue>> queues;
+        std::vector<std::unique_ptr<std::atomic<int>>> running;
+
+        for (std::size_t c = 0; c < kConnections; ++c) {
+            queues.push_back(std::make_shared<SerialQueue>(pool));
+            running.push_back(std::make_unique<std::atomic<int>>(0));
+        }
+        for (std::size_t m = 0; m < kMessagesPerConnection; ++m) {
+            for (std::size_t c = 0; c < kConnections; ++c) {
+                queues[c]->post([&, c, m] {
+                    if (running[c]->fetch_add(1) != 0) {
+                        overlapped = true;
+                    }
+                    seen[c].push_back(m);
+                    running[c]->fetch_sub(1);
+                    done.count_down();
+                });
+            }
+        }
+        done.wait();
+    }
+    CHECK_FALSE(overlapped);
+
+    for (auto const &messages : seen) {
+        REQUIRE(messages.size() == kMessagesPerConnection);
+
+        for (std::size_t m = 0; m < messages.size(); ++m) {
+            CHECK(messages[m] == m);
+        }
+    }
+}
+
+TEST_CASE("Idle workers take the tasks queued behind a slow one", "[executor]") {
+    WorkStealingPool pool{2};
+    std::atomic<bool> slowDone{false};
+    std::atomic<bool> fastDoneFirst{false};
+    std::latch done{2};
+
+    // The workers' own queues are fed round robin, the second task may land behind the first
+    pool.submit([&] {
+        spin(200ms);
+        slowDone = true;
+        done.count_down();
+    });
+    pool.submit([&] {
+        fastDoneFirst = !slowDone;
+        done.count_down();
+    });
+    done.wait();
+
+    CHECK(fastDoneFirst);
+}
+
+TEST_CASE("A task that throws leaves its queue and the pool running", "[executor]") {
+    WorkStealingPool pool{1};
+    auto const queue = std::make_shared<SerialQueue>(pool);
+    std::atomic<bool> ranAfter{false};
+    std::latch done{2};
+
+    queue->post([] { throw std::runtime_error("handler failure"); });
+    queue->post([&] {
+        ranAfter = true;
+        done.count_down();
+    });
+    pool.submit([] { throw std::bad_alloc{}; });
+    pool.submit([&] { done.count_down(); });
+    done.wait();
+
+    CHECK(ranAfter);
+}
+
+TEST_CASE("Stopping the pool runs every task, even the ones submitted while it stops",
+          "[executor]") {
+    constexpr std::size_t kTasks = 10'000;
+    std::atomic<std::size_t> ran{0};
+    {
+        WorkStealingPool pool{3};
+
+        for (std::size_t i = 0; i < kTasks; ++i) {
+            pool.submit([&] { ++ran; });
+        }
+        // Still running when the pool stops, what it submits then runs all the same
+        pool.submit([&] {
+            std::this_thread::sleep_for(50ms);
+
+            for (std::size_t i = 0; i < kTasks; ++i) {
+                pool.submit([&] { ++ran; });
+            }
+        });
+    }
+    CHECK(ran == 2 * kTasks);
+}
+
+TEST_CASE("Handler pool: latency of cheap messages next to slow ones", "[executor][!benchmark]") {
+    std::size_t const threadsCount = GENERATE(1, 4, 8);
+    WorkStealingPool pool{threadsCount};
+    std::vector<std::shared_ptr<SerialQueue>> queues;
+
+    for (std::size_t c = 0; c < kConnections; ++c) {
+        queues.push_back(std::make_shared<SerialQueue>(pool));
+    }
+    // One connection in eight sends expensive messages, e.g. large diffs or queries
+    BENCHMARK(std::format("{} connections x {} messages, {} threads", kConnections,
+                          kMessagesPerConnection, threadsCount)) {
+        std::latch done{static_cast<std::ptrdiff_t>(kConnections * kMessagesPerConnection)};
+
+        for (std::size_t m = 0; m < kMessagesPerConnection; ++m) {
+            for (std::size_t c = 0; c < kConnections; ++c) {
+                queues[c]->post([&done, slow = c % 8 == 0] {
+                    spin(slow ? 20us : 1us);
+                    done.count_down();
+                });
+            }
+        }
+        done.wait();
+    };
+}
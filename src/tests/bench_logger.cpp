@@ -0,0 +1,125 @@
+
+#include "eps_common/Logger.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <format>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+/**
+ * Captures what the logger writes, and restores stderr and the level at the end of the test
+ */
+struct CapturedLog {
+    std::mutex mtx;
+    std::string text;
+
+    CapturedLog() {
+        log::Logger::instance().level(log::Level::Info);
+        log::Logger::instance().sink([this](std::string_view lines) {
+            std::lock_guard<std::mutex> _{mtx};
+            text += lines;
+        });
+    }
+
+    ~CapturedLog() {
+        log::Logger::instance().flush();
+        log::Logger::instance().sink([](std::string_view lines) {
+            std::fwrite(lines.data(), 1, lines.size(), stderr);
+            std::fflush(stderr);
+        });
+        log::Logger::instance().level(log::Level::Info);
+    }
+
+    std::string flushed() {
+        log::Logger::instance().flush();
+        std::lock_guard<std::mutex> _{mtx};
+        return text;
+    }
+};
+
+std::size_t countOf(std::string const &text, std::string const &what) {
+    std::size_t count = 0;
+
+    for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1)) {
+        ++count;
+    }
+    return count;
+}
+
+} // namespace
+
+TEST_CASE("Lines below the level are not even formatted", "[logger]") {
+    CapturedLog captured;
+    int formatted = 0;
+
+    EPS_LOG_DEBUG("hidden {}", ++formatted);
+    EPS_LOG_INFO("shown {}", ++formatted);
+
+    CHECK(formatted == 1);
+    auto const text = captured.flushed();
+    CHECK_FALSE(text.contains("hidden"));
+    CHECK(text.contains("Info"));
+    CHECK(text.contains("bench_logger.cpp"));
+    CHECK(text.contains("shown 1\n"));
+}
+
+TEST_CASE("Every thread's lines make it to the sink", "[logger]") {
+    CapturedLog captured;
+    {
+        std::vector<std::jthread> threads;
+
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([t] { EPS_LOG_WARNING("from thread {}", t); });
+        }
+    }
+    auto const text = captured.flushed();
+
+    for (int t = 0; t < 4; ++t) {
+        CHECK(text.contains(std::format("from thread {}\n", t)));
+    }
+}
+
+TEST_CASE("A call site is rate limited", "[logger]") {
+    CapturedLog captured;
+
+    for (int i = 0; i < 100; ++i) {
+        EPS_LOG_ERROR("repeated line");
+    }
+    CHECK(countOf(captured.flushed(), "repeated line") <= log::RateLimit::kLinesPerSecond);
+
+    log::RateLimit rateLimit;
+
+    for (uint32_t i = 0; i < log::RateLimit::kLinesPerSecond; ++i) {
+        CHECK(rateLimit.admit() == 0U);
+    }
+    CHECK_FALSE(rateLimit.admit().has_value());
+}
+
+TEST_CASE("Logger: queueing a line against writing it to a stream", "[logger][!benchmark]") {
+    CapturedLog captured;
+    auto &logger = log::Logger::instance();
+    std::ostringstream stream;
+
+    BENCHMARK("std::endl to a stream") {
+        stream << "Received: " << R"({"type": "GetUpdates"})" << std::endl;
+    };
+    // Bypasses the rate limit of the call site to measure the queueing itself. Past the ring
+    // capacity the lines are dropped until the writer drains it, which costs even less
+    BENCHMARK("queued line") {
+        logger.write(log::Level::Info, __FILE__, __LINE__, 0,
+                     std::format("Received: {}", R"({"type": "GetUpdates"})"));
+    };
+    BENCHMARK("line below the level") {
+        EPS_LOG_DEBUG("Received: {}", R"({"type": "GetUpdates"})");
+    };
+}
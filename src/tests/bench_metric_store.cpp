@@ -0,0 +1,183 @@
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Protocol.hpp"
+#include "server/MetricStore.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <atomic>
+#include <format>
+#include <thread>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+constexpr std::size_t kIngestsPerThread = 100;
+constexpr std::size_t kSamplesPerSeries = 1'000;
+
+std::vector<proto::Series> makeSeries(std::size_t samplesCount) {
+    std::vector<proto::Series> series;
+
+    for (auto &&[name, metric] : proto::kMetricsDefault) {
+        series.push_back(proto::Series{.metric = name,
+                                       .doubles = std::vector<double>(samplesCount, 0.5)});
+    }
+    return series;
+}
+
+} // namespace
+
+TEST_CASE("The sample ring keeps the newest samples in order", "[metric_store]") {
+    SampleRing<double> ring{4};
+
+    for (int64_t i = 0; i < 6; ++i) {
+        ring.push(i, static_cast<double>(i) / 10);
+    }
+    std::vector<int64_t> times;
+    ring.forEachPiece([&](auto pieceTimes, auto) {
+        times.insert(times.end(), pieceTimes.begin(), pieceTimes.end());
+    });
+
+    CHECK(ring.size() == 4);
+    CHECK(ring.written() == 6);
+    CHECK(times == std::vector<int64_t>{2, 3, 4, 5});
+}
+
+TEST_CASE("Every series is accepted or rejected on its own", "[metric_store]") {
+    MetricStore store;
+    auto catalog = proto::kMetricsDefault;
+    catalog.insert({"os_name",
+                    {.name = "os_name", .description = "OS", .type = proto::MetricType::String}});
+    store.track(catalog);
+
+    std::vector<proto::Series> series;
+    series.push_back({.metric = std::string{proto::keys::kAvailability},
+                      .times = {1, 2},
+                      .integers = {1, 0}});
+    series.push_back({.metric = "os_name", .doubles = {0.5}});
+    series.push_back({.metric = "unknown", .doubles = {0.5}});
+    series.push_back({.metric = std::string{proto::keys::kPerformance}, .times = {1}});
+
+    auto const report = store.ingest(std::move(series));
+
+    // Integers are read as doubles for a Double metric
+    CHECK(report.accepted == 2);
+    REQUIRE(report.rejected.size() == 3);
+    CHECK(report.rejected[0].first == "os_name");
+    CHECK(report.rejected[1].first == "unknown");
+    CHECK(report.rejected[2].first == proto::keys::kPerformance);
+
+    std::size_t stored = 0;
+    store.find(std::string{proto::keys::kAvailability})->visit<double>([&](auto const &ring) {
+        stored += ring.size();
+    });
+    CHECK(stored == 2);
+}
+
+TEST_CASE("A metric gets its part of the memory budget on its first write", "[metric_store]") {
+    constexpr std::size_t kMetricsCount = 100;
+    // 1'000 samples in every shard of every metric
+    MetricStore store{kMetricsCount * MetricColumns::kShardsCount * 1'000 *
+                      SampleRing<double>::kSampleBytes};
+    proto::metrics_umap_t catalog;
+
+    for (std::size_t i = 0; i < kMetricsCount; ++i) {
+        auto name = std::format("metric_{}", i);
+        catalog.insert({name, {.name = name, .type = proto::MetricType::Double}});
+    }
+    store.track(catalog);
+
+    auto const columns = store.find("metric_0");
+    REQUIRE(columns != nullptr);
+    CHECK(columns->capacityPerShard() == 1'000);
+
+    std::vector<std::size_t> capacities;
+    auto const collect = [&](auto const &ring) { capacities.push_back(ring.capacity()); };
+    columns->visit<double>(collect);
+    CHECK(capacities.empty());
+
+    CHECK(store.ingest({proto::Series{.metric = "metric_0", .doubles = {0.5}}}).accepted == 1);
+    columns->visit<double>(collect);
+    CHECK(capacities == std::vector<std::size_t>{1'000});
+
+    // The bounds hold whatever the budget
+    MetricStore small{1};
+    small.track(catalog);
+    CHECK(small.find("metric_0")->capacityPerShard() == MetricStore::kMinCapacity);
+
+    MetricStore large;
+    large.track(proto::kMetricsDefault);
+    CHECK(large.find(std::string{proto::keys::kAvailability})->capacityPerShard() ==
+          MetricStore::kMaxCapacity);
+}
+
+TEST_CASE("Series round trip in both wire formats", "[metric_store]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    proto::Message const message{
+        .type = proto::MessageType::Ingest,
+        .series = std::vector<proto::Series>{
+            {.metric = "a", .times = {1, 2}, .doubles = {0.5, 1.0}},
+            {.metric = "b", .integers = {-3, 4}},
+            {.metric = "c", .strings = {"x"}}}};
+
+    auto const decoded = proto::decode(proto::encode(message, format), format);
+
+    REQUIRE(decoded.series.has_value());
+    REQUIRE(decoded.series->size() == 3);
+    CHECK(decoded.series->at(0).times == message.series->at(0).times);
+    CHECK(decoded.series->at(0).doubles == message.series->at(0).doubles);
+    CHECK(decoded.series->at(1).integers == message.series->at(1).integers);
+    CHECK(decoded.series->at(2).strings == message.series->at(2).strings);
+
+    // Mixed numbers keep their order
+    auto const mixed = proto::decode(
+        R"({"type": "Ingest", "payload": {"series": [{"metric": "a", "values": [1, 0.5, 2]}]}})",
+        proto::WireFormat::Json);
+    CHECK(mixed.series->at(0).doubles == std::vector<double>{1, 0.5, 2});
+
+    CHECK_THROWS_AS(
+        proto::decode(R"({"type": "Ingest", "payload": {"series": [{"values": [1]}]}})",
+                      proto::WireFormat::Json),
+        nlohmann::json::exception);
+}
+
+TEST_CASE("Ingestion throughput per thread count", "[metric_store][!benchmark]") {
+    std::size_t const threadsCount = GENERATE(1, 2, 4, 8, 16);
+    MetricStore store;
+    store.track(proto::kMetricsDefault);
+    auto const series = makeSeries(kSamplesPerSeries);
+
+    // Every iteration ingests threadsCount * kIngestsPerThread * 2 * kSamplesPerSeries samples
+    BENCHMARK(std::format("ingest, {} threads", threadsCount)) {
+        std::atomic<std::size_t> accepted{0};
+        {
+            std::vector<std::jthread> threads;
+
+            for (std::size_t t = 0; t < threadsCount; ++t) {
+                threads.emplace_back([&] {
+                    for (std::size_t i = 0; i < kIngestsPerThread; ++i) {
+                        auto copy = series;
+                        accepted.fetch_add(store.ingest(std::move(copy)).accepted,
+                                           std::memory_order_relaxed);
+                    }
+                });
+            }
+        }
+        return accepted.load();
+    };
+
+    auto const message = proto::Message{.type = proto::MessageType::Ingest, .series = series};
+    auto const json = proto::encode(message, proto::WireFormat::Json);
+    auto const msgPack = proto::encode(message, proto::WireFormat::MsgPack);
+
+    BENCHMARK(std::format("decode Ingest json, {} samples", 2 * kSamplesPerSeries)) {
+        return proto::decode(json, proto::WireFormat::Json);
+    };
+    BENCHMARK(std::format("decode Ingest msgpack, {} samples", 2 * kSamplesPerSeries)) {
+        return proto::decode(msgPack, proto::WireFormat::MsgPack);
+    };
+}
@@ -0,0 +1,210 @@
+
+#include "eps_common/Protocol.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <format>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+proto::metrics_umap_t makeCatalog(std::size_t metricsCount) {
+    proto::metrics_umap_t catalog;
+    catalog.reserve(metricsCount);
+
+    for (std::size_t i = 0; i < metricsCount; ++i) {
+        auto name = std::format("metric_{}", i);
+        catalog.emplace(name, proto::Metric{.name = name,
+                                            .description = std::format("Description {}", i),
+                                            .type = proto::MetricType::Double});
+    }
+    return catalog;
+}
+
+proto::Message makePushSettings(proto::metrics_umap_t const &catalog) {
+    proto::Message m{.type = proto::MessageType::PushSettings,
+                     .version = "0.1.5",
+                     .metrics = std::vector<proto::Metric>{}};
+    m.metrics->reserve(catalog.size());
+
+    for (auto &&[k, metric] : catalog) {
+        m.metrics->push_back(metric);
+    }
+    return m;
+}
+
+} // namespace
+
+TEST_CASE("findMissingMetrics returns the metrics the client lacks", "[protocol]") {
+    auto const server = makeCatalog(10);
+    auto client = server;
+    client.erase("metric_3");
+    client.erase("metric_7");
+
+    auto const missing = proto::findMissingMetrics<std::string, proto::Metric>(server, client);
+
+    REQUIRE(missing.size() == 2);
+    CHECK(client.find(missing[0].first) == client.end());
+    CHECK(client.find(missing[1].first) == client.end());
+}
+
+TEST_CASE("toMessage reads back the json of a message", "[protocol]") {
+    auto const message = makePushSettings(makeCatalog(10));
+
+    auto const decoded = proto::toMessage(nlohmann::json::parse(proto::toString(message)));
+
+    CHECK(decoded.type == message.type);
+    CHECK(decoded.version == message.version);
+    CHECK(decoded.metrics == message.metrics);
+}
+
+TEST_CASE("toMessage only takes an unsigned integer id", "[protocol]") {
+    CHECK(proto::toMessage(nlohmann::json::parse(R"({"type": "Version", "id": 4})")).id == 4U);
+    CHECK_THROWS_AS(proto::toMessage(nlohmann::json::parse(R"({"type": "Version", "id": -1})")),
+                    nlohmann::json::type_error);
+    CHECK_THROWS_AS(proto::toMessage(nlohmann::json::parse(R"({"type": "Version", "id": 1.5})")),
+                    nlohmann::json::type_error);
+    CHECK_THROWS_AS(proto::toMessage(nlohmann::json::parse(R"({"type": "Version", "id": "1"})")),
+                    nlohmann::json::type_error);
+}
+
+TEST_CASE("MessageHandler echoes the request id in the response", "[protocol]") {
+    proto::MessageHandler handler;
+    handler.onVersion([](proto::Message &&) {
+        return proto::Message{.type = proto::MessageType::Accepted};
+    });
+
+    auto const response =
+        handler.process(proto::Message{.type = proto::MessageType::Version, .id = 7});
+    REQUIRE(response.has_value());
+    CHECK(response->id == 7U);
+
+    auto const notSupported =
+        handler.process(proto::Message{.type = proto::MessageType::GetUpdates, .id = 8});
+    REQUIRE(notSupported.has_value());
+    CHECK(notSupported->type == proto::MessageType::NotSupported);
+    CHECK(notSupported->id == 8U);
+}
+
+TEST_CASE("BasicMessageHandler hands its context to the handlers", "[protocol]") {
+    // What a connection keeps between its messages
+    struct Context {
+        std::optional<std::string> version;
+        int messages{0};
+    };
+    proto::BasicMessageHandler<Context> handler;
+    handler
+        .onHello([](Context &context, proto::Message &&message) {
+            ++context.messages;
+            context.version = message.version;
+            return proto::Message{.type = proto::MessageType::Accepted};
+        })
+        .onVersion([](Context &context, proto::Message &&message) {
+            ++context.messages;
+            return proto::Message{.type = proto::MessageType::Accepted,
+                                  .version = message.version.value_or(context.version.value())};
+        });
+
+    Context first;
+    Context second;
+    std::ignore = handler.process(
+        first, proto::Message{.type = proto::MessageType::Hello, .version = "1.0.0"});
+    auto const response =
+        handler.process(first, proto::Message{.type = proto::MessageType::Version, .id = 3});
+
+    REQUIRE(response.has_value());
+    CHECK(response->id == 3U);
+    CHECK(response->version == "1.0.0");
+    CHECK(first.messages == 2);
+    CHECK(second.messages == 0);
+
+    auto const notSupported =
+        handler.process(second, proto::Message{.type = proto::MessageType::Query});
+    REQUIRE(notSupported.has_value());
+    CHECK(notSupported->type == proto::MessageType::NotSupported);
+    CHECK(second.messages == 0);
+}
+
+TEST_CASE("unbatch reports the malformed entries one by one", "[protocol]") {
+    auto batch = proto::toMessage(nlohmann::json::parse(R"({
+        "type": "Batch",
+        "payload": {"messages": [
+            {"type": "Version", "id": 1, "payload": {"version": "0.1.0"}},
+            42,
+            {"type": "Version", "payload": {"version": 1}},
+            {"type": "GetUpdates", "payload": {}}
+        ]}
+    })"));
+
+    auto const items = proto::unbatch(std::move(batch));
+
+    REQUIRE(items.size() == 4);
+    REQUIRE(items[0].message.has_value());
+    CHECK(items[0].message->id == 1U);
+    CHECK_FALSE(items[1].message.has_value());
+    CHECK_FALSE(items[1].error.empty());
+    CHECK_FALSE(items[2].message.has_value());
+    REQUIRE(items[3].message.has_value());
+    CHECK(items[3].message->type == proto::MessageType::GetUpdates);
+}
+
+TEST_CASE("Protocol hot paths per catalog size", "[protocol][!benchmark]") {
+    auto const metricsCount = GENERATE(10, 100, 1'000, 10'000, 100'000);
+    auto const catalog = makeCatalog(metricsCount);
+    auto const message = makePushSettings(catalog);
+    auto const text = proto::toString(message);
+    auto const json = nlohmann::json::parse(text);
+    auto const metricsJson = nlohmann::json(*message.metrics);
+
+    // Half of the catalog is missing on the client side, so the diff has work to do
+    proto::metrics_umap_t clientCatalog;
+
+    for (auto &&[k, metric] : catalog) {
+        if (clientCatalog.size() < catalog.size() / 2) {
+            clientCatalog.emplace(k, metric);
+        }
+    }
+    proto::MessageHandler handler;
+    handler.onPushSettings([](proto::Message &&m) {
+        return proto::Message{.type = proto::MessageType::Accepted,
+                              .version = std::move(m.version)};
+    });
+
+    BENCHMARK(std::format("toMessage {}", metricsCount)) { return proto::toMessage(json); };
+
+    BENCHMARK(std::format("toString {}", metricsCount)) { return proto::toString(message); };
+
+    BENCHMARK_ADVANCED(std::format("MessageHandler::process {}", metricsCount))
+    (Catch::Benchmark::Chronometer meter) {
+        // process() takes the message, every run gets its own copy made outside of the timing
+        std::vector<proto::Message> messages(meter.runs(), message);
+        meter.measure([&](int i) { return handler.process(std::move(messages[i])); });
+    };
+
+    BENCHMARK(std::format("Metric to json {}", metricsCount)) {
+        return nlohmann::json(*message.metrics);
+    };
+
+    BENCHMARK(std::format("Metric from json {}", metricsCount)) {
+        return metricsJson.get<std::vector<proto::Metric>>();
+    };
+
+    BENCHMARK(std::format("findMissingMetrics {}", metricsCount)) {
+        return proto::findMissingMetrics<std::string, proto::Metric>(catalog, clientCatalog);
+    };
+}
+
+TEST_CASE("semver parsing", "[protocol][!benchmark]") {
+    BENCHMARK("semver::version from string") { return semver::version{"10.21.305-rc.2"}; };
+
+    semver::version const version{"10.21.305-rc.2"};
+
+    BENCHMARK("semver::version to string") { return version.to_string(); };
+}
@@ -0,0 +1,150 @@
+
+#include "eps_common/SendQueue.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+using namespace eps;
+
+namespace {
+
+SendQueue::Frame makeFrame(std::size_t size,
+                           std::optional<proto::MessageType> kind = std::nullopt) {
+    return {.bytes = std::string(size, 'x'), .binary = true, .kind = kind};
+}
+
+} // namespace
+
+TEST_CASE("A send queue is writable again at its low watermark only", "[send_queue]") {
+    SendQueue queue{{.highWatermark = 1'000, .lowWatermark = 200, .maxQueued = 10'000}};
+
+    queue.sent(600);
+    CHECK(queue.writable());
+    queue.sent(400);
+    CHECK_FALSE(queue.writable());
+    CHECK(queue.inFlightBytes() == 1'000);
+
+    // Below the high watermark but above the low one, still blocked
+    queue.written(500);
+    CHECK_FALSE(queue.writable());
+    queue.written(300);
+    CHECK(queue.writable());
+
+    // More written than in flight leaves nothing in flight
+    queue.written(1'000);
+    CHECK(queue.inFlightBytes() == 0);
+}
+
+TEST_CASE("A send queue keeps the latest frame of a kind", "[send_queue]") {
+    SendQueue queue;
+
+    CHECK(queue.push(makeFrame(10, proto::MessageType::VersionUpdatesAvailable)) ==
+          SendQueue::Push::Queued);
+    CHECK(queue.push(makeFrame(20)) == SendQueue::Push::Queued);
+    CHECK(queue.push(makeFrame(30, proto::MessageType::VersionUpdatesAvailable)) ==
+          SendQueue::Push::Coalesced);
+
+    CHECK(queue.size() == 2);
+    CHECK(queue.queuedBytes() == 50);
+    CHECK(queue.coalesced() == 1);
+
+    // The latest notification comes after the frames queued before it
+    CHECK(queue.pop().bytes.size() == 20);
+    CHECK(queue.pop().bytes.size() == 30);
+    CHECK(queue.empty());
+    CHECK(queue.inFlightBytes() == 50);
+}
+
+TEST_CASE("A full send queue refuses the frame and stays as it was", "[send_queue]") {
+    SendQueue queue{{.maxQueued = 100}};
+
+    CHECK(queue.push(makeFrame(60)) == SendQueue::Push::Queued);
+    CHECK(queue.push(makeFrame(50)) == SendQueue::Push::Overflow);
+    CHECK(queue.push(makeFrame(40)) == SendQueue::Push::Queued);
+
+    CHECK(queue.size() == 2);
+    CHECK(queue.queuedBytes() == 100);
+    CHECK(queue.overflows() == 1);
+
+    queue.sent(10);
+    queue.clear();
+    CHECK(queue.empty());
+    CHECK(queue.queuedBytes() == 0);
+    CHECK(queue.inFlightBytes() == 0);
+    CHECK(queue.writable());
+}
+
+TEST_CASE("A peer that never acknowledges overflows the send queue", "[send_queue]") {
+    SendQueue queue{{.highWatermark = 1'000, .lowWatermark = 200, .maxQueued = 500}};
+    std::string const bytes(100, 'x');
+
+    // Sent right away up to the high watermark, nothing ever comes back as written
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(queue.offer(bytes, true) == SendQueue::Push::Sent);
+    }
+    CHECK_FALSE(queue.writable());
+    CHECK(queue.offer(bytes, true) == SendQueue::Push::Queued);
+
+    // The notifications still supersede each other while the peer is behind
+    CHECK(queue.offer(bytes, true, proto::MessageType::VersionUpdatesAvailable) ==
+          SendQueue::Push::Queued);
+    CHECK(queue.offer(bytes, true, proto::MessageType::VersionUpdatesAvailable) ==
+          SendQueue::Push::Coalesced);
+
+    auto result = SendQueue::Push::Queued;
+
+    for (int i = 0; i < 10 && result == SendQueue::Push::Queued; ++i) {
+        result = queue.offer(bytes, true);
+    }
+    // Whatever the policy, the session drops the frame or closes the connection here
+    CHECK(result == SendQueue::Push::Overflow);
+    CHECK(queue.queuedBytes() == 500);
+    CHECK(queue.inFlightBytes() == 1'000);
+}
+
+TEST_CASE("A peer without acknowledgements gets its budget back at the legacy rate",
+          "[send_queue]") {
+    using namespace std::chrono_literals;
+
+    SendBudget budget{1'000, 10'000};
+    auto const start = SendBudget::clock_t::now();
+
+    CHECK(budget.spend(600, start));
+    CHECK(budget.spend(400, start));
+    // Nothing assumed read yet, the budget is spent
+    CHECK_FALSE(budget.spend(1, start));
+    CHECK(budget.inFlightBytes() == 1'000);
+
+    // 10'000 bytes per second, 50ms later 500 bytes are assumed read
+    CHECK(budget.spend(500, start + 50ms));
+    CHECK_FALSE(budget.spend(1, start + 50ms));
+
+    // A peer idle for long has its whole budget again, never more
+    CHECK(budget.spend(1'000, start + 1h));
+    CHECK(budget.overflows() == 2);
+}
+
+TEST_CASE("Send queue: a blocked connection under broadcasts", "[send_queue][!benchmark]") {
+    // What a broadcast costs a connection that stopped reading: queued, then superseded
+    BENCHMARK_ADVANCED("push, coalesced")(Catch::Benchmark::Chronometer meter) {
+        SendQueue queue;
+        queue.push(makeFrame(64, proto::MessageType::VersionUpdatesAvailable));
+        meter.measure([&] {
+            return queue.push(makeFrame(64, proto::MessageType::VersionUpdatesAvailable));
+        });
+    };
+
+    BENCHMARK_ADVANCED("push and pop")(Catch::Benchmark::Chronometer meter) {
+        SendQueue queue;
+        meter.measure([&] {
+            queue.push(makeFrame(64));
+            auto frame = queue.pop();
+            queue.written(frame.bytes.size());
+            return frame.bytes.size();
+        });
+    };
+}
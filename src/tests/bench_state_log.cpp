@@ -0,0 +1,202 @@
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Protocol.hpp"
+#include "server/StateLog.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+#include <vector>
+
+using namespace eps;
+
+namespace {
+
+/**
+ * Directory removed with its content at the end of the test
+ */
+struct TempDirectory {
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 std::format("eps-state-{}", std::random_device{}());
+
+    ~TempDirectory() { std::filesystem::remove_all(path); }
+};
+
+proto::Message catalogRecord() {
+    return proto::Message{
+        .type = proto::MessageType::Updates,
+        .version = "0.1.6",
+        .metrics = std::vector<proto::Metric>{
+            {.name = "a", .description = "A", .type = proto::MetricType::Double}}};
+}
+
+proto::Message samplesRecord(int64_t from, std::size_t count) {
+    proto::Series series{.metric = "a"};
+
+    for (std::size_t i = 0; i < count; ++i) {
+        series.times.push_back(from + static_cast<int64_t>(i));
+        series.doubles.push_back(static_cast<double>(from) + static_cast<double>(i));
+    }
+    return proto::Message{.type = proto::MessageType::Ingest,
+                          .series = std::vector<proto::Series>{std::move(series)}};
+}
+
+std::vector<proto::Message> replayAll(std::filesystem::path const &directory,
+                                      std::size_t retention = 1'000) {
+    std::vector<proto::Message> messages;
+    StateLog log{directory, retention};
+    log.replay([&](proto::Message &&message) { messages.push_back(std::move(message)); });
+    return messages;
+}
+
+std::vector<int64_t> timesOf(std::vector<proto::Message> const &messages) {
+    std::vector<int64_t> times;
+
+    for (auto const &message : messages) {
+        if (message.series) {
+            for (auto const &series : *message.series) {
+                times.insert(times.end(), series.times.begin(), series.times.end());
+            }
+        }
+    }
+    return times;
+}
+
+} // namespace
+
+TEST_CASE("The log replays what was appended, in order", "[state_log]") {
+    TempDirectory directory;
+    {
+        StateLog log{directory.path, 1'000};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(catalogRecord());
+        log.append(samplesRecord(0, 3));
+        log.append(samplesRecord(3, 2));
+    }
+    auto const messages = replayAll(directory.path);
+
+    REQUIRE(messages.size() == 3);
+    CHECK(messages[0].type == proto::MessageType::Updates);
+    CHECK(messages[0].version == "0.1.6");
+    CHECK(timesOf(messages) == std::vector<int64_t>{0, 1, 2, 3, 4});
+
+    // Appending after a restart continues the log
+    {
+        StateLog log{directory.path, 1'000};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(samplesRecord(5, 1));
+    }
+    CHECK(timesOf(replayAll(directory.path)) == std::vector<int64_t>{0, 1, 2, 3, 4, 5});
+}
+
+TEST_CASE("Compaction keeps the catalog and the newest samples", "[state_log]") {
+    TempDirectory directory;
+    {
+        // Compacts after every write
+        StateLog log{directory.path, 4, 1};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(catalogRecord());
+
+        for (int64_t i = 0; i < 10; ++i) {
+            log.append(samplesRecord(i, 1));
+        }
+    }
+    CHECK(std::filesystem::exists(directory.path / StateLog::kSnapshotFile));
+
+    auto const messages = replayAll(directory.path, 4);
+
+    REQUIRE_FALSE(messages.empty());
+    CHECK(messages[0].type == proto::MessageType::Updates);
+    CHECK(timesOf(messages) == std::vector<int64_t>{6, 7, 8, 9});
+}
+
+TEST_CASE("Samples are shed while the writer is behind, catalogs never are", "[state_log]") {
+    TempDirectory directory;
+    auto const recordSize = proto::encode(samplesRecord(0, 10), proto::WireFormat::MsgPack).size();
+    {
+        // Room for two sample records, the writer thread is not started yet
+        StateLog log{directory.path, 1'000, StateLog::kDefaultCompactionThreshold,
+                     2 * recordSize};
+        log.replay([](proto::Message &&) {});
+
+        CHECK(log.append(samplesRecord(0, 10)));
+        CHECK(log.append(samplesRecord(10, 10)));
+        CHECK_FALSE(log.append(samplesRecord(20, 10)));
+        CHECK(log.append(catalogRecord()));
+        CHECK(log.shed() == 1);
+
+        log.start();
+    }
+    auto const messages = replayAll(directory.path);
+
+    REQUIRE(messages.size() == 3);
+    CHECK(messages[2].type == proto::MessageType::Updates);
+    CHECK(timesOf(messages).size() == 20);
+}
+
+TEST_CASE("Replaying stops at a torn record", "[state_log]") {
+    TempDirectory directory;
+    {
+        StateLog log{directory.path, 1'000};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(samplesRecord(0, 1));
+        log.append(samplesRecord(1, 1));
+    }
+    // Damages the last byte of the second record
+    auto const first = proto::encode(samplesRecord(0, 1), proto::WireFormat::MsgPack).size();
+    auto const second = proto::encode(samplesRecord(1, 1), proto::WireFormat::MsgPack).size();
+    {
+        std::fstream file{directory.path / StateLog::kLogFile,
+                          std::ios::in | std::ios::out | std::ios::binary};
+        file.seekp(static_cast<std::streamoff>(2 * sizeof(StateLog::Header) + first + second - 1));
+        file.put('\xff');
+    }
+    CHECK(timesOf(replayAll(directory.path)) == std::vector<int64_t>{0});
+}
+
+TEST_CASE("State log: appending and replaying", "[state_log][!benchmark]") {
+    constexpr std::size_t kSamplesPerRecord = 1'000;
+    std::size_t const recordsCount = GENERATE(100, 1'000);
+    auto const record = samplesRecord(0, kSamplesPerRecord);
+    auto const retention = recordsCount * kSamplesPerRecord;
+
+    {
+        TempDirectory directory;
+        StateLog log{directory.path, retention};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(catalogRecord());
+
+        // What an IO thread pays per Ingest, the disk is the writer thread's
+        BENCHMARK(std::format("append {} samples", kSamplesPerRecord)) { log.append(record); };
+    }
+    TempDirectory directory;
+    {
+        StateLog log{directory.path, retention};
+        log.replay([](proto::Message &&) {});
+        log.start();
+        log.append(catalogRecord());
+
+        for (std::size_t i = 0; i < recordsCount; ++i) {
+            log.append(record);
+        }
+    }
+    // A restart of a server with that much history in its log
+    BENCHMARK(std::format("replay {} records of {} samples", recordsCount, kSamplesPerRecord)) {
+        std::size_t samples = 0;
+        StateLog log{directory.path, retention};
+        log.replay([&](proto::Message &&message) {
+            samples += message.series ? message.series->front().size() : 0;
+        });
+        return samples;
+    };
+}
@@ -0,0 +1,103 @@
+
+#include "eps_common/Protocol.hpp"
+#include "server/Telemetry.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <chrono>
+#include <format>
+#include <thread>
+#include <vector>
+
+using namespace eps;
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr std::size_t kSamplesPerThread = 10'000;
+
+Telemetry::Sample versionSample() {
+    return Telemetry::Sample{.type = proto::MessageType::Version,
+                             .parse = 200ns,
+                             .handler = 300ns,
+                             .serialize = 1us,
+                             .received = 10,
+                             .sent = 20};
+}
+
+void recordFromThreads(Telemetry &telemetry, std::size_t threadsCount) {
+    std::vector<std::jthread> threads;
+
+    for (std::size_t t = 0; t < threadsCount; ++t) {
+        threads.emplace_back([&] {
+            for (std::size_t i = 0; i < kSamplesPerThread; ++i) {
+                telemetry.record(versionSample());
+            }
+        });
+    }
+}
+
+} // namespace
+
+TEST_CASE("Durations fall in the bucket they are at most", "[telemetry]") {
+    DurationHistogram histogram;
+    histogram.record(256ns);
+    histogram.record(257ns);
+    histogram.record(512ns);
+    histogram.record(10s);
+
+    std::vector<uint64_t> cumulative;
+    histogram.forEachBucket([&](auto, uint64_t count) { cumulative.push_back(count); });
+
+    CHECK(cumulative.size() == DurationHistogram::kBucketsCount + 1);
+    CHECK(cumulative[0] == 1);
+    CHECK(cumulative[1] == 3);
+    CHECK(cumulative[DurationHistogram::kBucketsCount - 1] == 3);
+    CHECK(cumulative.back() == 4);
+    CHECK(histogram.count() == 4);
+}
+
+TEST_CASE("The shards of exited threads stay in the totals", "[telemetry]") {
+    Telemetry telemetry;
+    recordFromThreads(telemetry, 4);
+    telemetry.record({.fanOut = 3ms, .sent = 100});
+
+    auto const stats = telemetry.collect();
+    auto const version = magic_enum::enum_index(proto::MessageType::Version).value();
+
+    CHECK(stats.handlers[version].count() == 4 * kSamplesPerThread);
+    CHECK(stats.parse.count() == 4 * kSamplesPerThread);
+    CHECK(stats.fanOut.count() == 1);
+    CHECK(stats.bytesIn == 4 * kSamplesPerThread * 10);
+    CHECK(stats.bytesOut == 4 * kSamplesPerThread * 20 + 100);
+}
+
+TEST_CASE("The exposition follows the Prometheus text format", "[telemetry]") {
+    Telemetry telemetry;
+    telemetry.record(versionSample());
+
+    auto const text = telemetry.render(2);
+
+    CHECK(text.contains("# TYPE eps_handler_duration_seconds histogram\n"));
+    CHECK(text.contains("eps_handler_duration_seconds_bucket{type=\"Version\",le=\"+Inf\"} 1\n"));
+    CHECK(text.contains("eps_handler_duration_seconds_count{type=\"Version\"} 1\n"));
+    CHECK_FALSE(text.contains("type=\"GetUpdates\""));
+    CHECK(text.contains("eps_parse_duration_seconds_count 1\n"));
+    CHECK(text.contains("eps_received_bytes_total 10\n"));
+    CHECK(text.contains("eps_open_connections 2\n"));
+}
+
+TEST_CASE("Telemetry: recording from many threads", "[telemetry][!benchmark]") {
+    std::size_t const threadsCount = GENERATE(1, 4, 16);
+    Telemetry telemetry;
+
+    // Every iteration records threadsCount * kSamplesPerThread samples
+    BENCHMARK(std::format("record, {} threads", threadsCount)) {
+        recordFromThreads(telemetry, threadsCount);
+    };
+    BENCHMARK(std::format("scrape after {} threads", threadsCount)) {
+        return telemetry.render(0);
+    };
+}
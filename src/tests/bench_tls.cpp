@@ -0,0 +1,171 @@
+
+#include "client/TlsSessionCache.hpp"
+#include "client/WsSession.hpp"
+#include "server/TlsSessions.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <boost/asio/ssl/context.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <string>
+
+using namespace eps;
+using namespace std::chrono_literals;
+
+namespace {
+
+using ctx_ptr_t = std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)>;
+
+constexpr auto kServer = "localhost:8008";
+
+/**
+ * A server context with a self-signed certificate made up for the test
+ */
+ctx_ptr_t makeServerContext(TlsSessions &sessions) {
+    ctx_ptr_t ctx{SSL_CTX_new(TLS_server_method()), &SSL_CTX_free};
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{EVP_EC_gen("P-256"), &EVP_PKEY_free};
+    std::unique_ptr<X509, decltype(&X509_free)> cert{X509_new(), &X509_free};
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert.get()), 3'600);
+    X509_set_pubkey(cert.get(), key.get());
+    auto *name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<unsigned char const *>("localhost"), -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+    X509_sign(cert.get(), key.get(), EVP_sha256());
+
+    SSL_CTX_use_certificate(ctx.get(), cert.get());
+    SSL_CTX_use_PrivateKey(ctx.get(), key.get());
+    sessions.configure(ctx.get());
+    return ctx;
+}
+
+/**
+ * Runs a handshake in memory, then lets the client read the ticket the server sends after it
+ *
+ * @return whether the session was resumed
+ */
+bool handshake(SSL_CTX *server, boost::asio::ssl::context &client) {
+    auto *serverSsl = SSL_new(server);
+    auto *clientSsl = SSL_new(client.native_handle());
+    BIO *serverBio = nullptr;
+    BIO *clientBio = nullptr;
+
+    BIO_new_bio_pair(&serverBio, 0, &clientBio, 0);
+    SSL_set_bio(serverSsl, serverBio, serverBio);
+    SSL_set_bio(clientSsl, clientBio, clientBio);
+    SSL_set_accept_state(serverSsl);
+    SSL_set_connect_state(clientSsl);
+    TlsSessionCache::resume(clientSsl, kServer);
+
+    bool serverDone = false;
+    bool clientDone = false;
+
+    for (int i = 0; i < 16 && !(serverDone && clientDone); ++i) {
+        clientDone = clientDone || SSL_do_handshake(clientSsl) == 1;
+        serverDone = serverDone || SSL_do_handshake(serverSsl) == 1;
+    }
+    char byte = 0;
+    SSL_read(clientSsl, &byte, 1);
+
+    auto const resumed = clientDone && serverDone && SSL_session_reused(clientSsl) == 1;
+    SSL_free(clientSsl);
+    SSL_free(serverSsl);
+    return resumed;
+}
+
+/**
+ * Ticket keys file in a directory of its own, removed at the end of the test
+ */
+struct TicketKeys {
+    std::filesystem::path directory =
+        std::filesystem::temp_directory_path() /
+        std::format("eps-tls-{}", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::filesystem::path file = directory / "tls-ticket.keys";
+
+    ~TicketKeys() { std::filesystem::remove_all(directory); }
+};
+
+} // namespace
+
+TEST_CASE("A client resumes its TLS session, even after the server restarts", "[tls]") {
+    TicketKeys keys;
+    boost::asio::ssl::context client{boost::asio::ssl::context::tls_client};
+    TlsSessionCache cache{client};
+
+    TlsSessions sessions{keys.file};
+    auto server = makeServerContext(sessions);
+
+    CHECK_FALSE(handshake(server.get(), client));
+    CHECK(handshake(server.get(), client));
+    CHECK(sessions.counters().completed == 2);
+    CHECK(sessions.counters().resumed == 1);
+
+    // Same ticket keys, the sessions of the previous process are still good
+    TlsSessions restarted{keys.file};
+    auto serverRestarted = makeServerContext(restarted);
+
+    CHECK(handshake(serverRestarted.get(), client));
+    CHECK(restarted.counters().resumed == 1);
+
+    // Keys that died with the process
+    TlsSessions inMemory;
+    auto serverInMemory = makeServerContext(inMemory);
+
+    CHECK_FALSE(handshake(serverInMemory.get(), client));
+}
+
+TEST_CASE("The reconnection delays grow up to the maximum, drawn below their bound", "[tls]") {
+    ReconnectSettings const settings{.enabled = true, .initialDelay = 100ms, .maxDelay = 1'000ms};
+    Backoff backoff{settings, 42};
+
+    for (auto const bound : {100ms, 200ms, 400ms, 800ms, 1'000ms, 1'000ms}) {
+        CHECK(backoff.next() <= bound);
+    }
+    CHECK(backoff.attempts() == 6);
+
+    // Many attempts in, the bound stays the maximum instead of overflowing
+    for (int i = 0; i < 100; ++i) {
+        auto const delay = backoff.next();
+        CHECK(delay >= 0ms);
+        CHECK(delay <= settings.maxDelay);
+    }
+    backoff.reset();
+    CHECK(backoff.next() <= settings.initialDelay);
+
+    // Clients dropped at once spread their first attempt over the whole bound
+    std::chrono::milliseconds lowest = settings.initialDelay;
+    std::chrono::milliseconds highest = 0ms;
+
+    for (unsigned seed = 0; seed < 100; ++seed) {
+        auto const delay = Backoff{settings, seed}.next();
+        lowest = std::min(lowest, delay);
+        highest = std::max(highest, delay);
+    }
+    CHECK(highest - lowest > settings.initialDelay / 2);
+}
+
+TEST_CASE("TLS: full handshake against a resumed one", "[tls][!benchmark]") {
+    boost::asio::ssl::context client{boost::asio::ssl::context::tls_client};
+    TlsSessions sessions;
+    auto server = makeServerContext(sessions);
+
+    // Without a cache on its context, the client has no session to offer
+    BENCHMARK("full handshake") { return handshake(server.get(), client); };
+
+    TlsSessionCache cache{client};
+    handshake(server.get(), client);
+
+    BENCHMARK("resumed handshake") { return handshake(server.get(), client); };
+}
@@ -0,0 +1,218 @@
+
+#include "eps_common/Codec.hpp"
+#include "eps_common/Compression.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+
+#include <format>
+#include <iostream>
+
+using namespace eps;
+
+namespace {
+
+proto::Message makeUpdates(std::size_t metricsCount) {
+    proto::Message m{.type = proto::MessageType::Updates,
+                     .version = "0.1.5",
+                     .metrics = std::vector<proto::Metric>{}};
+
+    for (std::size_t i = 0; i < metricsCount; ++i) {
+        m.metrics->push_back(proto::Metric{.name = std::format("metric_{}", i),
+                                           .description = std::format("Description {}", i),
+                                           .type = proto::MetricType::Double});
+    }
+    return m;
+}
+
+} // namespace
+
+TEST_CASE("Both wire formats round trip a message", "[wire_format]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    auto const message = makeUpdates(10);
+
+    auto const decoded = proto::decode(proto::encode(message, format), format);
+
+    CHECK(decoded.type == message.type);
+    CHECK(decoded.version == message.version);
+    CHECK(decoded.metrics == message.metrics);
+}
+
+TEST_CASE("The streaming decoder keeps untyped payload entries", "[wire_format]") {
+    auto const decoded = proto::decode(
+        R"({"type": "Deprecated", "payload": {"error": "old", "extra": [1, {"a": null}]}})",
+        proto::WireFormat::Json);
+
+    CHECK(decoded.type == proto::MessageType::Deprecated);
+    CHECK(decoded.payload ==
+          nlohmann::json::parse(R"({"error": "old", "extra": [1, {"a": null}]})"));
+    CHECK_FALSE(decoded.version.has_value());
+}
+
+TEST_CASE("The streaming decoder rejects malformed frames", "[wire_format]") {
+    auto const frame = GENERATE(as<std::string>{}, R"({"type": "Version", "payload": )",
+                                R"({"type": "Version", "payload": {"version": 1}})",
+                                R"({"type": "PushSettings", "payload": {"metrics": [1]}})",
+                                R"({"type": "PushSettings", "payload": {"metrics": [{}]}})");
+
+    CHECK_THROWS_AS(proto::decode(frame, proto::WireFormat::Json), nlohmann::json::exception);
+}
+
+TEST_CASE("The request id travels in the envelope, frozen frames included", "[wire_format]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    auto message = makeUpdates(10);
+    message.id = 1'234'567'890'123ULL;
+
+    auto const decoded = proto::decode(proto::encode(message, format), format);
+    CHECK(decoded.id == message.id);
+    CHECK(decoded.metrics == message.metrics);
+
+    // A shared frame, frozen without an id, gets the id of the request it answers spliced in
+    message.id.reset();
+    proto::Message const frozen{.type = message.type, .id = 42, .frame = proto::freeze(message)};
+    auto const spliced = proto::decode(proto::encode(frozen, format), format);
+    CHECK(spliced.id == 42U);
+    CHECK(spliced.type == message.type);
+    CHECK(spliced.version == message.version);
+    CHECK(spliced.metrics == message.metrics);
+
+    CHECK_THROWS_AS(proto::decode(R"({"type": "Version", "id": "1", "payload": {}})",
+                                  proto::WireFormat::Json),
+                    nlohmann::json::exception);
+}
+
+TEST_CASE("A batch carries its sub-messages in both wire formats", "[wire_format]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    auto updates = makeUpdates(10);
+    updates.id = 2;
+    proto::Message const batch{
+        .type = proto::MessageType::Batch,
+        .id = 1,
+        .messages = std::vector<proto::Message>{
+            proto::Message{.type = proto::MessageType::Version, .id = 3, .version = "0.1.0"},
+            proto::Message{.type = updates.type, .id = updates.id,
+                           .frame = proto::freeze(updates)}}};
+
+    auto decoded = proto::decode(proto::encode(batch, format), format);
+    CHECK(decoded.type == proto::MessageType::Batch);
+    CHECK(decoded.id == 1U);
+
+    auto const items = proto::unbatch(std::move(decoded));
+    REQUIRE(items.size() == 2);
+    REQUIRE(items[0].message.has_value());
+    CHECK(items[0].message->type == proto::MessageType::Version);
+    CHECK(items[0].message->id == 3U);
+    CHECK(items[0].message->version == "0.1.0");
+    REQUIRE(items[1].message.has_value());
+    CHECK(items[1].message->id == 2U);
+    CHECK(items[1].message->metrics == updates.metrics);
+}
+
+TEST_CASE("The decoder reads the entries of a batch one by one", "[wire_format]") {
+    auto decoded = proto::decode(R"({"type": "Batch", "payload": {"messages": [
+        {"type": "Version", "id": 1, "payload": {"version": "0.1.0"}},
+        42,
+        {"type": "Version", "payload": {"version": 1, "metrics": [{"name": "m"}]}},
+        [1, 2],
+        {"type": "Batch", "payload": {"messages": [{"type": "GetUpdates"}]}},
+        {"type": "GetUpdates", "id": 5}
+    ]}})",
+                                 proto::WireFormat::Json);
+
+    auto const items = proto::unbatch(std::move(decoded));
+    REQUIRE(items.size() == 6);
+    REQUIRE(items[0].message.has_value());
+    CHECK(items[0].message->id == 1U);
+    CHECK(items[0].message->version == "0.1.0");
+
+    for (std::size_t i : {1, 2, 3}) {
+        CHECK_FALSE(items[i].message.has_value());
+        CHECK_FALSE(items[i].error.empty());
+    }
+    // A nested batch is left to the handler, its entries are not decoded
+    REQUIRE(items[4].message.has_value());
+    CHECK(items[4].message->type == proto::MessageType::Batch);
+    CHECK_FALSE(items[4].message->entries.has_value());
+    REQUIRE(items[5].message.has_value());
+    CHECK(items[5].message->type == proto::MessageType::GetUpdates);
+    CHECK(items[5].message->id == 5U);
+}
+
+TEST_CASE("A batch past the size limit is rejected as a whole", "[wire_format]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    proto::Message batch{.type = proto::MessageType::Batch,
+                         .messages = std::vector<proto::Message>(
+                             proto::kMaxBatchSize,
+                             proto::Message{.type = proto::MessageType::GetUpdates})};
+
+    CHECK(proto::unbatch(proto::decode(proto::encode(batch, format), format)).size() ==
+          proto::kMaxBatchSize);
+
+    batch.messages->push_back(proto::Message{.type = proto::MessageType::GetUpdates});
+    CHECK_THROWS_AS(proto::decode(proto::encode(batch, format), format),
+                    nlohmann::json::out_of_range);
+    CHECK_THROWS_AS(proto::toMessage(proto::toEnvelopeJson(batch)), nlohmann::json::out_of_range);
+}
+
+TEST_CASE("Deflated frames round trip with and without context", "[wire_format]") {
+    auto const format = GENERATE(proto::WireFormat::Json, proto::WireFormat::MsgPack);
+    proto::CompressionSettings const settings{.enabled = true};
+    proto::Deflater deflater{settings};
+    proto::Inflater inflater;
+
+    // Shared frames are deflated without context and interleaved with the connection ones
+    auto const shared = proto::freeze(makeUpdates(100), settings);
+    REQUIRE_FALSE(shared->deflated(format).empty());
+
+    for (std::size_t i = 1; i <= 3; ++i) {
+        auto const bytes = proto::encode(makeUpdates(i * 50), format);
+        auto const *deflated = deflater.compress(bytes, format);
+        REQUIRE(deflated != nullptr);
+        CHECK(proto::isDeflated(*deflated, true));
+
+        auto const [inflated, inflatedFormat] = inflater.inflate(*deflated);
+        CHECK(inflated == bytes);
+        CHECK(inflatedFormat == format);
+
+        auto const [inflatedShared, _] = inflater.inflate(shared->deflated(format));
+        CHECK(inflatedShared == shared->bytes(format));
+    }
+    // Small frames go out as they are
+    CHECK(deflater.compress(proto::encode(proto::Message{}, format), format) == nullptr);
+}
+
+TEST_CASE("Corrupted deflated frames are rejected", "[wire_format]") {
+    proto::Inflater inflater;
+    std::string const frame{"\xC1\x00\xff\xff\xff\xff", 6};
+
+    CHECK_THROWS_AS(inflater.inflate(frame), proto::CompressionError);
+}
+
+TEST_CASE("Wire format: bytes and encode/decode time", "[wire_format][!benchmark]") {
+    auto const metricsCount = GENERATE(10, 1'000, 10'000);
+    auto const message = makeUpdates(metricsCount);
+    auto const json = proto::encode(message, proto::WireFormat::Json);
+    auto const msgPack = proto::encode(message, proto::WireFormat::MsgPack);
+
+    auto const frame = proto::freeze(message, proto::CompressionSettings{.enabled = true});
+
+    std::cout << std::format("{} metrics: json {} bytes, msgpack {} bytes ({:.1f}%), deflated "
+                             "json {} bytes, deflated msgpack {} bytes\n",
+                             metricsCount, json.size(), msgPack.size(),
+                             100.0 * msgPack.size() / json.size(), frame->deflatedJson.size(),
+                             frame->deflatedMsgPack.size());
+
+    BENCHMARK(std::format("encode json {}", metricsCount)) {
+        return proto::encode(message, proto::WireFormat::Json);
+    };
+    BENCHMARK(std::format("encode msgpack {}", metricsCount)) {
+        return proto::encode(message, proto::WireFormat::MsgPack);
+    };
+    BENCHMARK(std::format("decode json {}", metricsCount)) {
+        return proto::decode(json, proto::WireFormat::Json);
+    };
+    BENCHMARK(std::format("decode msgpack {}", metricsCount)) {
+        return proto::decode(msgPack, proto::WireFormat::MsgPack);
+    };
+}